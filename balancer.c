@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "net/net_util.h"
+
+#include "balancer.h"
+
+/* This thread's private picking state. */
+struct bal_view {
+        const struct balancer *bal;
+        unsigned int rr;
+        uint32_t rng;
+};
+
+static __thread struct bal_view bal_view;
+
+
+/* 64-bit FNV-1a of <b>n</b> bytes, mixed with the MurmurHash3 finalizer.
+ * Stable across runs, so consistent hashing survives restarts. */
+static uint64_t
+_bal_hash(const void *p, size_t n, uint64_t seed)
+{
+        const unsigned char *c = p;
+        uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                h ^= c[i];
+                h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+
+/*
+ * Hash the address (not the port) of client <b>addr</b>, as the key that
+ * keeps a client on the same upstream under BAL_MAGLEV.
+ */
+uint64_t
+balancer_key(const struct sockaddr *addr, socklen_t addrlen)
+{
+        if (addr->sa_family == AF_INET &&
+            addrlen >= (socklen_t) sizeof(struct sockaddr_in))
+                return _bal_hash(&((const struct sockaddr_in *)
+                                   addr)->sin_addr, 4, 0);
+        if (addr->sa_family == AF_INET6 &&
+            addrlen >= (socklen_t) sizeof(struct sockaddr_in6))
+                return _bal_hash(&((const struct sockaddr_in6 *)
+                                   addr)->sin6_addr, 16, 0);
+        return 0;
+}
+
+
+/* Parse "host:port", "[v6addr]:port", either followed by "/weight", into
+ * <b>up</b> and resolve it.  @return 0 on success, -1 on failure. */
+static int
+_bal_parse(struct upstream *up, const char *spec)
+{
+        const char *host = spec, *host_end, *port, *slash;
+        struct addrinfo hints, *res;
+        size_t len;
+        int err;
+
+        if (*spec == '[') {
+                host = spec + 1;
+                host_end = strchr(host, ']');
+                if (!host_end || host_end[1] != ':')
+                        return -1;
+                port = host_end + 2;
+        } else {
+                host_end = strrchr(spec, ':');
+                if (!host_end)
+                        return -1;
+                port = host_end + 1;
+        }
+        slash = strchr(port, '/');
+        up->weight = slash ? (unsigned int) atoi(slash + 1) : 1;
+        if (!up->weight)
+                up->weight = 1;
+        if (up->weight > BAL_MAX_WEIGHT)
+                up->weight = BAL_MAX_WEIGHT;
+
+        len = (size_t) (host_end - host);
+        if (len >= sizeof(up->host))
+                return -1;
+        memcpy(up->host, host, len);
+        up->host[len] = '\0';
+        len = slash ? (size_t) (slash - port) : strlen(port);
+        if (!len || len >= sizeof(up->port))
+                return -1;
+        memcpy(up->port, port, len);
+        up->port[len] = '\0';
+
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        err = getaddrinfo(up->host, up->port, &hints, &res);
+        if (err) {
+                net_error("Failed to resolve upstream %s: %s.\n", spec,
+                          gai_strerror(err));
+                return -1;
+        }
+        memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+        up->addrlen = res->ai_addrlen;
+        freeaddrinfo(res);
+        return 0;
+}
+
+
+static void
+_bal_table_free(struct bal_table *t)
+{
+        free(t->live);
+        free(t->slots);
+        free(t->maglev);
+        free(t);
+}
+
+
+/* Fill <b>t</b>'s Maglev lookup table from its live upstreams: each takes
+ * turns claiming its next preferred free entry, <b>weight</b> entries per
+ * round.  (Eisenbud et al., "Maglev", NSDI 2016.) */
+static int
+_bal_maglev_build(struct bal_table *t)
+{
+        uint32_t *offset, *skip, *next;
+        unsigned int i, w, filled = 0;
+        int err = -1;
+
+        t->maglev = calloc(BAL_MAGLEV_SIZE, sizeof(*t->maglev));
+        offset = calloc(t->nlive, sizeof(*offset));
+        skip = calloc(t->nlive, sizeof(*skip));
+        next = calloc(t->nlive, sizeof(*next));
+        if (!t->maglev || !offset || !skip || !next)
+                goto out;
+
+        for (i = 0; i < t->nlive; i++) {
+                struct upstream *up = t->live[i];
+                char name[BAL_HOST_MAX + BAL_PORT_MAX + 1];
+                size_t n;
+
+                n = (size_t) snprintf(name, sizeof(name), "%s:%s", up->host,
+                                      up->port);
+                offset[i] = (uint32_t) (_bal_hash(name, n, 1) %
+                                        BAL_MAGLEV_SIZE);
+                skip[i] = (uint32_t) (_bal_hash(name, n, 2) %
+                                      (BAL_MAGLEV_SIZE - 1)) + 1;
+        }
+
+        while (filled < BAL_MAGLEV_SIZE) {
+                for (i = 0; i < t->nlive; i++) {
+                        for (w = 0; w < t->live[i]->weight; w++) {
+                                uint32_t c;
+
+                                do {
+                                        c = (uint32_t) ((offset[i] +
+                                             (uint64_t) next[i] * skip[i]) %
+                                            BAL_MAGLEV_SIZE);
+                                        next[i]++;
+                                } while (t->maglev[c]);
+                                t->maglev[c] = t->live[i];
+                                if (++filled == BAL_MAGLEV_SIZE)
+                                        goto done;
+                        }
+                }
+        }
+ done:
+        err = 0;
+ out:
+        free(offset);
+        free(skip);
+        free(next);
+        return err;
+}
+
+
+/* Build and publish a table of the currently live upstreams.  Caller holds
+ * b->lock.  @return 0 on success, -1 if out of memory. */
+static int
+_bal_rebuild(struct balancer *b)
+{
+        struct bal_table *t, *old = b->table, **pp, *r;
+        unsigned int i, w, nslots = 0;
+        uint64_t now = net_now_ns();
+
+        t = calloc(1, sizeof(*t));
+        if (!t)
+                return -1;
+        t->live = calloc(b->nups, sizeof(*t->live));
+        for (i = 0; i < b->nups; i++)
+                nslots += b->ups[i].weight;
+        t->slots = calloc(nslots, sizeof(*t->slots));
+        if (!t->live || !t->slots)
+                goto err;
+
+        for (i = 0; i < b->nups; i++) {
+                struct upstream *up = &b->ups[i];
+
+                if (!__atomic_load_n(&up->live, __ATOMIC_RELAXED))
+                        continue;
+                t->live[t->nlive++] = up;
+                for (w = 0; w < up->weight; w++)
+                        t->slots[t->nslots++] = up;
+        }
+        if (b->policy == BAL_MAGLEV && t->nlive &&
+            _bal_maglev_build(t) < 0)
+                goto err;
+
+        /* Spread a weighted upstream's round robin slots out, so that it
+         * does not get its whole share in a burst. */
+        for (i = t->nslots; i > 1; i--) {
+                unsigned int j = (unsigned int) (_bal_hash(&i, sizeof(i), 3)
+                                                 % i);
+                struct upstream *tmp = t->slots[i - 1];
+
+                t->slots[i - 1] = t->slots[j];
+                t->slots[j] = tmp;
+        }
+
+        if (old) {
+                t->gen = old->gen + 1;
+                old->retired_ns = now;
+                t->retired = old;
+                /* Nobody is still reading tables replaced before the last
+                 * grace period. */
+                for (pp = &old->retired; (r = *pp) != NULL; ) {
+                        if (now - r->retired_ns > BAL_GRACE_NS) {
+                                *pp = r->retired;
+                                _bal_table_free(r);
+                        } else {
+                                pp = &r->retired;
+                        }
+                }
+        }
+        __atomic_store_n(&b->table, t, __ATOMIC_RELEASE);
+        return 0;
+
+ err:
+        _bal_table_free(t);
+        return -1;
+}
+
+
+/*
+ * Create a balancer choosing among the <b>nspecs</b> upstreams in
+ * <b>specs</b> ("host:port", optionally followed by "/weight") with
+ * <b>policy</b>, one of BAL_*.
+ * @return the balancer, or NULL on failure.
+ */
+struct balancer *
+balancer_create(int policy, const char *const *specs, unsigned int nspecs)
+{
+        struct balancer *b;
+        unsigned int i;
+
+        if (!nspecs || nspecs > BAL_MAX_UPSTREAMS)
+                return NULL;
+
+        b = calloc(1, sizeof(*b));
+        if (!b)
+                return NULL;
+        b->ups = aligned_alloc(64, nspecs * sizeof(*b->ups));
+        if (!b->ups) {
+                free(b);
+                return NULL;
+        }
+        memset(b->ups, 0, nspecs * sizeof(*b->ups));
+        b->policy = policy;
+        b->nups = nspecs;
+        pthread_mutex_init(&b->lock, NULL);
+
+        for (i = 0; i < nspecs; i++) {
+                if (_bal_parse(&b->ups[i], specs[i]) < 0) {
+                        net_error("Bad upstream: %s.\n", specs[i]);
+                        balancer_delete(b);
+                        return NULL;
+                }
+                b->ups[i].index = i;
+                b->ups[i].live = 1;
+        }
+
+        if (_bal_rebuild(b) < 0) {
+                balancer_delete(b);
+                return NULL;
+        }
+        return b;
+}
+
+
+/* Free <b>b</b>.  Nothing may be picking from it. */
+void
+balancer_delete(struct balancer *b)
+{
+        struct bal_table *t, *next;
+
+        for (t = b->table; t; t = next) {
+                next = t->retired;
+                _bal_table_free(t);
+        }
+        pthread_mutex_destroy(&b->lock);
+        free(b->ups);
+        free(b);
+}
+
+
+/*
+ * Mark <b>up</b> as able to take requests or not, and republish the table
+ * if that changed anything.
+ * @return 0 on success, -1 if out of memory (the old table stays).
+ */
+int
+balancer_set_live(struct balancer *b, struct upstream *up, int live)
+{
+        int err = 0;
+
+        pthread_mutex_lock(&b->lock);
+        if (up->live != !!live) {
+                __atomic_store_n(&up->live, !!live, __ATOMIC_RELAXED);
+                err = _bal_rebuild(b);
+                if (err < 0)
+                        __atomic_store_n(&up->live, !live, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&b->lock);
+        return err;
+}
+
+
+/* Whether <b>a</b> is less loaded than <b>c</b> for its weight. */
+static int
+_bal_lighter(const struct upstream *a, const struct upstream *c)
+{
+        uint64_t la = __atomic_load_n(&a->outstanding, __ATOMIC_RELAXED);
+        uint64_t lc = __atomic_load_n(&c->outstanding, __ATOMIC_RELAXED);
+
+        return la * c->weight < lc * a->weight;
+}
+
+
+/*
+ * Choose an upstream for a new request, counting it as outstanding until
+ * balancer_done().  <b>key</b> (see balancer_key()) only matters under
+ * BAL_MAGLEV.
+ * @return the upstream, or NULL if none is live.
+ */
+struct upstream *
+balancer_pick(struct balancer *b, uint64_t key)
+{
+        struct bal_view *v = &bal_view;
+        const struct bal_table *t;
+        struct upstream *up = NULL, *other;
+        unsigned int i, n;
+
+        if (v->bal != b) {
+                uint64_t seed = net_now_ns() ^ (uint64_t) (uintptr_t) v;
+
+                /* Threads start at different places in the rotation. */
+                v->bal = b;
+                v->rng = (uint32_t) _bal_hash(&seed, sizeof(seed), 4) | 1;
+                v->rr = v->rng >> 8;
+        }
+
+        t = __atomic_load_n(&b->table, __ATOMIC_ACQUIRE);
+        n = t->nlive;
+        if (!n)
+                return NULL;
+
+        switch (b->policy) {
+        case BAL_LEAST_OUTSTANDING:
+                /* Start somewhere new each time so ties spread out. */
+                up = t->live[v->rr++ % n];
+                for (i = 1; i < n; i++) {
+                        other = t->live[(v->rr + i) % n];
+                        if (_bal_lighter(other, up))
+                                up = other;
+                }
+                break;
+        case BAL_P2C:
+                /* xorshift32 */
+                v->rng ^= v->rng << 13;
+                v->rng ^= v->rng >> 17;
+                v->rng ^= v->rng << 5;
+                i = v->rng % n;
+                up = t->live[i];
+                if (n > 1) {
+                        /* A second, different one; keep the lighter. */
+                        other = t->live[(i + 1 + (v->rng >> 16) % (n - 1)) %
+                                        n];
+                        if (_bal_lighter(other, up))
+                                up = other;
+                }
+                break;
+        case BAL_MAGLEV:
+                up = t->maglev[key % BAL_MAGLEV_SIZE];
+                break;
+        case BAL_ROUND_ROBIN:
+        default:
+                up = t->slots[v->rr++ % t->nslots];
+                break;
+        }
+
+        __atomic_add_fetch(&up->outstanding, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&up->picks, 1, __ATOMIC_RELAXED);
+        return up;
+}
+
+
+/* The request sent to <b>up</b> finished, <b>failed</b> or not. */
+void
+balancer_done(struct balancer *b, struct upstream *up, int failed)
+{
+        (void) b;
+        __atomic_sub_fetch(&up->outstanding, 1, __ATOMIC_RELAXED);
+        if (failed)
+                __atomic_add_fetch(&up->failures, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,84 @@
+/* Choosing an upstream for each proxied request.
+ *
+ * Upstreams are fixed once the balancer is built; which of them are live
+ * is published as an immutable table that pickers read without locks.
+ * Each worker thread keeps its own view (round robin cursor, random state)
+ * so that picking never writes to a shared cache line other than the
+ * chosen upstream's outstanding request count. */
+
+#ifndef _BALANCER_H
+#define _BALANCER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define BAL_ROUND_ROBIN 0
+#define BAL_LEAST_OUTSTANDING 1
+#define BAL_P2C 2
+#define BAL_MAGLEV 3
+
+#define BAL_MAX_UPSTREAMS 256
+/* Maglev lookup table size; a prime well above 100 times the upstreams
+ * keeps the load imbalance under about one percent. */
+#define BAL_MAGLEV_SIZE 65537
+
+/* A table replaced this long ago is no longer being read by anyone. */
+#define BAL_GRACE_NS (1000 * 1000 * 1000)
+#define BAL_MAX_WEIGHT 100
+
+#define BAL_HOST_MAX 256
+#define BAL_PORT_MAX 16
+
+struct upstream {
+        char host[BAL_HOST_MAX];
+        char port[BAL_PORT_MAX];
+        /* Resolved once when the balancer is built. */
+        struct sockaddr_storage addr;
+        socklen_t addrlen;
+        unsigned int weight;
+        unsigned int index;
+
+        /* Requests in flight, across all workers. */
+        unsigned int outstanding;
+        int live;
+        unsigned long picks;
+        unsigned long failures;
+} __attribute__ ((aligned(64)));
+
+/* What pickers see; replaced as a whole whenever an upstream goes up or
+ * down. */
+struct bal_table {
+        uint64_t gen;
+        unsigned int nlive;
+        struct upstream **live;
+        /* Live upstreams repeated by weight, for round robin. */
+        unsigned int nslots;
+        struct upstream **slots;
+        /* BAL_MAGLEV only. */
+        struct upstream **maglev;
+        /* Older tables readers may still be using, and when this one was
+         * replaced. */
+        struct bal_table *retired;
+        uint64_t retired_ns;
+};
+
+struct balancer {
+        int policy;
+        struct upstream *ups;
+        unsigned int nups;
+        struct bal_table *table;
+        /* Serialises table rebuilds; pickers never take it. */
+        pthread_mutex_t lock;
+};
+
+struct balancer *balancer_create(int policy, const char *const *specs,
+                                 unsigned int nspecs);
+void balancer_delete(struct balancer *b);
+struct upstream *balancer_pick(struct balancer *b, uint64_t key);
+void balancer_done(struct balancer *b, struct upstream *up, int failed);
+int balancer_set_live(struct balancer *b, struct upstream *up, int live);
+uint64_t balancer_key(const struct sockaddr *addr, socklen_t addrlen);
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "net/net_util.h"
+
+#include "capture.h"
+
+
+/*
+ * Start a capture into <b>path</b>, replacing it, of at most <b>size</b>
+ * bytes (0 for CAPTURE_DEFAULT_SIZE).  Records that do not fit any more
+ * are dropped.
+ * @return the capture, or NULL on failure.
+ */
+struct capture *
+capture_open(const char *path, size_t size)
+{
+        struct capture *cap;
+        struct capture_header *h;
+        struct timespec ts;
+
+        if (!size)
+                size = CAPTURE_DEFAULT_SIZE;
+        cap = calloc(1, sizeof(*cap));
+        if (!cap)
+                return NULL;
+        cap->size = size;
+        cap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (cap->fd < 0) {
+                net_error("Couldn't create capture %s: %s.\n", path,
+                          strerror(errno));
+                free(cap);
+                return NULL;
+        }
+        /* Sparse until written to. */
+        if (ftruncate(cap->fd, (off_t) size) < 0)
+                goto err;
+        cap->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        cap->fd, 0);
+        if (cap->map == MAP_FAILED)
+                goto err;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h = (struct capture_header *) cap->map;
+        memcpy(h->magic, CAPTURE_MAGIC, sizeof(h->magic));
+        h->start_real_ns = (uint64_t) ts.tv_sec * 1000000000u +
+                           (uint64_t) ts.tv_nsec;
+        cap->start_ns = net_now_ns();
+        cap->off = sizeof(*h);
+        return cap;
+
+ err:
+        net_error("Couldn't map capture %s: %s.\n", path, strerror(errno));
+        close(cap->fd);
+        free(cap);
+        return NULL;
+}
+
+
+/* Finish the capture: trim the file to what was recorded and free it.
+ * Nobody may record meanwhile. */
+void
+capture_close(struct capture *cap)
+{
+        struct capture_header *h = (struct capture_header *) cap->map;
+        uint64_t end = cap->off < cap->size ? cap->off : cap->size;
+
+        h->used = end - sizeof(*h);
+        munmap(cap->map, cap->size);
+        if (ftruncate(cap->fd, (off_t) end) < 0)
+                net_warn("Couldn't trim capture: %s.\n", strerror(errno));
+        close(cap->fd);
+        if (cap->dropped)
+                net_warn("Capture full; dropped %lu records.\n",
+                         cap->dropped);
+        free(cap);
+}
+
+
+/* @return a new connection number for <b>cap</b>. */
+uint32_t
+capture_conn(struct capture *cap)
+{
+        return __atomic_add_fetch(&cap->next_conn, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Append a record of <b>type</b> for connection <b>conn</b> carrying
+ * <b>len</b> bytes of <b>data</b>.  Safe from any thread. */
+void
+capture_record(struct capture *cap, uint32_t conn, uint32_t type,
+               const void *data, size_t len)
+{
+        struct capture_rec *rec;
+        size_t need = sizeof(*rec) + CAPTURE_ALIGN(len);
+        uint64_t off;
+
+        if (len > UINT32_MAX) {
+                __atomic_add_fetch(&cap->dropped, 1, __ATOMIC_RELAXED);
+                return;
+        }
+        off = __atomic_fetch_add(&cap->off, need, __ATOMIC_RELAXED);
+        if (off + need > cap->size) {
+                __atomic_add_fetch(&cap->dropped, 1, __ATOMIC_RELAXED);
+                return;
+        }
+
+        rec = (struct capture_rec *) (cap->map + off);
+        rec->t_ns = net_now_ns() - cap->start_ns;
+        rec->conn = conn;
+        rec->len = (uint32_t) len;
+        if (len)
+                memcpy(rec + 1, data, len);
+        /* Last, so that a reader of a live capture stops short of a half
+         * written record rather than read it. */
+        __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+}
+
+
+/* Map the capture at <b>path</b> for reading.  @return 0, or a negative
+ * errno (-EINVAL if it is not a capture). */
+int
+capture_reader_open(struct capture_reader *r, const char *path)
+{
+        const struct capture_header *h;
+        struct stat st;
+        int fd, err = 0;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+        if (fstat(fd, &st) < 0) {
+                err = -errno;
+                goto out;
+        }
+        if ((size_t) st.st_size < sizeof(*h)) {
+                err = -EINVAL;
+                goto out;
+        }
+        r->map_size = r->size = (size_t) st.st_size;
+        r->map = mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r->map == MAP_FAILED) {
+                err = -errno;
+                goto out;
+        }
+        h = (const struct capture_header *) r->map;
+        if (memcmp(h->magic, CAPTURE_MAGIC, sizeof(h->magic)) != 0) {
+                munmap((void *) r->map, r->map_size);
+                err = -EINVAL;
+                goto out;
+        }
+        /* An unfinished capture has used 0 and runs to the first empty
+         * record. */
+        if (h->used && h->used <= r->size - sizeof(*h))
+                r->size = sizeof(*h) + h->used;
+        r->off = sizeof(*h);
+ out:
+        close(fd);
+        return err;
+}
+
+
+void
+capture_reader_close(struct capture_reader *r)
+{
+        munmap((void *) r->map, r->map_size);
+}
+
+
+/* @return the next record of <b>r</b>, its data right after it, or NULL
+ * at the end. */
+const struct capture_rec *
+capture_next(struct capture_reader *r)
+{
+        const struct capture_rec *rec;
+
+        if (r->off + sizeof(*rec) > r->size)
+                return NULL;
+        rec = (const struct capture_rec *) (r->map + r->off);
+        if (rec->type == 0 ||
+            r->off + sizeof(*rec) + CAPTURE_ALIGN(rec->len) > r->size)
+                return NULL;
+        r->off += sizeof(*rec) + CAPTURE_ALIGN(rec->len);
+        return rec;
+}
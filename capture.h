@@ -0,0 +1,76 @@
+/* Capture of the bytes clients send, for replaying them later.
+ *
+ * A capture file is a header followed by records, each an 8-byte aligned
+ * struct capture_rec and its data, in native byte order.  The file is
+ * sized up front and mapped shared; writers reserve space with one atomic
+ * add and copy straight into the mapping, so any thread may record at any
+ * time.  Records of one connection appear in the order they were made;
+ * records of different connections may be slightly out of time order.  A
+ * zeroed record (type 0) ends the file early. */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "NBCAPT01"
+#define CAPTURE_DEFAULT_SIZE (256 * 1024 * 1024)
+
+/* Record types. */
+#define CAPTURE_OPEN 1
+#define CAPTURE_DATA 2
+#define CAPTURE_CLOSE 3
+
+struct capture_header {
+        char magic[8];
+        /* CLOCK_REALTIME ns when the capture started, for reference. */
+        uint64_t start_real_ns;
+        /* Bytes of records that follow. */
+        uint64_t used;
+};
+
+struct capture_rec {
+        /* ns since the capture started. */
+        uint64_t t_ns;
+        /* Numbered from 1 in order of CAPTURE_OPEN. */
+        uint32_t conn;
+        uint32_t type;
+        /* Bytes of data following the record, before padding. */
+        uint32_t len;
+        uint32_t pad;
+};
+
+#define CAPTURE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+struct capture {
+        int fd;
+        char *map;
+        size_t size;
+        uint64_t start_ns;
+        /* Next free byte of the mapping; may run past size once full. */
+        uint64_t off;
+        uint32_t next_conn;
+        unsigned long dropped;
+};
+
+struct capture *capture_open(const char *path, size_t size);
+void capture_close(struct capture *cap);
+uint32_t capture_conn(struct capture *cap);
+void capture_record(struct capture *cap, uint32_t conn, uint32_t type,
+                    const void *data, size_t len);
+
+/* Reading a finished capture. */
+struct capture_reader {
+        const char *map;
+        size_t map_size;
+        /* End of the records. */
+        size_t size;
+        size_t off;
+};
+
+int capture_reader_open(struct capture_reader *r, const char *path);
+void capture_reader_close(struct capture_reader *r);
+const struct capture_rec *capture_next(struct capture_reader *r);
+
+#endif
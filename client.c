@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h> // memset
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "net/net_util.h"
 #include "net/net_compat.h"
@@ -15,37 +19,23 @@
 
 
 /*
- * Open a non-blocking connected tcp socket and return it's fd.
+ * Open a non-blocking tcp socket tuned with <b>prof</b> (may be NULL) and
+ * start connecting it to <b>addr</b>.  The connection may still be in
+ * progress on return; see client_connect_wait().
  *
  * @return net_socket_fd_t, the socket file descriptor.
  *      Returns the macro NET_INVALID_SOCKET on failure.  No outstanding
  *      memory or sockets on failure.
  */
 net_socket_fd_t
-_client_tcp_connect(char *server_ip, char *server_port)
+_client_tcp_connect_addr(const struct sockaddr *addr, socklen_t addrlen,
+                         const struct net_sockopt_profile *prof)
 {
         net_socket_fd_t sock_fd;
         int err;
-        struct addrinfo *server;
-        struct addrinfo hints;
-
-        /* The hints struct is used to specify what kind of server info we are
-         * looking for--TCP/IP for this server example. */
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-
-        /* getaddrinfo() gives us back a server address we can connect to.
-           The first parameter is NULL since we want an address on this host.
-           It actually gives us a linked list of addresses, but we'll just
-           use the first. */
-        if ( getaddrinfo(server_ip, server_port, &hints, &server) ) {
-                net_error("Failed to get addrinfo.\n");
-                return NET_INVALID_SOCKET;
-        }
 
-        sock_fd = net_socket_nonblocking(server->ai_family, server->ai_socktype,
-                                         server->ai_protocol);
+        sock_fd = net_socket_nonblocking_tuned(addr->sa_family, SOCK_STREAM,
+                                               0, prof, NET_SOCKOPT_CLIENT);
 
         if ( !NET_SOCKET_OK(sock_fd) ) {
                 /* We use the following macro to read errno. */
@@ -57,7 +47,6 @@ _client_tcp_connect(char *server_ip, char *server_port)
                         net_error("Socket creation failed: %s.\n",
                                   net_socket_strerror(err));
                 }
-                freeaddrinfo(server);
                 return NET_INVALID_SOCKET;
         }
 
@@ -76,8 +65,7 @@ _client_tcp_connect(char *server_ip, char *server_port)
         }
 #endif
 
-        err = connect(sock_fd, server->ai_addr, server->ai_addrlen);
-        freeaddrinfo(server);
+        err = connect(sock_fd, addr, addrlen);
         if(err < 0) {
                 err = net_socket_errno(sock_fd);
                 /* Is this a real error or just an non-blocking error? */
@@ -104,6 +92,92 @@ _client_tcp_connect(char *server_ip, char *server_port)
 }
 
 
+/*
+ * Open a non-blocking connected tcp socket and return it's fd.  The socket
+ * is tuned with <b>prof</b> (may be NULL) before connecting; with Fast Open
+ * enabled the SYN is only sent along with the first write.
+ *
+ * @return net_socket_fd_t, the socket file descriptor.
+ *      Returns the macro NET_INVALID_SOCKET on failure.  No outstanding
+ *      memory or sockets on failure.
+ */
+net_socket_fd_t
+_client_tcp_connect(char *server_ip, char *server_port,
+                    const struct net_sockopt_profile *prof)
+{
+        net_socket_fd_t sock_fd;
+        struct addrinfo *server;
+        struct addrinfo hints;
+
+        /* The hints struct is used to specify what kind of server info we are
+         * looking for--TCP/IP for this server example. */
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        /* getaddrinfo() gives us back a server address we can connect to.
+           The first parameter is NULL since we want an address on this host.
+           It actually gives us a linked list of addresses, but we'll just
+           use the first. */
+        if ( getaddrinfo(server_ip, server_port, &hints, &server) ) {
+                net_error("Failed to get addrinfo.\n");
+                return NET_INVALID_SOCKET;
+        }
+
+        sock_fd = _client_tcp_connect_addr(server->ai_addr,
+                                           server->ai_addrlen, prof);
+        freeaddrinfo(server);
+        return sock_fd;
+}
+
+
+/*
+ * Connect a non-blocking AF_UNIX socket of <b>type</b> (SOCK_STREAM or
+ * SOCK_SEQPACKET) to <b>path</b>, "@name" for the abstract namespace,
+ * tuned with <b>prof</b> (may be NULL).  Same-host servers are reached
+ * without going through the TCP/IP stack.
+ *
+ * @return net_socket_fd_t, the socket file descriptor.
+ *      Returns the macro NET_INVALID_SOCKET on failure.
+ */
+net_socket_fd_t
+_client_unix_connect(const char *path, int type,
+                     const struct net_sockopt_profile *prof)
+{
+        net_socket_fd_t sock_fd;
+
+        sock_fd = net_unix_connect(path, type, prof);
+        if ( !NET_SOCKET_OK(sock_fd) )
+                net_error("connect() to %s failed: %s.\n", path,
+                          strerror(errno));
+        return sock_fd;
+}
+
+
+/*
+ * Wait up to <b>timeout_ms</b> for the non-blocking connect() on
+ * <b>sock_fd</b> to finish.
+ * @return 0 once connected, otherwise the negative error code
+ *      (-ETIMEDOUT if it took too long).
+ */
+int
+client_connect_wait(net_socket_fd_t sock_fd, int timeout_ms)
+{
+        int err = 0;
+        socklen_t len = (socklen_t) sizeof(err);
+        int r;
+
+        r = net_wait(sock_fd, POLLOUT, timeout_ms);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return -ETIMEDOUT;
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) < 0)
+                return -net_socket_errno(sock_fd);
+        return -err;
+}
+
+
 int
 _client_tcp_loop(struct _server_vars *s_vars, int sock_fd)
 {
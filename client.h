@@ -0,0 +1,14 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+net_socket_fd_t _client_tcp_connect_addr(const struct sockaddr *addr,
+                                socklen_t addrlen,
+                                const struct net_sockopt_profile *prof);
+net_socket_fd_t _client_tcp_connect(char *server_ip, char *server_port,
+                                    const struct net_sockopt_profile *prof);
+net_socket_fd_t _client_unix_connect(const char *path, int type,
+                                     const struct net_sockopt_profile *prof);
+int client_connect_wait(net_socket_fd_t sock_fd, int timeout_ms);
+int client_start(char *server_ip, char *server_port);
+
+#endif
@@ -0,0 +1,50 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+#include "net/net_trace.h"
+
+#include "conn.h"
+
+
+/*
+ * Wrap the accepted socket <b>fd</b> from peer <b>addr</b>.
+ * @return the connection, or NULL if out of memory.  The fd is not closed
+ *      on failure.
+ */
+struct conn *
+conn_new(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        struct conn *c;
+
+        c = calloc(1, sizeof(*c));
+        if (!c)
+                return NULL;
+
+        c->fd = fd;
+        c->wait_fd = -1;
+        c->ev_fd = -1;
+        if (addr && addrlen <= sizeof(c->addr)) {
+                memcpy(&c->addr, addr, addrlen);
+                c->addrlen = addrlen;
+        }
+        return c;
+}
+
+
+/* Close the connection's socket and free it. */
+void
+conn_free(struct conn *c)
+{
+        if (NET_SOCKET_OK(c->fd)) {
+                net_trace(NET_TRACE_CLOSE, c->fd);
+                net_socket_close(c->fd);
+        }
+        free(c);
+}
@@ -0,0 +1,67 @@
+/* A client connection as it travels from the acceptor to a worker. */
+
+#ifndef _CONN_H
+#define _CONN_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct coro;
+struct evloop;
+struct net_batch;
+
+struct conn {
+        /* Link for whichever queue the connection is waiting in. */
+        struct conn *next;
+        int fd;
+        socklen_t addrlen;
+        struct sockaddr_storage addr;
+
+        /* Server that accepted the connection. */
+        void *srv;
+        /* Coroutine running the handler, once a worker has started it. */
+        struct coro *co;
+        /* Small writes to the client not sent yet, if the server batches
+         * them. */
+        struct net_batch *batch;
+        /* Priority class the scheduler queues it in, one of
+         * SCHED_CLASS_*; see _server_vars.prio. */
+        unsigned int prio;
+        /* Hold the handler off this long after it starts, in ms. */
+        unsigned int delay_ms;
+        /* Queued to move its wait, not to run: whichever worker takes it
+         * arms it in its own loop. */
+        int migrating;
+
+        /* What the suspended handler is waiting for; see evloop_arm(). */
+        int wait_fd;
+        int wait_events;
+        /* As net_wait(): 1 ready, 0 timed out, negative errno. */
+        int wait_result;
+        /* CLOCK_MONOTONIC ns, or 0 to wait forever. */
+        uint64_t wait_deadline;
+
+        /* Event loop holding an epoll registration for ev_fd, if any,
+         * and the connection's slot there while it waits.  Only the worker
+         * that owns that loop touches the slot. */
+        struct evloop *loop;
+        int ev_fd;
+        unsigned int wslot;
+
+        /* CLOCK_MONOTONIC ns, while the server records latency: when
+         * accept() returned it and it was queued, when a worker first
+         * picked it up, and when its first byte reached the kernel (0 if
+         * unknown). */
+        uint64_t t_accept;
+        uint64_t t_start;
+        uint64_t t_rx;
+
+        /* Number of the connection in the server's capture, if any. */
+        uint32_t capture_id;
+};
+
+struct conn *conn_new(int fd, const struct sockaddr *addr, socklen_t addrlen);
+void conn_free(struct conn *c);
+
+#endif
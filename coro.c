@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "net/net_util.h"
+
+#include "coro.h"
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#define CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+/* The coroutine running on this thread, if any. */
+static __thread struct coro *coro_running;
+/* Stacks of finished coroutines, ready for reuse by this thread. */
+static __thread struct coro *coro_pool;
+static __thread unsigned int coro_pool_len;
+
+void _coro_main(struct coro *co) __attribute__ ((noreturn, used));
+
+#if defined(__x86_64__)
+/* void _coro_switch(void **save_sp, void *load_sp)
+ *
+ * Push the SysV callee-saved registers, swap stacks and pop the other
+ * side's.  A fresh stack is laid out so that the final ret lands in
+ * _coro_trampoline with the coroutine in r12. */
+void _coro_switch(void **save_sp, void *load_sp);
+__asm__ (
+        ".text\n"
+        ".p2align 4\n"
+        "_coro_switch:\n"
+        "        pushq %rbp\n"
+        "        pushq %rbx\n"
+        "        pushq %r12\n"
+        "        pushq %r13\n"
+        "        pushq %r14\n"
+        "        pushq %r15\n"
+        "        movq %rsp, (%rdi)\n"
+        "        movq %rsi, %rsp\n"
+        "        popq %r15\n"
+        "        popq %r14\n"
+        "        popq %r13\n"
+        "        popq %r12\n"
+        "        popq %rbx\n"
+        "        popq %rbp\n"
+        "        ret\n"
+        "_coro_trampoline:\n"
+        "        movq %r12, %rdi\n"
+        "        call _coro_main\n"
+        "        ud2\n"
+);
+void _coro_trampoline(void);
+
+/* Registers popped by _coro_switch, then its return address. */
+#define CORO_FRAME_WORDS 7
+#define CORO_FRAME_ARG 3
+
+#elif defined(__aarch64__)
+void _coro_switch(void **save_sp, void *load_sp);
+__asm__ (
+        ".text\n"
+        ".p2align 4\n"
+        "_coro_switch:\n"
+        "        sub sp, sp, #160\n"
+        "        stp x19, x20, [sp, #0]\n"
+        "        stp x21, x22, [sp, #16]\n"
+        "        stp x23, x24, [sp, #32]\n"
+        "        stp x25, x26, [sp, #48]\n"
+        "        stp x27, x28, [sp, #64]\n"
+        "        stp x29, x30, [sp, #80]\n"
+        "        stp d8, d9, [sp, #96]\n"
+        "        stp d10, d11, [sp, #112]\n"
+        "        stp d12, d13, [sp, #128]\n"
+        "        stp d14, d15, [sp, #144]\n"
+        "        mov x2, sp\n"
+        "        str x2, [x0]\n"
+        "        mov sp, x1\n"
+        "        ldp x19, x20, [sp, #0]\n"
+        "        ldp x21, x22, [sp, #16]\n"
+        "        ldp x23, x24, [sp, #32]\n"
+        "        ldp x25, x26, [sp, #48]\n"
+        "        ldp x27, x28, [sp, #64]\n"
+        "        ldp x29, x30, [sp, #80]\n"
+        "        ldp d8, d9, [sp, #96]\n"
+        "        ldp d10, d11, [sp, #112]\n"
+        "        ldp d12, d13, [sp, #128]\n"
+        "        ldp d14, d15, [sp, #144]\n"
+        "        add sp, sp, #160\n"
+        "        ret\n"
+        "_coro_trampoline:\n"
+        "        mov x0, x19\n"
+        "        bl _coro_main\n"
+        "        brk #0\n"
+);
+void _coro_trampoline(void);
+
+/* 20 saved registers; x19 is word 0 and x30 (the return address) 11. */
+#define CORO_FRAME_WORDS 20
+#define CORO_FRAME_ARG 0
+#define CORO_FRAME_LR 11
+#endif
+
+#ifdef CORO_UCONTEXT
+/* Portable but slow: swapcontext() saves the signal mask with a syscall.
+ * The sp fields then point at ucontext_t's stored after struct coro. */
+static __thread struct coro *coro_starting;
+
+static void
+_coro_uc_entry(void)
+{
+        _coro_main(coro_starting);
+}
+
+static void
+_coro_switch(void **save_sp, void *load_sp)
+{
+        swapcontext((ucontext_t *) *save_sp, (ucontext_t *) load_sp);
+}
+#endif
+
+
+/* Never inlined, so that a coroutine which moved to another thread while
+ * suspended does not reuse the old thread's TLS address. */
+__attribute__ ((noinline)) struct coro *
+coro_current(void)
+{
+        return coro_running;
+}
+
+
+__attribute__ ((noinline)) static void
+_coro_set_current(struct coro *co)
+{
+        coro_running = co;
+}
+
+
+void
+_coro_main(struct coro *co)
+{
+        co->fn(co->arg);
+        co->done = 1;
+        _coro_switch(&co->sp, co->caller_sp);
+        /* A finished coroutine is never resumed. */
+        abort();
+}
+
+
+/* Get a stack with a struct coro living at its top, reusing one from this
+ * thread's pool when possible. */
+static struct coro *
+_coro_stack_get(void)
+{
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t size = CORO_STACK_SIZE + page;
+        struct coro *co;
+        char *base;
+
+        co = coro_pool;
+        if (co) {
+                coro_pool = co->next;
+                coro_pool_len--;
+                return co;
+        }
+
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (base == MAP_FAILED)
+                return NULL;
+        /* Stacks grow down; overflowing into the guard page faults instead
+         * of silently corrupting the neighbouring mapping. */
+        if (mprotect(base, page, PROT_NONE) < 0) {
+                munmap(base, size);
+                return NULL;
+        }
+
+        co = (struct coro *) (base + size) - 1;
+#ifdef CORO_UCONTEXT
+        co = (struct coro *) ((char *) co - 2 * sizeof(ucontext_t));
+#endif
+        co->stack = base;
+        co->stack_size = size;
+        return co;
+}
+
+
+/*
+ * Create a coroutine that will run <b>fn</b>(<b>arg</b>) once resumed.
+ * Returns NULL if no stack could be mapped.
+ */
+struct coro *
+coro_create(void (*fn)(void *arg), void *arg)
+{
+        struct coro *co = _coro_stack_get();
+        void *stack, *size;
+
+        if (!co)
+                return NULL;
+
+        stack = co->stack;
+        size = (void *) co->stack_size;
+        memset(co, 0, sizeof(*co));
+        co->stack = stack;
+        co->stack_size = (size_t) size;
+        co->fn = fn;
+        co->arg = arg;
+
+#ifdef CORO_UCONTEXT
+        {
+                ucontext_t *uc = (ucontext_t *) (co + 1);
+                size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+                getcontext(uc);
+                uc->uc_stack.ss_sp = (char *) co->stack + page;
+                uc->uc_stack.ss_size = (size_t) ((char *) co - (char *)
+                                                 uc->uc_stack.ss_sp);
+                uc->uc_link = NULL;
+                makecontext(uc, _coro_uc_entry, 0);
+                co->sp = uc;
+                co->caller_sp = uc + 1;
+        }
+#else
+        {
+                /* The frame sits just below struct coro, 16 byte aligned
+                 * once _coro_switch has popped it. */
+                uintptr_t top = ((uintptr_t) co) & ~(uintptr_t) 15;
+                void **frame;
+
+#if defined(__x86_64__)
+                /* Return address at top - 8 leaves rsp 16 byte aligned
+                 * after the ret, as the trampoline's call expects. */
+                frame = (void **) (top - 8) - (CORO_FRAME_WORDS - 1);
+                memset(frame, 0, CORO_FRAME_WORDS * sizeof(void *));
+                frame[CORO_FRAME_WORDS - 1] = (void *) &_coro_trampoline;
+#else
+                frame = (void **) top - CORO_FRAME_WORDS;
+                memset(frame, 0, CORO_FRAME_WORDS * sizeof(void *));
+                frame[CORO_FRAME_LR] = (void *) &_coro_trampoline;
+#endif
+                frame[CORO_FRAME_ARG] = co;
+                co->sp = frame;
+        }
+#endif
+        return co;
+}
+
+
+/*
+ * Run <b>co</b> on the calling thread until it yields or returns.
+ * Returns 1 if it finished, in which case it must be coro_free()'d,
+ * and 0 if it yielded.
+ */
+int
+coro_resume(struct coro *co)
+{
+        struct coro *prev = coro_current();
+
+#ifdef CORO_UCONTEXT
+        coro_starting = co;
+#endif
+        _coro_set_current(co);
+        _coro_switch(&co->caller_sp, co->sp);
+        _coro_set_current(prev);
+
+        return co->done;
+}
+
+
+/* Suspend the running coroutine and return to whoever resumed it. */
+void
+coro_yield(void)
+{
+        /* Keep co in a local: after the switch we may be on another
+         * thread. */
+        struct coro *co = coro_current();
+
+        if (PREDICT_UNLIKELY(!co)) {
+                net_error("coro_yield() called outside a coroutine.\n");
+                abort();
+        }
+        _coro_switch(&co->sp, co->caller_sp);
+}
+
+
+/* Release the stack of a finished (or never started) coroutine, or of one
+ * that will never be resumed. */
+void
+coro_free(struct coro *co)
+{
+        if (coro_pool_len < CORO_POOL_MAX) {
+                co->next = coro_pool;
+                coro_pool = co;
+                coro_pool_len++;
+                return;
+        }
+        munmap(co->stack, co->stack_size);
+}
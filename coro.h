@@ -0,0 +1,38 @@
+/* Stackful coroutines.
+ *
+ * Each coroutine runs on a small pooled stack with a guard page below it.
+ * Switching saves only the callee-saved registers, so a switch costs a few
+ * nanoseconds rather than the signal mask syscall of swapcontext().  A
+ * suspended coroutine may be resumed from any thread, so code that yields
+ * must not hold locks or pointers to thread-local data across the yield. */
+
+#ifndef _CORO_H
+#define _CORO_H
+
+#include <stddef.h>
+
+#define CORO_STACK_SIZE (64 * 1024)
+/* Free stacks kept per thread; beyond this they are unmapped. */
+#define CORO_POOL_MAX 256
+
+struct coro {
+        /* Saved stack pointers of the coroutine and of whoever resumed it. */
+        void *sp;
+        void *caller_sp;
+        void (*fn)(void *arg);
+        void *arg;
+        int done;
+        /* Base of the mapping, including the guard page. */
+        void *stack;
+        size_t stack_size;
+        /* Free list link in the stack pool. */
+        struct coro *next;
+};
+
+struct coro *coro_create(void (*fn)(void *arg), void *arg);
+int coro_resume(struct coro *co);
+void coro_yield(void);
+struct coro *coro_current(void);
+void coro_free(struct coro *co);
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "dispatch.h"
+
+/* What one rule makes of the bytes so far. */
+#define _DISPATCH_NO 0
+#define _DISPATCH_YES 1
+#define _DISPATCH_MORE 2
+
+/* Longest HTTP method we wait for before deciding it is not HTTP. */
+#define _DISPATCH_METHOD_MAX 16
+
+
+/*
+ * Create a dispatcher picking <b>fallback</b> when no rule matches, and
+ * when the client has not said enough within <b>timeout_ms</b> (0 for
+ * DISPATCH_DEFAULT_TIMEOUT_MS).
+ * @return the dispatcher, or NULL if out of memory.
+ */
+struct dispatch *
+dispatch_create(void *fallback, int timeout_ms)
+{
+        struct dispatch *d;
+
+        d = calloc(1, sizeof(*d));
+        if (!d)
+                return NULL;
+        d->fallback = fallback;
+        d->timeout_ms = timeout_ms > 0 ? timeout_ms
+                                       : DISPATCH_DEFAULT_TIMEOUT_MS;
+        return d;
+}
+
+
+void
+dispatch_free(struct dispatch *d)
+{
+        free(d);
+}
+
+
+/*
+ * Route connections matching <b>match</b> by <b>kind</b> (one of
+ * DISPATCH_*) to <b>target</b>.  <b>len</b> is the length of a
+ * DISPATCH_MAGIC; 0 takes <b>match</b> as a string.
+ * @return 0, or -1 if the rule is too long or there are too many.
+ */
+int
+dispatch_add(struct dispatch *d, int kind, const void *match, size_t len,
+             void *target)
+{
+        struct dispatch_rule *r;
+
+        if (!len)
+                len = strlen((const char *) match);
+        if (d->nrules >= DISPATCH_MAX_RULES || len >= DISPATCH_NAME_MAX ||
+            len > DISPATCH_PEEK_MAX || !len)
+                return -1;
+
+        r = &d->rules[d->nrules];
+        r->kind = kind;
+        memcpy(r->match, match, len);
+        r->match[len] = '\0';
+        r->len = len;
+        r->target = target;
+        r->hits = 0;
+        d->nrules++;
+        return 0;
+}
+
+
+/* Does <b>buf</b> start with <b>r</b>'s bytes? */
+static int
+_dispatch_prefix(const struct dispatch_rule *r, const char *buf, size_t len)
+{
+        size_t n = len < r->len ? len : r->len;
+
+        if (memcmp(buf, r->match, n) != 0)
+                return _DISPATCH_NO;
+        return n == r->len ? _DISPATCH_YES : _DISPATCH_MORE;
+}
+
+
+/* Does the request line in <b>buf</b> ask for a path under <b>r</b>? */
+static int
+_dispatch_path(const struct dispatch_rule *r, const char *buf, size_t len)
+{
+        size_t i;
+
+        if (!len)
+                return _DISPATCH_MORE;
+        for (i = 0; i < len && i <= _DISPATCH_METHOD_MAX; i++) {
+                if (buf[i] == ' ')
+                        break;
+                if (buf[i] < 'A' || buf[i] > 'Z')
+                        return _DISPATCH_NO;
+        }
+        if (i > _DISPATCH_METHOD_MAX || i == 0)
+                return _DISPATCH_NO;
+        if (i == len)
+                return _DISPATCH_MORE;
+        return _dispatch_prefix(r, buf + i + 1, len - i - 1);
+}
+
+
+/* Is <b>name</b> the server name <b>r</b> wants? */
+static int
+_dispatch_sni(const struct dispatch_rule *r, const char *name, size_t len)
+{
+        const char *suffix = r->match + 1;
+        size_t slen = r->len - 1;
+
+        if (r->match[0] == '*' && r->len > 1)
+                return len > slen &&
+                       strncasecmp(name + len - slen, suffix, slen) == 0;
+        return len == r->len && strncasecmp(name, r->match, len) == 0;
+}
+
+
+#define _DISPATCH_U16(p) (((size_t) (unsigned char) (p)[0] << 8) | \
+                          (size_t) (unsigned char) (p)[1])
+
+/* Structure running past the record is malformed; past what we have is
+ * still to come. */
+#define _DISPATCH_NEED(n) do {                          \
+                if ((n) > end)                          \
+                        return 0;                       \
+                if ((n) > len)                          \
+                        return -EAGAIN;                 \
+        } while (0)
+
+/*
+ * Find the server name in the TLS ClientHello at the start of <b>buf</b>
+ * and copy it, NUL terminated, to <b>name</b>.  Only the first record is
+ * looked at, which is where every client we know of puts the whole hello.
+ * @return the name's length, 0 if <b>buf</b> is not a ClientHello or
+ *      names no server, or -EAGAIN if it is cut short.
+ */
+int
+dispatch_tls_sni(const char *buf, size_t len, char *name, size_t name_size)
+{
+        size_t end = 5, p, hs_end, ext_end;
+
+        _DISPATCH_NEED(1);
+        /* Handshake record. */
+        if (buf[0] != 0x16)
+                return 0;
+        _DISPATCH_NEED(5);
+        if (buf[1] != 0x03)
+                return 0;
+        end = 5 + _DISPATCH_U16(buf + 3);
+
+        /* ClientHello, its length, version and random. */
+        p = 5;
+        _DISPATCH_NEED(p + 4);
+        if (buf[p] != 0x01)
+                return 0;
+        hs_end = p + 4 + (((size_t) (unsigned char) buf[p + 1] << 16) |
+                          _DISPATCH_U16(buf + p + 2));
+        if (hs_end < end)
+                end = hs_end;
+        p += 4 + 2 + 32;
+
+        /* Session id, cipher suites, compression methods. */
+        _DISPATCH_NEED(p + 1);
+        p += 1 + (unsigned char) buf[p];
+        _DISPATCH_NEED(p + 2);
+        p += 2 + _DISPATCH_U16(buf + p);
+        _DISPATCH_NEED(p + 1);
+        p += 1 + (unsigned char) buf[p];
+
+        _DISPATCH_NEED(p + 2);
+        ext_end = p + 2 + _DISPATCH_U16(buf + p);
+        if (ext_end > end)
+                return 0;
+        p += 2;
+
+        while (p < ext_end) {
+                size_t type, elen, q;
+
+                _DISPATCH_NEED(p + 4);
+                type = _DISPATCH_U16(buf + p);
+                elen = _DISPATCH_U16(buf + p + 2);
+                p += 4;
+                if (type != 0) {
+                        p += elen;
+                        continue;
+                }
+
+                /* server_name: a list of which we want the host_name. */
+                _DISPATCH_NEED(p + elen);
+                for (q = p + 2; q + 3 <= p + elen;) {
+                        size_t nlen = _DISPATCH_U16(buf + q + 1);
+
+                        if (q + 3 + nlen > p + elen)
+                                return 0;
+                        if (buf[q] == 0) {
+                                if (nlen >= name_size)
+                                        return 0;
+                                memcpy(name, buf + q + 3, nlen);
+                                name[nlen] = '\0';
+                                return (int) nlen;
+                        }
+                        q += 3 + nlen;
+                }
+                return 0;
+        }
+        return 0;
+}
+
+
+/*
+ * Pick a target for a connection whose client sent <b>buf</b> so far.
+ * Rules are tried in order and the first to match wins, so a rule that
+ * cannot tell yet holds up the decision unless <b>final</b> says no more
+ * is coming.
+ * @return 1 with the rule's target, or the fallback, in *<b>target</b>; 0
+ *      to look again once more has arrived.
+ */
+int
+dispatch_classify(struct dispatch *d, const char *buf, size_t len, int final,
+                  void **target)
+{
+        char name[DISPATCH_NAME_MAX];
+        int sni = -1, m = _DISPATCH_NO;
+        unsigned int i;
+
+        for (i = 0; i < d->nrules; i++) {
+                struct dispatch_rule *r = &d->rules[i];
+
+                switch (r->kind) {
+                case DISPATCH_MAGIC:
+                        m = _dispatch_prefix(r, buf, len);
+                        break;
+                case DISPATCH_PATH:
+                        m = _dispatch_path(r, buf, len);
+                        break;
+                case DISPATCH_SNI:
+                        if (sni == -1)
+                                sni = dispatch_tls_sni(buf, len, name,
+                                                       sizeof(name));
+                        if (sni == -EAGAIN)
+                                m = _DISPATCH_MORE;
+                        else
+                                m = sni > 0 && _dispatch_sni(r, name,
+                                                             (size_t) sni);
+                        break;
+                default:
+                        m = _DISPATCH_NO;
+                }
+
+                if (m == _DISPATCH_MORE && !final)
+                        return 0;
+                if (m == _DISPATCH_YES) {
+                        __atomic_add_fetch(&r->hits, 1, __ATOMIC_RELAXED);
+                        *target = r->target;
+                        return 1;
+                }
+        }
+
+        __atomic_add_fetch(&d->fallbacks, 1, __ATOMIC_RELAXED);
+        *target = d->fallback;
+        return 1;
+}
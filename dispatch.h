@@ -0,0 +1,57 @@
+/* Routing connections by the first bytes their client sends.
+ *
+ * A listener with a dispatcher peeks at what each new connection sends,
+ * without consuming it, and matches it against rules in the order they
+ * were added: a protocol magic the data starts with, the server name a TLS
+ * ClientHello asks for, or the path an HTTP request line starts with.  The
+ * first rule that matches picks the target, typically another server's
+ * settings on an engine of its own, whose handler then reads the same
+ * bytes from the start.  Nothing matching, or the client taking too long
+ * to say enough, picks the fallback. */
+
+#ifndef _DISPATCH_H
+#define _DISPATCH_H
+
+#include <stddef.h>
+
+/* Rule kinds. */
+#define DISPATCH_MAGIC 0
+/* Exact, case-insensitive; "*.example.com" matches any subdomain. */
+#define DISPATCH_SNI 1
+#define DISPATCH_PATH 2
+
+/* Most a dispatcher looks at; a ClientHello with a large key share can
+ * take most of it. */
+#define DISPATCH_PEEK_MAX 4096
+#define DISPATCH_DEFAULT_TIMEOUT_MS 1000
+#define DISPATCH_MAX_RULES 32
+#define DISPATCH_NAME_MAX 256
+
+struct dispatch_rule {
+        int kind;
+        char match[DISPATCH_NAME_MAX];
+        size_t len;
+        void *target;
+        unsigned long hits;
+};
+
+struct dispatch {
+        struct dispatch_rule rules[DISPATCH_MAX_RULES];
+        unsigned int nrules;
+        /* Picked when no rule matches; NULL for the listener itself. */
+        void *fallback;
+        unsigned long fallbacks;
+        /* How long a client may take to send enough to decide on. */
+        int timeout_ms;
+};
+
+struct dispatch *dispatch_create(void *fallback, int timeout_ms);
+void dispatch_free(struct dispatch *d);
+int dispatch_add(struct dispatch *d, int kind, const void *match, size_t len,
+                 void *target);
+int dispatch_classify(struct dispatch *d, const char *buf, size_t len,
+                      int final, void **target);
+int dispatch_tls_sni(const char *buf, size_t len, char *name,
+                     size_t name_size);
+
+#endif
@@ -0,0 +1,163 @@
+/* Decode an event log (see net/net_event.h).
+ *
+ *      evlog <log> [-f]
+ *
+ * Prints the records still in the ring, oldest first, one per line with
+ * the wall clock time, event, fd, errno and payload, then a count of each
+ * event.  With -f it keeps following the log of a running server. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "net/net_util.h"
+#include "net/net_event.h"
+
+/* How often -f looks for new records. */
+#define EVLOG_FOLLOW_MS 200
+
+
+/* Print <b>rec</b>'s payload as its event has it. */
+static void
+_evlog_payload(const struct net_event_rec *rec)
+{
+        char ip[INET6_ADDRSTRLEN];
+        struct net_event_addr a;
+        uint32_t i;
+
+        if (net_event_payload(rec->id) == NET_EVENT_ADDR &&
+            rec->len >= sizeof(a)) {
+                memcpy(&a, rec->data, sizeof(a));
+                if ((a.family == AF_INET || a.family == AF_INET6) &&
+                    inet_ntop(a.family, a.addr, ip, sizeof(ip))) {
+                        printf(a.family == AF_INET6 ? " [%s]:%u" : " %s:%u",
+                               ip, (unsigned int) ntohs(a.port));
+                        return;
+                }
+                printf(" (family %u)", (unsigned int) a.family);
+                return;
+        }
+        if (rec->len)
+                putchar(' ');
+        for (i = 0; i < rec->len && i < NET_EVENT_DATA; i++)
+                printf("%02x", rec->data[i]);
+}
+
+
+/* Print slot <b>seq</b> of the log if it still holds that record.
+ * @return 1 if it did, 0 if it was overwritten. */
+static int
+_evlog_print(const struct net_event_header *h, uint64_t seq,
+             unsigned long *counts)
+{
+        const struct net_event_rec *slot = (const struct net_event_rec *)
+                (h + 1) + (seq & (h->nrecs - 1));
+        struct net_event_rec rec;
+        uint64_t real;
+        time_t secs;
+        struct tm tm;
+        char when[32];
+
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+                return 0;
+        memcpy(&rec, slot, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+                return 0;
+
+        real = h->start_real_ns + (rec.t_ns - h->start_mono_ns);
+        secs = (time_t) (real / 1000000000u);
+        localtime_r(&secs, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        printf("%s.%06u %s fd %d: %s", when,
+               (unsigned int) (real % 1000000000u / 1000),
+               net_event_name(rec.id), rec.fd,
+               rec.err ? strerror(rec.err) : "no error");
+        _evlog_payload(&rec);
+        putchar('\n');
+        if (rec.id < NET_EVENTS)
+                counts[rec.id]++;
+        return 1;
+}
+
+
+int
+main(int argc, char **argv)
+{
+        const struct net_event_header *h;
+        unsigned long counts[NET_EVENTS];
+        unsigned long lost = 0;
+        struct stat st;
+        uint64_t seq, head;
+        unsigned int id;
+        int fd, follow;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: %s <log> [-f]\n", argv[0]);
+                return 2;
+        }
+        follow = argc > 2 && strcmp(argv[2], "-f") == 0;
+
+        fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+                net_error("Couldn't open %s: %s.\n", argv[1],
+                          strerror(errno));
+                return 1;
+        }
+        h = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (h == MAP_FAILED) {
+                net_error("Couldn't map %s: %s.\n", argv[1],
+                          strerror(errno));
+                return 1;
+        }
+        if ((size_t) st.st_size < sizeof(*h) ||
+            memcmp(h->magic, NET_EVENT_MAGIC, sizeof(h->magic)) != 0 ||
+            h->rec_size != sizeof(struct net_event_rec) || !h->nrecs ||
+            (h->nrecs & (h->nrecs - 1)) ||
+            (size_t) st.st_size < sizeof(*h) +
+                                  (size_t) h->nrecs * h->rec_size) {
+                net_error("%s is not an event log.\n", argv[1]);
+                return 1;
+        }
+
+        memset(counts, 0, sizeof(counts));
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        seq = head > h->nrecs ? head - h->nrecs : 0;
+        lost = (unsigned long) seq;
+        for (;;) {
+                for (; seq < head; seq++)
+                        if (!_evlog_print(h, seq, counts))
+                                lost++;
+                if (!follow)
+                        break;
+                fflush(stdout);
+                poll(NULL, 0, EVLOG_FOLLOW_MS);
+                head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+                /* Fell more than a ring behind. */
+                if (head - seq > h->nrecs) {
+                        lost += (unsigned long) (head - h->nrecs - seq);
+                        seq = head - h->nrecs;
+                }
+        }
+
+        for (id = 0; id < NET_EVENTS; id++)
+                if (counts[id])
+                        printf("%10lu %s\n", counts[id], net_event_name(id));
+        if (lost)
+                printf("%10lu overwritten\n", lost);
+        return 0;
+}
@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+
+#include "net/net_util.h"
+
+#include "conn.h"
+#include "evloop.h"
+
+
+/*
+ * Set up an empty loop.
+ * @return 0 on success, the negative errno on failure.
+ */
+int
+evloop_init(struct evloop *l)
+{
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (l->epfd < 0)
+                return -errno;
+        l->conns = NULL;
+        l->deadlines = NULL;
+        l->nwaiting = 0;
+        l->nslots = 0;
+        l->ndeadlines = 0;
+        l->next_sweep = UINT64_MAX;
+        l->last_sweep = 0;
+        return 0;
+}
+
+
+/* Close the loop.  Connections still waiting in it are not freed. */
+void
+evloop_destroy(struct evloop *l)
+{
+        if (l->epfd >= 0)
+                close(l->epfd);
+        l->epfd = -1;
+        free(l->conns);
+        free(l->deadlines);
+        l->conns = NULL;
+        l->deadlines = NULL;
+        l->nwaiting = l->nslots = 0;
+}
+
+
+/* Make room for one more waiting connection.  @return 0, or -ENOMEM. */
+static int
+_evloop_reserve(struct evloop *l)
+{
+        unsigned int n = l->nslots ? l->nslots * 2 : EVLOOP_MIN_SLOTS;
+        struct conn **conns;
+        uint64_t *deadlines;
+
+        if (l->nwaiting < l->nslots)
+                return 0;
+        conns = realloc(l->conns, n * sizeof(*conns));
+        if (!conns)
+                return -ENOMEM;
+        l->conns = conns;
+        deadlines = realloc(l->deadlines, n * sizeof(*deadlines));
+        if (!deadlines)
+                return -ENOMEM;
+        l->deadlines = deadlines;
+        l->nslots = n;
+        return 0;
+}
+
+
+/* Put <b>c</b> in the next free slot; there must be one. */
+static void
+_evloop_link(struct evloop *l, struct conn *c)
+{
+        unsigned int i = l->nwaiting++;
+        uint64_t due;
+
+        l->conns[i] = c;
+        l->deadlines[i] = c->wait_deadline;
+        c->wslot = i;
+        if (!c->wait_deadline)
+                return;
+        l->ndeadlines++;
+        /* Sooner than the next sweep, but not sooner than the pace. */
+        due = l->last_sweep + EVLOOP_SWEEP_NS;
+        if (c->wait_deadline > due)
+                due = c->wait_deadline;
+        if (due < l->next_sweep)
+                l->next_sweep = due;
+}
+
+
+/* Empty <b>c</b>'s slot, filling it with the last. */
+static void
+_evloop_unlink(struct evloop *l, struct conn *c)
+{
+        unsigned int i = c->wslot, last = --l->nwaiting;
+
+        if (l->deadlines[i])
+                l->ndeadlines--;
+        if (i != last) {
+                l->conns[i] = l->conns[last];
+                l->deadlines[i] = l->deadlines[last];
+                l->conns[i]->wslot = i;
+        }
+}
+
+
+/*
+ * Also wake evloop_poll() when <b>fd</b> is readable, without handing
+ * anything back; the caller drains it.  For the worker's wakeup fd.
+ * @return 0 on success, the negative errno on failure.
+ */
+int
+evloop_watch(struct evloop *l, int fd)
+{
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+                return -errno;
+        return 0;
+}
+
+
+/* @return how long, in ms, <b>l</b> may sleep at <b>now</b> before a
+ * deadline needs sweeping, or -1 for as long as it likes. */
+int
+evloop_timeout(struct evloop *l, uint64_t now)
+{
+        if (!l->ndeadlines)
+                return -1;
+        if (now >= l->next_sweep)
+                return 0;
+        return (int) ((l->next_sweep - now + 999999) / 1000000);
+}
+
+
+/*
+ * Drop <b>c</b>'s epoll registration, in whichever loop holds it.  The
+ * connection must not be waiting.  Safe to call from any thread.
+ */
+void
+evloop_forget(struct conn *c)
+{
+        if (c->loop && c->ev_fd >= 0)
+                epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->ev_fd, NULL);
+        c->loop = NULL;
+        c->ev_fd = -1;
+}
+
+
+/*
+ * Wait in <b>l</b> for <b>c</b>->wait_events on <b>c</b>->wait_fd.  The
+ * registration for the connection's own socket is kept across waits, and
+ * moves here from another worker's loop if the connection was stolen.
+ * @return 0 on success, the negative errno if the fd cannot be polled.
+ */
+int
+evloop_arm(struct evloop *l, struct conn *c)
+{
+        struct epoll_event ev;
+        int r;
+
+        if (_evloop_reserve(l) < 0)
+                return -ENOMEM;
+
+        /* POLLIN and friends have the same values as their EPOLL twins. */
+        ev.events = (uint32_t) c->wait_events | EPOLLONESHOT;
+        ev.data.ptr = c;
+
+        if (c->loop != l || c->ev_fd != c->wait_fd)
+                evloop_forget(c);
+
+        if (c->loop == l) {
+                r = epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->wait_fd, &ev);
+                /* The fd was closed and reopened under us. */
+                if (r < 0 && errno == ENOENT)
+                        r = epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->wait_fd, &ev);
+        } else {
+                r = epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->wait_fd, &ev);
+                if (r < 0 && errno == EEXIST)
+                        r = epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->wait_fd, &ev);
+        }
+        if (r < 0) {
+                r = -errno;
+                c->loop = NULL;
+                c->ev_fd = -1;
+                return r;
+        }
+
+        c->loop = l;
+        c->ev_fd = c->wait_fd;
+        _evloop_link(l, c);
+        return 0;
+}
+
+
+/* <b>c</b> is done waiting in <b>l</b> with <b>result</b>. */
+static void
+_evloop_done(struct evloop *l, struct conn *c, int result)
+{
+        _evloop_unlink(l, c);
+        c->wait_result = result;
+        /* Only the connection's own socket stays registered: any other fd
+         * may be closed and its number reused before the next wait. */
+        if (result <= 0 || c->ev_fd != c->fd)
+                evloop_forget(c);
+}
+
+
+/*
+ * Wait up to <b>timeout_ms</b> for events in <b>l</b> and pass each
+ * connection that became ready to <b>ready</b>.
+ * @return the number of connections handed back, or the negative errno.
+ */
+int
+evloop_poll(struct evloop *l, int timeout_ms,
+            void (*ready)(struct conn *c, void *arg), void *arg)
+{
+        struct epoll_event evs[EVLOOP_BATCH];
+        int i, n, handed = 0;
+
+        n = epoll_wait(l->epfd, evs, EVLOOP_BATCH, timeout_ms);
+        if (n < 0)
+                return errno == EINTR ? 0 : -errno;
+
+        for (i = 0; i < n; i++) {
+                struct conn *c = evs[i].data.ptr;
+
+                if (!c)
+                        continue;
+                _evloop_done(l, c, 1);
+                ready(c, arg);
+                handed++;
+        }
+        return handed;
+}
+
+
+/*
+ * Take <b>c</b>, waiting in <b>l</b>, out of it without waking it, for
+ * another loop to arm as it was.  Owner only.
+ */
+void
+evloop_detach(struct evloop *l, struct conn *c)
+{
+        _evloop_unlink(l, c);
+        evloop_forget(c);
+}
+
+
+/* @return the connection most recently armed in <b>l</b> that is still
+ * waiting there, or NULL if there are none. */
+struct conn *
+evloop_last(struct evloop *l)
+{
+        return l->nwaiting ? l->conns[l->nwaiting - 1] : NULL;
+}
+
+
+/*
+ * Hand connections in <b>l</b> whose deadline is before <b>now</b> to
+ * <b>ready</b>, with a wait_result of 0.  Scans only once the earliest
+ * deadline is due, and at most once every EVLOOP_SWEEP_NS.
+ */
+void
+evloop_sweep(struct evloop *l, uint64_t now,
+             void (*ready)(struct conn *c, void *arg), void *arg)
+{
+        uint64_t next = UINT64_MAX, d;
+        unsigned int i;
+
+        if (now < l->next_sweep)
+                return;
+        l->last_sweep = now;
+
+        /* Backwards: a slot emptied is refilled from the end, which has
+         * been looked at already. */
+        for (i = l->nwaiting; i-- > 0;) {
+                d = l->deadlines[i];
+                if (!d)
+                        continue;
+                if (d <= now) {
+                        struct conn *c = l->conns[i];
+
+                        _evloop_done(l, c, 0);
+                        ready(c, arg);
+                } else if (d < next) {
+                        next = d;
+                }
+        }
+        if (next != UINT64_MAX && next < now + EVLOOP_SWEEP_NS)
+                next = now + EVLOOP_SWEEP_NS;
+        l->next_sweep = next;
+}
@@ -0,0 +1,57 @@
+/* Per-worker event loop for suspended connection handlers.
+ *
+ * A handler that would block in net_wait() parks its connection here; the
+ * worker polls the loop between running ready connections and hands back
+ * those whose socket became ready or whose deadline passed.
+ *
+ * Waiting connections are kept dense in slots, each field in an array of
+ * its own, so that sweeping the deadlines of 100k connections reads one
+ * contiguous array instead of chasing a pointer into each of them.  A
+ * connection leaving its slot has the last one moved into it. */
+
+#ifndef _EVLOOP_H
+#define _EVLOOP_H
+
+#include <stdint.h>
+
+#include "conn.h"
+
+/* Events fetched per epoll_wait(). */
+#define EVLOOP_BATCH 64
+/* How often, at most, waiting connections are checked for expired
+ * deadlines. */
+#define EVLOOP_SWEEP_NS (10 * 1000 * 1000)
+/* Slots a loop starts with; it doubles them as needed. */
+#define EVLOOP_MIN_SLOTS 64
+
+struct evloop {
+        int epfd;
+        /* Connections armed in this loop, roughly in the order they were:
+         * slot i holds conns[i], waiting until deadlines[i] (0 for
+         * ever). */
+        struct conn **conns;
+        uint64_t *deadlines;
+        unsigned int nwaiting;
+        unsigned int nslots;
+        /* Of those, how many have a deadline. */
+        unsigned int ndeadlines;
+        /* No deadline expires before next_sweep; last_sweep paces the
+         * sweeps. */
+        uint64_t next_sweep;
+        uint64_t last_sweep;
+};
+
+int evloop_init(struct evloop *l);
+void evloop_destroy(struct evloop *l);
+int evloop_watch(struct evloop *l, int fd);
+int evloop_timeout(struct evloop *l, uint64_t now);
+int evloop_arm(struct evloop *l, struct conn *c);
+int evloop_poll(struct evloop *l, int timeout_ms,
+                void (*ready)(struct conn *c, void *arg), void *arg);
+void evloop_sweep(struct evloop *l, uint64_t now,
+                  void (*ready)(struct conn *c, void *arg), void *arg);
+void evloop_detach(struct evloop *l, struct conn *c);
+struct conn *evloop_last(struct evloop *l);
+void evloop_forget(struct conn *c);
+
+#endif
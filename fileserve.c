@@ -0,0 +1,738 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+#include "net/net_trace.h"
+
+#include "fileserve.h"
+
+static unsigned int
+_fs_hash(const char *path)
+{
+        /* FNV-1a */
+        unsigned int h = 2166136261u;
+
+        while (*path) {
+                h ^= (unsigned char) *path++;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+
+/*
+ * Copy the request path <b>in</b> to <b>out</b> as a path relative to the
+ * document root: leading and repeated slashes and "." segments are dropped,
+ * and a bare directory maps to its index.html.
+ * @return 0 on success, -1 if the path is too long or climbs out of the
+ *      root with "..".
+ */
+static int
+_fs_normalize(const char *in, char *out, size_t outlen)
+{
+        size_t o = 0;
+
+        while (*in) {
+                const char *seg;
+                size_t len;
+
+                while (*in == '/')
+                        in++;
+                seg = in;
+                while (*in && *in != '/')
+                        in++;
+                len = (size_t) (in - seg);
+
+                if (len == 0 || (len == 1 && seg[0] == '.'))
+                        continue;
+                if (len == 2 && seg[0] == '.' && seg[1] == '.')
+                        return -1;
+
+                if (o + len + 2 > outlen)
+                        return -1;
+                if (o)
+                        out[o++] = '/';
+                memcpy(out + o, seg, len);
+                o += len;
+        }
+
+        if (o == 0 || in[-1] == '/') {
+                const char *index = o ? "/index.html" : "index.html";
+                if (o + strlen(index) + 1 > outlen)
+                        return -1;
+                memcpy(out + o, index, strlen(index));
+                o += strlen(index);
+        }
+        out[o] = '\0';
+        return 0;
+}
+
+
+static void
+_fs_entry_free(struct fs_entry *entry)
+{
+        close(entry->fd);
+        free(entry);
+}
+
+
+/*
+ * Drop a reference to <b>entry</b>, closing it when the last one goes.
+ * Safe to call without the cache lock.
+ */
+void
+fs_entry_put(struct fs_cache *cache, struct fs_entry *entry)
+{
+        (void) cache;
+
+        if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+                _fs_entry_free(entry);
+}
+
+
+/* Take <b>entry</b> out of the table and LRU.  Caller holds the lock. */
+static void
+_fs_unlink(struct fs_cache *cache, struct fs_entry *entry)
+{
+        struct fs_entry **link;
+
+        link = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+        while (*link != entry)
+                link = &(*link)->hnext;
+        *link = entry->hnext;
+
+        entry->lru_prev->lru_next = entry->lru_next;
+        entry->lru_next->lru_prev = entry->lru_prev;
+
+        cache->bytes -= entry->size;
+        cache->nentries--;
+        entry->in_table = 0;
+        fs_entry_put(cache, entry);
+}
+
+
+static struct fs_entry *
+_fs_lookup(struct fs_cache *cache, const char *path, unsigned int hash)
+{
+        struct fs_entry *entry;
+
+        entry = cache->buckets[hash & (cache->nbuckets - 1)];
+        for (; entry; entry = entry->hnext) {
+                if (entry->hash == hash && !strcmp(entry->path, path))
+                        return entry;
+        }
+        return NULL;
+}
+
+
+static void
+_fs_lru_front(struct fs_cache *cache, struct fs_entry *entry)
+{
+        entry->lru_prev->lru_next = entry->lru_next;
+        entry->lru_next->lru_prev = entry->lru_prev;
+        entry->lru_next = cache->lru.lru_next;
+        entry->lru_prev = &cache->lru;
+        cache->lru.lru_next->lru_prev = entry;
+        cache->lru.lru_next = entry;
+}
+
+
+#ifdef __linux__
+/* @return the index in <b>cache</b>->dirs of the directory <b>dir</b>,
+ * <b>len</b> bytes long, or -1.  Caller holds the lock. */
+static int
+_fs_dir_find(struct fs_cache *cache, const char *dir, size_t len)
+{
+        int i;
+
+        for (i = 0; i < cache->ndirs; i++) {
+                if (!strncmp(cache->dirs[i].dir, dir, len) &&
+                    cache->dirs[i].dir[len] == '\0')
+                        return i;
+        }
+        return -1;
+}
+
+
+/*
+ * Make sure the directory holding <b>path</b> is watched.  Watching
+ * directories rather than files catches deploy tools that replace a file by
+ * renaming over it, and means watches never need to be removed when an
+ * entry is evicted.  Only a directory not seen before costs a system call,
+ * which is made without the lock.
+ * @return 1 if the watch is new, 0 if the directory was already watched,
+ *      and -1 if it cannot be.
+ */
+static int
+_fs_watch_dir(struct fs_cache *cache, const char *path)
+{
+        char full[FS_PATH_MAX * 2];
+        const char *slash = strrchr(path, '/');
+        size_t dirlen = slash ? (size_t) (slash - path) : 0;
+        char *dir;
+        int wd, i, r = -1;
+
+        pthread_mutex_lock(&cache->lock);
+        i = _fs_dir_find(cache, path, dirlen);
+        pthread_mutex_unlock(&cache->lock);
+        if (i >= 0)
+                return 0;
+
+        snprintf(full, sizeof(full), "%s/%.*s", cache->root, (int) dirlen,
+                 path);
+        wd = inotify_add_watch(cache->inotify_fd, full,
+                               IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                               IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE |
+                               IN_DELETE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+                net_debug("fileserve: cannot watch %s: %s.\n", full,
+                          strerror(errno));
+                return -1;
+        }
+        dir = strndup(path, dirlen);
+
+        pthread_mutex_lock(&cache->lock);
+        if (_fs_dir_find(cache, path, dirlen) >= 0) {
+                /* Somebody else got there first. */
+                r = 0;
+                goto out;
+        }
+        for (i = 0; i < cache->ndirs; i++) {
+                /* The same directory by another name, through a symlink:
+                 * its events come back under that name, so files cached
+                 * under this one would never be invalidated. */
+                if (cache->dirs[i].wd == wd)
+                        goto out;
+        }
+        if (!dir || cache->ndirs == FS_MAX_WATCHED_DIRS) {
+                if (dir)
+                        net_warn("fileserve: too many directories to "
+                                 "watch.\n");
+                inotify_rm_watch(cache->inotify_fd, wd);
+                goto out;
+        }
+        cache->dirs[cache->ndirs].wd = wd;
+        cache->dirs[cache->ndirs++].dir = dir;
+        dir = NULL;
+        r = 1;
+out:
+        pthread_mutex_unlock(&cache->lock);
+        free(dir);
+        return r;
+}
+
+
+/* Drop every cached entry; used when inotify lost events. */
+static void
+_fs_flush(struct fs_cache *cache)
+{
+        while (cache->lru.lru_next != &cache->lru)
+                _fs_unlink(cache, cache->lru.lru_next);
+}
+
+
+static void *
+_fs_watcher(void *arg)
+{
+        struct fs_cache *cache = arg;
+        char events[4096]
+                __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        int cancel;
+
+        for (;;) {
+                ssize_t len = read(cache->inotify_fd, events, sizeof(events));
+                char *p;
+
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        /* fs_cache_delete() stops us with pthread_cancel()
+                         * while we sit in read(), so this is inotify
+                         * itself failing; nothing is invalidated from now
+                         * on. */
+                        net_warn("fileserve: inotify read failed: %s.\n",
+                                 strerror(errno));
+                        break;
+                }
+
+                /* Closing evicted entries is a cancellation point; do not
+                 * let fs_cache_delete() stop us holding the lock. */
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel);
+                pthread_mutex_lock(&cache->lock);
+                __atomic_add_fetch(&cache->events, 1, __ATOMIC_RELEASE);
+                for (p = events; p < events + len; ) {
+                        struct inotify_event *ev = (struct inotify_event *) p;
+                        char path[FS_PATH_MAX];
+                        struct fs_entry *entry;
+                        int i;
+
+                        p += sizeof(*ev) + ev->len;
+
+                        if (ev->mask & IN_Q_OVERFLOW) {
+                                _fs_flush(cache);
+                                continue;
+                        }
+                        if (!ev->len)
+                                continue;
+
+                        for (i = 0; i < cache->ndirs; i++) {
+                                if (cache->dirs[i].wd == ev->wd)
+                                        break;
+                        }
+                        if (i == cache->ndirs)
+                                continue;
+
+                        snprintf(path, sizeof(path), "%s%s%s",
+                                 cache->dirs[i].dir,
+                                 cache->dirs[i].dir[0] ? "/" : "", ev->name);
+                        entry = _fs_lookup(cache, path, _fs_hash(path));
+                        if (entry)
+                                _fs_unlink(cache, entry);
+                }
+                pthread_mutex_unlock(&cache->lock);
+                pthread_setcancelstate(cancel, NULL);
+        }
+        return NULL;
+}
+#endif
+
+
+/* Every entry holds its file open, so by default the cache may take a
+ * quarter of the descriptors we are allowed, and no more than
+ * FS_DEFAULT_MAX_ENTRIES. */
+static unsigned int
+_fs_default_max_entries(void)
+{
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY ||
+            rl.rlim_cur / 4 > FS_DEFAULT_MAX_ENTRIES)
+                return FS_DEFAULT_MAX_ENTRIES;
+        return rl.rlim_cur / 4 ? (unsigned int) (rl.rlim_cur / 4) : 1;
+}
+
+
+/*
+ * Create a file cache serving files below the directory <b>root</b>.
+ * Zero for any of the limits picks the default.
+ * @return the cache, or NULL on failure.
+ */
+struct fs_cache *
+fs_cache_create(const char *root, size_t max_file, size_t max_bytes,
+                unsigned int max_entries)
+{
+        struct fs_cache *cache;
+
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+                return NULL;
+
+        if (strlen(root) >= sizeof(cache->root)) {
+                free(cache);
+                return NULL;
+        }
+        strcpy(cache->root, root);
+
+        cache->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (cache->root_fd < 0) {
+                net_error("Cannot open document root %s: %s.\n", root,
+                          strerror(errno));
+                free(cache);
+                return NULL;
+        }
+
+        cache->max_file = max_file ? max_file : FS_DEFAULT_MAX_FILE;
+        cache->max_bytes = max_bytes ? max_bytes : FS_DEFAULT_MAX_BYTES;
+        cache->max_entries = max_entries ? max_entries
+                                         : _fs_default_max_entries();
+
+        cache->nbuckets = 64;
+        while (cache->nbuckets < cache->max_entries)
+                cache->nbuckets <<= 1;
+        cache->buckets = calloc(cache->nbuckets, sizeof(*cache->buckets));
+        if (!cache->buckets) {
+                close(cache->root_fd);
+                free(cache);
+                return NULL;
+        }
+        cache->lru.lru_next = cache->lru.lru_prev = &cache->lru;
+        pthread_mutex_init(&cache->lock, NULL);
+
+        cache->inotify_fd = -1;
+#ifdef __linux__
+        cache->inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (cache->inotify_fd >= 0 &&
+            pthread_create(&cache->watcher, NULL, &_fs_watcher, cache)) {
+                close(cache->inotify_fd);
+                cache->inotify_fd = -1;
+        }
+#endif
+        if (cache->inotify_fd < 0)
+                net_warn("fileserve: no inotify, revalidating with stat().\n");
+
+        return cache;
+}
+
+
+void
+fs_cache_delete(struct fs_cache *cache)
+{
+#ifdef __linux__
+        int i;
+
+        if (cache->inotify_fd >= 0) {
+                pthread_cancel(cache->watcher);
+                pthread_join(cache->watcher, NULL);
+                close(cache->inotify_fd);
+        }
+        for (i = 0; i < cache->ndirs; i++)
+                free(cache->dirs[i].dir);
+        cache->ndirs = 0;
+#endif
+        pthread_mutex_lock(&cache->lock);
+        while (cache->lru.lru_next != &cache->lru)
+                _fs_unlink(cache, cache->lru.lru_next);
+        pthread_mutex_unlock(&cache->lock);
+
+        pthread_mutex_destroy(&cache->lock);
+        close(cache->root_fd);
+        free(cache->buckets);
+        free(cache);
+}
+
+
+/*
+ * Look up the normalized <b>path</b> in the cache.
+ * @return a referenced entry to be released with fs_entry_put(), or NULL
+ *      if the file is not cached.
+ */
+struct fs_entry *
+fs_cache_get(struct fs_cache *cache, const char *path)
+{
+        unsigned int hash = _fs_hash(path);
+        struct fs_entry *entry;
+
+        pthread_mutex_lock(&cache->lock);
+        entry = _fs_lookup(cache, path, hash);
+        if (entry && cache->inotify_fd < 0) {
+                struct stat st;
+
+                if (fstatat(cache->root_fd, path, &st, 0) < 0 ||
+                    (size_t) st.st_size != entry->size ||
+                    st.st_mtim.tv_sec != entry->mtime.tv_sec ||
+                    st.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+                        _fs_unlink(cache, entry);
+                        entry = NULL;
+                }
+        }
+        if (entry) {
+                __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+                _fs_lru_front(cache, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return entry;
+}
+
+
+/*
+ * Make sure a change to the file <b>path</b>, opened and found to be
+ * <b>st</b>, is noticed once it is cached.  A directory watched only now
+ * may have missed a change made since the file was opened, so the path is
+ * looked up again.
+ * @return 0 if the file may be cached, -1 if not.
+ */
+static int
+_fs_watch(struct fs_cache *cache, const char *path, const struct stat *st)
+{
+#ifdef __linux__
+        struct stat now;
+        int r;
+
+        if (cache->inotify_fd < 0)
+                return 0;       /* Revalidated with stat() on every hit. */
+        r = _fs_watch_dir(cache, path);
+        if (r <= 0)
+                return r;
+        if (fstatat(cache->root_fd, path, &now, 0) < 0 ||
+            now.st_dev != st->st_dev || now.st_ino != st->st_ino ||
+            now.st_size != st->st_size ||
+            now.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+            now.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+                return -1;
+#else
+        (void) cache;
+        (void) path;
+        (void) st;
+#endif
+        return 0;
+}
+
+
+/*
+ * Add the open file <b>fd</b> to the cache under <b>path</b>, evicting
+ * least recently used entries to stay within bounds.  On success the entry
+ * owns <b>fd</b>.
+ * @return a referenced entry, or NULL if it could not be added, or if
+ *      inotify reported anything since <b>events</b> was read, before
+ *      the file was opened, and it may already be stale.
+ */
+static struct fs_entry *
+_fs_cache_insert(struct fs_cache *cache, const char *path, int fd,
+                 struct stat *st, unsigned long events)
+{
+        struct fs_entry *entry, *old;
+        size_t pathlen = strlen(path);
+
+        entry = malloc(sizeof(*entry) + pathlen + 1);
+        if (!entry)
+                return NULL;
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->path, path, pathlen + 1);
+        entry->hash = _fs_hash(path);
+        entry->size = (size_t) st->st_size;
+        entry->mtime = st->st_mtim;
+        entry->fd = fd;
+        /* One reference for the table and one for the caller. */
+        entry->refs = 2;
+
+        pthread_mutex_lock(&cache->lock);
+        if (cache->events != events) {
+                pthread_mutex_unlock(&cache->lock);
+                free(entry);
+                return NULL;
+        }
+        old = _fs_lookup(cache, path, entry->hash);
+        if (old) {
+                /* Somebody else loaded it first. */
+                _fs_unlink(cache, old);
+        }
+        entry->hnext = cache->buckets[entry->hash & (cache->nbuckets - 1)];
+        cache->buckets[entry->hash & (cache->nbuckets - 1)] = entry;
+        entry->lru_prev = &cache->lru;
+        entry->lru_next = cache->lru.lru_next;
+        cache->lru.lru_next->lru_prev = entry;
+        cache->lru.lru_next = entry;
+        entry->in_table = 1;
+        cache->bytes += entry->size;
+        cache->nentries++;
+
+        while ((cache->bytes > cache->max_bytes ||
+                cache->nentries > cache->max_entries) &&
+               cache->lru.lru_prev != entry)
+                _fs_unlink(cache, cache->lru.lru_prev);
+        pthread_mutex_unlock(&cache->lock);
+
+        return entry;
+}
+
+
+/* Copy <b>left</b> bytes of <b>fd</b> from <b>off</b> to the socket through
+ * a buffer; large writes go out with MSG_ZEROCOPY if the connection's batch
+ * has it on. */
+static int
+_fs_copy(int sock_fd, int fd, off_t off, size_t left)
+{
+        char buf[16384];
+
+        while (left) {
+                ssize_t n = pread(fd, buf, left < sizeof(buf) ? left
+                                                             : sizeof(buf),
+                                  off);
+                int r;
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return n < 0 ? -errno : -EIO;
+                r = net_write(sock_fd, buf, (size_t) n);
+                if (r < 0)
+                        return r;
+                off += n;
+                left -= (size_t) n;
+        }
+        return 0;
+}
+
+
+/* Copy <b>left</b> bytes of <b>fd</b> from <b>off</b> to the socket. */
+static int
+_fs_sendfile(int sock_fd, int fd, off_t off, size_t left)
+{
+        /* Any batched header rides in the first segment of the body. */
+        int err = net_flush(sock_fd, 1);
+
+        if (err < 0)
+                return err;
+#ifdef __linux__
+        while (left) {
+                ssize_t r = sendfile(sock_fd, fd, &off, left);
+
+                if (r > 0) {
+                        left -= (size_t) r;
+                        continue;
+                }
+                if (r == 0)
+                        return -EIO;    /* Truncated under us. */
+                if (errno == EINTR)
+                        continue;
+                if (NET_SOCKET_ERRNO_IS_EAGAIN(errno)) {
+                        r = net_wait(sock_fd, POLLOUT, NET_IO_TIMEOUT_MS);
+                        if (r < 0)
+                                return (int) r;
+                        if (r == 0)
+                                return -ETIMEDOUT;
+                        continue;
+                }
+                if (errno != EINVAL && errno != ENOSYS)
+                        return -errno;
+                /* Not supported for this fd pair; copy the rest. */
+                break;
+        }
+#endif
+        if (left) {
+                err = _fs_copy(sock_fd, fd, off, left);
+                if (err < 0)
+                        return err;
+        }
+        net_trace(NET_TRACE_FLUSH, sock_fd);
+        return 0;
+}
+
+
+/*
+ * Send the file <b>path</b> (relative to the document root, as requested by
+ * the client) on <b>sock_fd</b>.  Once the file is found and its size known,
+ * <b>head</b> is called to write any framing that precedes the body.
+ * @return 0 on success and the negative error code on failure; -ENOENT
+ *      means nothing was written and the caller may still reply.
+ */
+int
+fileserve_send(struct fs_cache *cache, int sock_fd, const char *path,
+               int (*head)(int, size_t, void *), void *head_arg)
+{
+        char rel[FS_PATH_MAX];
+        struct fs_entry *entry;
+        struct stat st;
+        unsigned long events;
+        int fd, r;
+
+        if (_fs_normalize(path, rel, sizeof(rel)) < 0)
+                return -ENOENT;
+
+        entry = fs_cache_get(cache, rel);
+        if (!entry) {
+                events = __atomic_load_n(&cache->events, __ATOMIC_ACQUIRE);
+                fd = openat(cache->root_fd, rel,
+                            O_RDONLY | O_CLOEXEC | O_NOCTTY);
+                if (fd < 0)
+                        return -ENOENT;
+                if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                        close(fd);
+                        return -ENOENT;
+                }
+
+                if (st.st_size > 0 &&
+                    (size_t) st.st_size <= cache->max_file &&
+                    _fs_watch(cache, rel, &st) == 0)
+                        entry = _fs_cache_insert(cache, rel, fd, &st,
+                                                 events);
+
+                if (!entry) {
+                        /* Too big to cache, not watched, or changing:
+                         * stream it. */
+                        r = head ? head(sock_fd, (size_t) st.st_size,
+                                        head_arg) : 0;
+                        if (r >= 0)
+                                r = _fs_sendfile(sock_fd, fd, 0,
+                                                 (size_t) st.st_size);
+                        close(fd);
+                        return r < 0 ? r : 0;
+                }
+        }
+
+        r = head ? head(sock_fd, entry->size, head_arg) : 0;
+        if (r >= 0)
+                r = _fs_sendfile(sock_fd, entry->fd, 0, entry->size);
+        fs_entry_put(cache, entry);
+        return r < 0 ? r : 0;
+}
+
+
+static int
+_fs_http_head(int sock_fd, size_t size, void *arg)
+{
+        char head[128];
+        int n;
+
+        (void) arg;
+        n = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", size);
+        return net_write(sock_fd, head, (size_t) n);
+}
+
+
+/*
+ * Worker handler answering a single "GET /path" request from the document
+ * root of <b>cache</b> (a struct fs_cache *), HTTP/1.0 style.
+ * @return 0 on success, -1 on failure.  The caller closes the socket.
+ */
+int
+fileserve_handler(void *cache, int client_fd)
+{
+        static const char not_found[] =
+                "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        static const char bad_request[] =
+                "HTTP/1.0 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+        char req[FS_PATH_MAX + 64];
+        size_t len = 0;
+        char *path, *end;
+        int r;
+
+        /* We only need the request line. */
+        while (!memchr(req, '\n', len)) {
+                if (len == sizeof(req) - 1) {
+                        net_write(client_fd, bad_request,
+                                  sizeof(bad_request) - 1);
+                        return -1;
+                }
+                r = net_read(client_fd, req + len, sizeof(req) - 1 - len);
+                if (r <= 0)
+                        return -1;
+                len += (size_t) r;
+        }
+        req[len] = '\0';
+
+        if (strncmp(req, "GET ", 4) != 0) {
+                net_write(client_fd, bad_request, sizeof(bad_request) - 1);
+                return -1;
+        }
+        path = req + 4;
+        end = path + strcspn(path, " ?#\r\n");
+        *end = '\0';
+
+        r = fileserve_send(cache, client_fd, path, &_fs_http_head, NULL);
+        if (r == -ENOENT) {
+                net_write(client_fd, not_found, sizeof(not_found) - 1);
+                return -1;
+        }
+        return r < 0 ? -1 : 0;
+}
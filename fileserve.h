@@ -0,0 +1,86 @@
+/* Static file serving from a document root.
+ *
+ * Small files are kept open in a bounded, refcounted cache that inotify
+ * invalidates when a file changes.  Everything goes out with sendfile()
+ * rather than from a mapping, so a file truncated while it is being sent
+ * ends the response early instead of raising SIGBUS. */
+
+#ifndef _FILESERVE_H
+#define _FILESERVE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Files up to this size are cached; anything larger is opened per request. */
+#define FS_DEFAULT_MAX_FILE (256 * 1024)
+/* Default bound on the summed size of cached files.  Entries hold only a
+ * descriptor, not the contents, so this bounds the working set kept open
+ * rather than our memory. */
+#define FS_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+/* Each entry holds a descriptor; the default number of entries is a quarter
+ * of RLIMIT_NOFILE, capped at this. */
+#define FS_DEFAULT_MAX_ENTRIES 4096
+
+#define FS_PATH_MAX 1024
+#define FS_MAX_WATCHED_DIRS 256
+
+struct fs_entry {
+        /* Hash chain and LRU links, protected by the cache lock. */
+        struct fs_entry *hnext;
+        struct fs_entry *lru_prev;
+        struct fs_entry *lru_next;
+        unsigned int hash;
+        /* References held by senders plus one while in the table. */
+        unsigned int refs;
+        int in_table;
+        struct timespec mtime;
+        int fd;
+        size_t size;
+        char path[];
+};
+
+struct fs_cache {
+        pthread_mutex_t lock;
+        char root[FS_PATH_MAX];
+        /* Directory fd that all lookups are openat()'d relative to. */
+        int root_fd;
+
+        size_t max_file;
+        size_t max_bytes;
+        unsigned int max_entries;
+        size_t bytes;
+        unsigned int nentries;
+
+        struct fs_entry **buckets;
+        unsigned int nbuckets;
+        /* Most recently used entry follows the sentinel. */
+        struct fs_entry lru;
+
+        /* -1 when inotify is unavailable; entries are then revalidated
+         * with stat() on every hit. */
+        int inotify_fd;
+        /* Bumped under the lock for every batch of inotify events, so that
+         * a file opened before a change is not cached after it. */
+        unsigned long events;
+        pthread_t watcher;
+        /* Directories below the root holding an inotify watch. */
+        struct {
+                int wd;
+                char *dir;
+        } dirs[FS_MAX_WATCHED_DIRS];
+        int ndirs;
+};
+
+struct fs_cache *fs_cache_create(const char *root, size_t max_file,
+                                 size_t max_bytes, unsigned int max_entries);
+void fs_cache_delete(struct fs_cache *cache);
+struct fs_entry *fs_cache_get(struct fs_cache *cache, const char *path);
+void fs_entry_put(struct fs_cache *cache, struct fs_entry *entry);
+
+int fileserve_send(struct fs_cache *cache, int sock_fd, const char *path,
+                   int (*head)(int, size_t, void *), void *head_arg);
+int fileserve_handler(void *cache, int client_fd);
+
+#endif
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+
+#include "balancer.h"
+#include "client.h"
+#include "healthcheck.h"
+
+#define HC_MS (1000 * 1000)
+
+
+/* Fold one probe of <b>s</b> into its averages. */
+static void
+_hc_record(struct hc_state *s, int ok, uint64_t now)
+{
+        s->success += HC_EWMA_ALPHA * ((ok ? 1.0 : 0.0) - s->success);
+        if (ok) {
+                double us = (double) (now - s->probe_start) / 1000.0;
+
+                s->latency_us = s->latency_us == 0.0 ? us :
+                        s->latency_us + HC_EWMA_ALPHA * (us - s->latency_us);
+                s->oks++;
+                s->fails = 0;
+        } else {
+                s->fails++;
+                s->oks = 0;
+        }
+}
+
+
+/* Finish the probe of <b>s</b>, if any, as <b>ok</b> or not. */
+static void
+_hc_finish(struct healthcheck *hc, struct hc_state *s, int ok, uint64_t now)
+{
+        if (s->fd < 0)
+                return;
+        epoll_ctl(hc->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+        net_socket_close(s->fd);
+        s->fd = -1;
+        _hc_record(s, ok, now);
+}
+
+
+/* Probe every upstream at once and wait for the answers, or the timeout.
+ * @return -1 if asked to stop meanwhile, 0 otherwise. */
+static int
+_hc_probe_all(struct healthcheck *hc)
+{
+        struct epoll_event evs[64];
+        unsigned int i, pending = 0;
+        uint64_t now = net_now_ns();
+        uint64_t deadline = now + (uint64_t) hc->timeout_ms * HC_MS;
+        int n, stop = 0;
+
+        for (i = 0; i < hc->bal->nups; i++) {
+                struct hc_state *s = &hc->st[i];
+                struct epoll_event ev;
+
+                s->probe_start = now;
+                s->fd = _client_tcp_connect_addr((struct sockaddr *)
+                                                 &s->up->addr,
+                                                 s->up->addrlen, NULL);
+                if (!NET_SOCKET_OK(s->fd)) {
+                        s->fd = -1;
+                        _hc_record(s, 0, now);
+                        continue;
+                }
+                ev.events = EPOLLOUT;
+                ev.data.u32 = i;
+                if (epoll_ctl(hc->epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+                        net_socket_close(s->fd);
+                        s->fd = -1;
+                        continue;
+                }
+                pending++;
+        }
+
+        while (pending && !stop && (now = net_now_ns()) < deadline) {
+                n = epoll_wait(hc->epfd, evs, 64,
+                               (int) ((deadline - now + HC_MS - 1) / HC_MS));
+                now = net_now_ns();
+                for (i = 0; i < (unsigned int) (n > 0 ? n : 0); i++) {
+                        struct hc_state *s;
+                        int err = 0;
+                        socklen_t len = (socklen_t) sizeof(err);
+
+                        if (evs[i].data.u32 == UINT32_MAX) {
+                                stop = 1;
+                                continue;
+                        }
+                        s = &hc->st[evs[i].data.u32];
+                        /* Writable: the connect() finished, one way or
+                         * the other. */
+                        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR,
+                                       (void *) &err, &len) < 0)
+                                err = errno;
+                        _hc_finish(hc, s, err == 0, now);
+                        pending--;
+                }
+        }
+
+        /* Whatever has not answered by now timed out. */
+        for (i = 0; i < hc->bal->nups; i++)
+                _hc_finish(hc, &hc->st[i], 0, now);
+        return stop ? -1 : 0;
+}
+
+
+static void
+_hc_eject(struct healthcheck *hc, struct hc_state *s, uint64_t now,
+          const char *why)
+{
+        if (s->ejections < HC_MAX_EJECTIONS)
+                s->ejections++;
+        s->ejected = 1;
+        s->eject_until = now + (uint64_t) HC_EJECT_BASE_MS * HC_MS *
+                               s->ejections;
+        balancer_set_live(hc->bal, s->up, 0);
+        net_warn("Ejecting upstream %s:%s: %s.\n", s->up->host, s->up->port,
+                 why);
+}
+
+
+/* Eject failing and outlying upstreams, and let recovered ones back. */
+static void
+_hc_evaluate(struct healthcheck *hc)
+{
+        uint64_t now = net_now_ns();
+        unsigned int i, nups = hc->bal->nups, nlat = 0;
+        unsigned int max_out, nout = 0;
+        double sum = 0.0, sumsq = 0.0;
+
+        for (i = 0; i < nups; i++) {
+                struct hc_state *s = &hc->st[i];
+                struct upstream *up = s->up;
+                unsigned long picks, failures;
+
+                /* Requests that failed on the proxy's hot path count as
+                 * failed probes too. */
+                picks = __atomic_load_n(&up->picks, __ATOMIC_RELAXED);
+                failures = __atomic_load_n(&up->failures, __ATOMIC_RELAXED);
+                if (picks > s->last_picks && failures > s->last_failures)
+                        s->success += HC_EWMA_ALPHA * ((1.0 -
+                                (double) (failures - s->last_failures) /
+                                (double) (picks - s->last_picks)) -
+                                s->success);
+                s->last_picks = picks;
+                s->last_failures = failures;
+
+                if (s->ejected) {
+                        nout++;
+                        if (now >= s->eject_until && s->oks >= HC_RISE) {
+                                s->ejected = 0;
+                                s->success = 1.0;
+                                s->live_since = now;
+                                nout--;
+                                balancer_set_live(hc->bal, up, 1);
+                                net_print("Upstream %s:%s is back.\n",
+                                          up->host, up->port);
+                        }
+                        continue;
+                }
+
+                if (s->fails >= HC_FALL) {
+                        _hc_eject(hc, s, now, "not answering");
+                        nout++;
+                        continue;
+                }
+                /* Forgive old ejections once it has behaved a while. */
+                if (s->ejections && now - s->live_since >
+                    (uint64_t) HC_EJECT_BASE_MS * HC_MS * HC_MAX_EJECTIONS)
+                        s->ejections = 0;
+                if (s->latency_us > 0.0) {
+                        sum += s->latency_us;
+                        sumsq += s->latency_us * s->latency_us;
+                        nlat++;
+                }
+        }
+
+        max_out = nups * HC_MAX_EJECT_PERCENT / 100;
+
+        for (i = 0; i < nups && nout < max_out; i++) {
+                struct hc_state *s = &hc->st[i];
+                double x = s->latency_us, mean, var;
+
+                if (s->ejected)
+                        continue;
+                if (s->success < HC_MIN_SUCCESS) {
+                        _hc_eject(hc, s, now, "failing requests");
+                        nout++;
+                        continue;
+                }
+                if (x <= 0.0 || nlat - 1 < HC_MIN_PEERS)
+                        continue;
+
+                /* Judge it against the others only: with itself in the
+                 * mean and variance, one outlier among n can never be more
+                 * than sqrt(n - 1) deviations out. */
+                mean = (sum - x) / (nlat - 1);
+                var = (sumsq - x * x) / (nlat - 1) - mean * mean;
+                if (var < 0.0)
+                        var = 0.0;
+                if (x - mean > HC_MIN_OUTLIER_US &&
+                    (x - mean) * (x - mean) >
+                    HC_LATENCY_SIGMAS * HC_LATENCY_SIGMAS * var) {
+                        _hc_eject(hc, s, now, "slow to connect");
+                        nout++;
+                }
+        }
+}
+
+
+static void *
+_hc_main(void *arg)
+{
+        struct healthcheck *hc = (struct healthcheck *) arg;
+        struct epoll_event ev;
+
+        for (;;) {
+                uint64_t start = net_now_ns(), elapsed;
+
+                if (_hc_probe_all(hc) < 0)
+                        break;
+                _hc_evaluate(hc);
+
+                /* Sleep out the rest of the interval, unless stopped. */
+                elapsed = (net_now_ns() - start) / HC_MS;
+                if (elapsed < hc->interval_ms &&
+                    epoll_wait(hc->epfd, &ev, 1,
+                               (int) (hc->interval_ms - elapsed)) > 0)
+                        break;
+        }
+        return NULL;
+}
+
+
+/*
+ * Start probing <b>bal</b>'s upstreams every <b>interval_ms</b>, giving
+ * each probe <b>timeout_ms</b> to connect.  Zero picks the defaults.
+ * @return the health checker, or NULL on failure.
+ */
+struct healthcheck *
+healthcheck_start(struct balancer *bal, unsigned int interval_ms,
+                  unsigned int timeout_ms)
+{
+        struct healthcheck *hc;
+        struct epoll_event ev;
+        unsigned int i;
+
+        hc = calloc(1, sizeof(*hc));
+        if (!hc)
+                return NULL;
+        hc->epfd = hc->stop_fd = -1;
+        hc->st = calloc(bal->nups, sizeof(*hc->st));
+        hc->epfd = epoll_create1(EPOLL_CLOEXEC);
+        hc->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (!hc->st || hc->epfd < 0 || hc->stop_fd < 0)
+                goto err;
+
+        ev.events = EPOLLIN;
+        ev.data.u32 = UINT32_MAX;
+        if (epoll_ctl(hc->epfd, EPOLL_CTL_ADD, hc->stop_fd, &ev) < 0)
+                goto err;
+
+        hc->bal = bal;
+        hc->interval_ms = interval_ms ? interval_ms : HC_DEFAULT_INTERVAL_MS;
+        hc->timeout_ms = timeout_ms ? timeout_ms : HC_DEFAULT_TIMEOUT_MS;
+        for (i = 0; i < bal->nups; i++) {
+                hc->st[i].up = &bal->ups[i];
+                hc->st[i].fd = -1;
+                hc->st[i].success = 1.0;
+                hc->st[i].live_since = net_now_ns();
+        }
+
+        if (pthread_create(&hc->thread, NULL, &_hc_main, hc))
+                goto err;
+        return hc;
+
+ err:
+        if (hc->epfd >= 0)
+                close(hc->epfd);
+        if (hc->stop_fd >= 0)
+                close(hc->stop_fd);
+        free(hc->st);
+        free(hc);
+        return NULL;
+}
+
+
+/* Stop the health checker and free it.  Upstreams keep their last state. */
+void
+healthcheck_stop(struct healthcheck *hc)
+{
+        uint64_t one = 1;
+
+        if (write(hc->stop_fd, &one, sizeof(one)) < 0)
+                net_warn("Failed to stop health checks: %s.\n",
+                         strerror(errno));
+        pthread_join(hc->thread, NULL);
+        close(hc->epfd);
+        close(hc->stop_fd);
+        free(hc->st);
+        free(hc);
+}
@@ -0,0 +1,74 @@
+/* Active health checking of a balancer's upstreams.
+ *
+ * A background thread connects to every upstream each interval, all
+ * probes in flight at once on nonblocking sockets, and keeps an EWMA of
+ * each upstream's success rate and connect latency.  Upstreams that keep
+ * failing, or are outliers against their peers, are taken out of the
+ * balancer until they answer probes again. */
+
+#ifndef _HEALTHCHECK_H
+#define _HEALTHCHECK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "balancer.h"
+
+#define HC_DEFAULT_INTERVAL_MS 2000
+#define HC_DEFAULT_TIMEOUT_MS 1000
+/* Weight of the newest sample in the moving averages. */
+#define HC_EWMA_ALPHA 0.3
+/* Consecutive failed probes that eject an upstream outright. */
+#define HC_FALL 3
+/* Consecutive good probes needed before an ejected upstream returns. */
+#define HC_RISE 2
+/* Outliers: success rate below this, or connect latency more than
+ * HC_LATENCY_SIGMAS deviations, and HC_MIN_OUTLIER_US, above the mean of
+ * at least HC_MIN_PEERS other live upstreams. */
+#define HC_MIN_SUCCESS 0.5
+#define HC_LATENCY_SIGMAS 2.0
+#define HC_MIN_PEERS 3
+#define HC_MIN_OUTLIER_US 1000
+/* Outlier ejection never takes out more than this share of upstreams. */
+#define HC_MAX_EJECT_PERCENT 50
+/* An ejected upstream sits out this long times its ejection count. */
+#define HC_EJECT_BASE_MS 10000
+#define HC_MAX_EJECTIONS 10
+
+struct hc_state {
+        struct upstream *up;
+        int fd;
+        uint64_t probe_start;
+
+        double success;
+        double latency_us;
+        unsigned int fails;
+        unsigned int oks;
+
+        int ejected;
+        unsigned int ejections;
+        uint64_t eject_until;
+        uint64_t live_since;
+
+        /* Balancer counters at the last round, for passive failures. */
+        unsigned long last_picks;
+        unsigned long last_failures;
+};
+
+struct healthcheck {
+        struct balancer *bal;
+        struct hc_state *st;
+        unsigned int interval_ms;
+        unsigned int timeout_ms;
+        int epfd;
+        /* Written to by healthcheck_stop(). */
+        int stop_fd;
+        pthread_t thread;
+};
+
+struct healthcheck *healthcheck_start(struct balancer *bal,
+                                      unsigned int interval_ms,
+                                      unsigned int timeout_ms);
+void healthcheck_stop(struct healthcheck *hc);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdint.h>
+
+#include "histogram.h"
+
+
+/* Bucket holding <b>v</b>. */
+static unsigned int
+_hist_bucket(uint64_t v)
+{
+        unsigned int exp;
+
+        if (v < HIST_SUB)
+                return (unsigned int) v;
+        exp = 63 - (unsigned int) __builtin_clzll(v);
+        if (exp >= HIST_MAX_BITS)
+                return HIST_BUCKETS - 1;
+        /* The top HIST_SUB_BITS + 1 bits, leading one included. */
+        return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+               (unsigned int) ((v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+
+/* Highest value that lands in bucket <b>b</b>. */
+static uint64_t
+_hist_bucket_top(unsigned int b)
+{
+        unsigned int shift;
+
+        if (b < HIST_SUB)
+                return b;
+        shift = (b >> HIST_SUB_BITS) - 1;
+        return (((uint64_t) (HIST_SUB | (b & (HIST_SUB - 1))) + 1) << shift)
+               - 1;
+}
+
+
+/* Count one sample of <b>ns</b>.  Single writer only. */
+void
+hist_record(struct hist *h, uint64_t ns)
+{
+        unsigned int b = _hist_bucket(ns);
+
+        __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->sum, h->sum + ns, __ATOMIC_RELAXED);
+        if (ns > h->max)
+                __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Add the samples in <b>src</b> to <b>dst</b>. */
+void
+hist_merge(struct hist *dst, const struct hist *src)
+{
+        unsigned int i;
+        uint64_t max;
+
+        for (i = 0; i < HIST_BUCKETS; i++)
+                dst->buckets[i] += __atomic_load_n(&src->buckets[i],
+                                                   __ATOMIC_RELAXED);
+        dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+        dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+        if (max > dst->max)
+                dst->max = max;
+}
+
+
+/*
+ * @return the value below which a share <b>q</b> (0 to 1) of the samples
+ *      fall, rounded up to its bucket's top, or 0 if there are none.
+ */
+uint64_t
+hist_quantile(const struct hist *h, double q)
+{
+        uint64_t total = 0, want, seen = 0;
+        unsigned int i;
+
+        for (i = 0; i < HIST_BUCKETS; i++)
+                total += h->buckets[i];
+        if (!total)
+                return 0;
+
+        want = (uint64_t) (q * (double) total + 0.5);
+        if (want < 1)
+                want = 1;
+        for (i = 0; i < HIST_BUCKETS; i++) {
+                seen += h->buckets[i];
+                if (seen >= want)
+                        break;
+        }
+        if (i == HIST_BUCKETS)
+                i--;
+        /* Never report more than was actually seen. */
+        return _hist_bucket_top(i) < h->max ? _hist_bucket_top(i) : h->max;
+}
@@ -0,0 +1,31 @@
+/* Log-linear latency histograms.
+ *
+ * Values are nanoseconds.  Each power of two is split into HIST_SUB
+ * linear buckets, so any recorded value is off by at most 1/HIST_SUB
+ * (about 6%) while a histogram covers 1ns to about 18 minutes in under
+ * 5KB.  A histogram has a single writer; readers may look at it at any
+ * time and see slightly stale counts. */
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+/* Values from 2^HIST_MAX_BITS ns up all land in the last bucket. */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_record(struct hist *h, uint64_t ns);
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_quantile(const struct hist *h, double q);
+
+#endif
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+
+#include "httpserve.h"
+
+/* Refusals; the connection closes after each. */
+#define HTTP_REFUSE(status) \
+        "HTTP/1.1 " status "\r\nContent-Length: 0\r\n" \
+        "Connection: close\r\n\r\n"
+
+/* What a request head asks of us. */
+struct _http_req {
+        int head_only;
+        int http10;
+        int keep_alive;
+        /* Content-Length of a body to skip. */
+        size_t body;
+};
+
+/* The Date line, with the blank line that ends the head, as of sec. */
+struct _http_date {
+        time_t sec;
+        size_t len;
+        char line[64];
+};
+
+/* Each worker keeps its own, so that nothing is shared on the hot path. */
+static __thread struct _http_date http_date;
+
+
+/* @return the Date line for now, reformatted if the second has changed,
+ * and its length in *<b>len</b>. */
+static const char *
+_http_date_line(size_t *len)
+{
+        time_t now = time(NULL);
+        struct tm tm;
+
+        if (now != http_date.sec || !http_date.len) {
+                gmtime_r(&now, &tm);
+                http_date.len = strftime(http_date.line,
+                                         sizeof(http_date.line),
+                                         "Date: %a, %d %b %Y %H:%M:%S GMT"
+                                         "\r\n\r\n", &tm);
+                http_date.sec = now;
+        }
+        *len = http_date.len;
+        return http_date.line;
+}
+
+
+/* Allocate a responder with the headers for a body of <b>len</b> bytes of
+ * <b>content_type</b>, but no body yet. */
+static struct http_responder *
+_http_responder_new(size_t len, const char *content_type)
+{
+        struct http_responder *r;
+        int n;
+
+        r = calloc(1, sizeof(*r));
+        if (!r)
+                return NULL;
+        n = snprintf(r->head, sizeof(r->head), "HTTP/1.1 200 OK\r\n"
+                     "Server: simple-nonblocking\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n",
+                     content_type ? content_type : HTTP_DEFAULT_TYPE, len);
+        if (n < 0 || (size_t) n >= sizeof(r->head)) {
+                free(r);
+                return NULL;
+        }
+        r->head_len = (size_t) n;
+        r->body_len = len;
+        return r;
+}
+
+
+/*
+ * Create a responder answering every request with a copy of the
+ * <b>len</b> bytes at <b>body</b>, or HTTP_DEFAULT_BODY if that is NULL,
+ * as <b>content_type</b> (NULL for HTTP_DEFAULT_TYPE).
+ * @return the responder, or NULL on failure.
+ */
+struct http_responder *
+http_responder_create(const void *body, size_t len, const char *content_type)
+{
+        struct http_responder *r;
+
+        if (!body) {
+                body = HTTP_DEFAULT_BODY;
+                len = sizeof(HTTP_DEFAULT_BODY) - 1;
+        }
+        r = _http_responder_new(len, content_type);
+        if (!r)
+                return NULL;
+        r->buf = malloc(len ? len : 1);
+        if (!r->buf) {
+                free(r);
+                return NULL;
+        }
+        memcpy(r->buf, body, len);
+        r->body = r->buf;
+        return r;
+}
+
+
+/*
+ * Create a responder answering every request with the contents of the
+ * file <b>path</b>, as it is now, mapped rather than copied.
+ * @return the responder, or NULL on failure.
+ */
+struct http_responder *
+http_responder_create_file(const char *path, const char *content_type)
+{
+        struct http_responder *r;
+        struct stat st;
+        void *map = NULL;
+        int fd;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+        if (fd < 0) {
+                net_error("Couldn't open %s: %s.\n", path, strerror(errno));
+                return NULL;
+        }
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                net_error("%s is not a regular file.\n", path);
+                close(fd);
+                return NULL;
+        }
+        if (st.st_size > 0) {
+                map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+                if (map == MAP_FAILED) {
+                        net_error("Couldn't map %s: %s.\n", path,
+                                  strerror(errno));
+                        close(fd);
+                        return NULL;
+                }
+        }
+        close(fd);
+
+        r = _http_responder_new((size_t) st.st_size, content_type);
+        if (!r) {
+                if (map)
+                        munmap(map, (size_t) st.st_size);
+                return NULL;
+        }
+        r->map = map;
+        r->body = map ? map : "";
+        return r;
+}
+
+
+/* Free <b>r</b>.  No handler may be using it. */
+void
+http_responder_delete(struct http_responder *r)
+{
+        if (r->map)
+                munmap(r->map, r->body_len);
+        free(r->buf);
+        free(r);
+}
+
+
+/*
+ * Find the end of a request head in <b>buf</b> between <b>from</b> and
+ * <b>len</b>: the blank line after it, CRLF or bare LF.
+ * @return the offset just past it, or 0 if it has not arrived yet.
+ */
+static size_t
+_http_head_end(const char *buf, size_t from, size_t len)
+{
+        const char *p = buf + from, *end = buf + len;
+
+        while (p < end && (p = memchr(p, '\n', (size_t) (end - p))) != NULL) {
+                p++;
+                if (p < end && *p == '\n')
+                        return (size_t) (p + 1 - buf);
+                if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+                        return (size_t) (p + 2 - buf);
+        }
+        return 0;
+}
+
+
+/* @return whether the header name of <b>len</b> bytes at <b>p</b> is
+ * <b>name</b>, whatever the case. */
+static int
+_http_is(const char *p, size_t len, const char *name)
+{
+        return len == strlen(name) && strncasecmp(p, name, len) == 0;
+}
+
+
+/* @return whether the header value of <b>len</b> bytes at <b>p</b>
+ * mentions <b>token</b>, whatever the case. */
+static int
+_http_has(const char *p, size_t len, const char *token)
+{
+        size_t n = strlen(token), i;
+
+        for (i = 0; i + n <= len; i++)
+                if (strncasecmp(p + i, token, n) == 0)
+                        return 1;
+        return 0;
+}
+
+
+/*
+ * Parse the request head of <b>len</b> bytes at <b>p</b>, which ends in a
+ * blank line, into <b>req</b>.  Only what changes our answer is looked
+ * at: the method, the version and the framing headers.
+ * @return NULL, or the refusal to send.
+ */
+static const char *
+_http_parse(const char *p, size_t len, struct _http_req *req)
+{
+        const char *end = p + len, *line, *eol, *sp, *colon, *v, *ve;
+        size_t n;
+
+        memset(req, 0, sizeof(*req));
+
+        /* Request line: method, target, HTTP/1.x. */
+        eol = memchr(p, '\n', len);
+        n = (size_t) (eol - p);
+        if (n && p[n - 1] == '\r')
+                n--;
+        sp = memchr(p, ' ', n);
+        if (!sp || sp == p || n < 10 ||
+            memcmp(p + n - 9, " HTTP/1.", 8) != 0 || p + n - 9 <= sp)
+                return HTTP_REFUSE("400 Bad Request");
+        if (p[n - 1] != '0' && p[n - 1] != '1')
+                return HTTP_REFUSE("505 HTTP Version Not Supported");
+        req->http10 = p[n - 1] == '0';
+        req->keep_alive = !req->http10;
+        req->head_only = sp - p == 4 && memcmp(p, "HEAD", 4) == 0;
+
+        for (line = eol + 1; line < end; line = eol + 1) {
+                eol = memchr(line, '\n', (size_t) (end - line));
+                n = (size_t) (eol - line);
+                if (n && line[n - 1] == '\r')
+                        n--;
+                if (!n)
+                        break;
+                colon = memchr(line, ':', n);
+                if (!colon)
+                        return HTTP_REFUSE("400 Bad Request");
+                v = colon + 1;
+                ve = line + n;
+                while (v < ve && (*v == ' ' || *v == '\t'))
+                        v++;
+                while (ve > v && (ve[-1] == ' ' || ve[-1] == '\t'))
+                        ve--;
+
+                n = (size_t) (colon - line);
+                if (_http_is(line, n, "connection")) {
+                        if (_http_has(v, (size_t) (ve - v), "close"))
+                                req->keep_alive = 0;
+                        else if (_http_has(v, (size_t) (ve - v),
+                                           "keep-alive"))
+                                req->keep_alive = 1;
+                } else if (_http_is(line, n, "content-length")) {
+                        if (v == ve)
+                                return HTTP_REFUSE("400 Bad Request");
+                        for (req->body = 0; v < ve; v++) {
+                                if (*v < '0' || *v > '9' ||
+                                    req->body > ((size_t) -1 - 9) / 10)
+                                        return HTTP_REFUSE("400 Bad Request");
+                                req->body = req->body * 10 +
+                                            (size_t) (*v - '0');
+                        }
+                } else if (_http_is(line, n, "transfer-encoding")) {
+                        /* Not worth a chunked decoder here. */
+                        return HTTP_REFUSE("501 Not Implemented");
+                }
+        }
+        return NULL;
+}
+
+
+/* Write the <b>*olen</b> bytes collected in <b>out</b>.
+ * @return 0, or the negative error code. */
+static int
+_http_flush(int fd, const char *out, size_t *olen)
+{
+        int r = 0;
+
+        if (*olen)
+                r = net_write(fd, out, *olen);
+        *olen = 0;
+        return r < 0 ? r : 0;
+}
+
+
+/*
+ * Add the response to <b>req</b> to the <b>*olen</b> bytes in <b>out</b>,
+ * writing them first if it does not fit, and the body on its own if it
+ * is too big to collect.
+ * @return 0, or the negative error code.
+ */
+static int
+_http_respond(struct http_responder *r, int fd, char *out, size_t *olen,
+              const struct _http_req *req)
+{
+        static const char close_line[] = "Connection: close\r\n";
+        static const char keep_line[] = "Connection: keep-alive\r\n";
+        size_t body = req->head_only ? 0 : r->body_len;
+        const char *conn = NULL, *date;
+        size_t clen = 0, dlen, need;
+        int err;
+
+        if (!req->keep_alive) {
+                conn = close_line;
+                clen = sizeof(close_line) - 1;
+        } else if (req->http10) {
+                conn = keep_line;
+                clen = sizeof(keep_line) - 1;
+        }
+        date = _http_date_line(&dlen);
+        need = r->head_len + clen + dlen;
+
+        if (*olen + need + body > HTTP_OUT_SIZE &&
+            (err = _http_flush(fd, out, olen)) < 0)
+                return err;
+        memcpy(out + *olen, r->head, r->head_len);
+        *olen += r->head_len;
+        if (conn) {
+                memcpy(out + *olen, conn, clen);
+                *olen += clen;
+        }
+        memcpy(out + *olen, date, dlen);
+        *olen += dlen;
+
+        if (body <= HTTP_OUT_SIZE - *olen) {
+                memcpy(out + *olen, r->body, body);
+                *olen += body;
+                return 0;
+        }
+        if ((err = _http_flush(fd, out, olen)) < 0)
+                return err;
+        err = net_write(fd, r->body, body);
+        return err < 0 ? err : 0;
+}
+
+
+/* The body of http_handler(), counting the requests answered in
+ * *<b>served</b>. */
+static int
+_http_serve(struct http_responder *r, int client_fd, unsigned long *served)
+{
+        char in[HTTP_REQ_MAX], out[HTTP_OUT_SIZE];
+        size_t len = 0, pos = 0, scan = 0, olen = 0, skip = 0, end, k;
+        struct _http_req req;
+        const char *refusal;
+        int n;
+
+        for (;;) {
+                for (;;) {
+                        /* The body of the last request, unread. */
+                        if (skip) {
+                                k = len - pos < skip ? len - pos : skip;
+                                pos += k;
+                                skip -= k;
+                                if (skip)
+                                        break;
+                        }
+                        /* Empty lines between requests are allowed. */
+                        while (pos < len && (in[pos] == '\r' ||
+                                             in[pos] == '\n'))
+                                pos++;
+                        if (scan < pos)
+                                scan = pos;
+                        end = _http_head_end(in, scan, len);
+                        if (!end) {
+                                /* Look at the tail again next time: it may
+                                 * hold the start of the blank line. */
+                                scan = len >= pos + 2 ? len - 2 : pos;
+                                break;
+                        }
+
+                        refusal = _http_parse(in + pos, end - pos, &req);
+                        pos = scan = end;
+                        if (refusal) {
+                                if (_http_flush(client_fd, out, &olen) == 0)
+                                        net_write(client_fd, refusal,
+                                                  strlen(refusal));
+                                return -1;
+                        }
+                        (*served)++;
+                        if (_http_respond(r, client_fd, out, &olen,
+                                          &req) < 0)
+                                return -1;
+                        if (!req.keep_alive)
+                                return _http_flush(client_fd, out,
+                                                   &olen) < 0 ? -1 : 0;
+                        skip = req.body;
+                }
+                if (_http_flush(client_fd, out, &olen) < 0)
+                        return -1;
+
+                /* Keep what we have of the next request at the front. */
+                if (pos) {
+                        memmove(in, in + pos, len - pos);
+                        len -= pos;
+                        scan -= pos;
+                        pos = 0;
+                }
+                if (len == sizeof(in)) {
+                        refusal = HTTP_REFUSE(
+                                "431 Request Header Fields Too Large");
+                        net_write(client_fd, refusal, strlen(refusal));
+                        return -1;
+                }
+                n = net_read(client_fd, in + len, sizeof(in) - len);
+                if (n <= 0)
+                        return n == 0 ? 0 : -1;
+                len += (size_t) n;
+        }
+}
+
+
+/*
+ * Worker handler answering every request on <b>client_fd</b> as the
+ * <b>responder</b> (a struct http_responder *) says, for as long as the
+ * client keeps the connection alive.  Requests are parsed as they
+ * complete in the receive buffer, and the responses to all of those
+ * that came in one read go out in one write.
+ * @return 0 once the client is done, -1 on failure.  The caller closes
+ *      the socket.
+ */
+int
+http_handler(void *responder, int client_fd)
+{
+        struct http_responder *r = (struct http_responder *) responder;
+        unsigned long served = 0;
+        int err;
+
+        err = _http_serve(r, client_fd, &served);
+        /* Every worker shares the total; touch it once per connection
+         * rather than once per request. */
+        if (served)
+                __atomic_add_fetch(&r->requests, served, __ATOMIC_RELAXED);
+        return err;
+}
@@ -0,0 +1,46 @@
+/* Minimal HTTP/1.1 responder, for benchmarking against other servers with
+ * wrk, h2load and the like.
+ *
+ * Every request gets the same 200 response: headers formatted once when
+ * the responder is created, plus a Date line each worker reformats at most
+ * once a second, and a fixed body or the contents of a file.  Connections
+ * are kept alive as HTTP/1.1 says, and pipelined requests are parsed out
+ * of the receive buffer as they complete, their responses going out
+ * together in one write. */
+
+#ifndef _HTTPSERVE_H
+#define _HTTPSERVE_H
+
+#include <stddef.h>
+
+/* Longest request head accepted; larger ones get a 431. */
+#define HTTP_REQ_MAX 8192
+/* Responses to pipelined requests collect up to this much before they
+ * are written; a body that does not fit goes out on its own. */
+#define HTTP_OUT_SIZE 16384
+/* Room for the preformatted status line and headers, Date excluded. */
+#define HTTP_HEAD_MAX 256
+#define HTTP_DEFAULT_BODY "Hello, World!\n"
+#define HTTP_DEFAULT_TYPE "text/plain"
+
+struct http_responder {
+        char head[HTTP_HEAD_MAX];
+        size_t head_len;
+        const char *body;
+        size_t body_len;
+        /* What body points into: a copy, or a mapping of the file. */
+        void *buf;
+        void *map;
+
+        /* Requests answered, added to as each connection ends. */
+        unsigned long requests;
+};
+
+struct http_responder *http_responder_create(const void *body, size_t len,
+                                             const char *content_type);
+struct http_responder *http_responder_create_file(const char *path,
+                                                  const char *content_type);
+void http_responder_delete(struct http_responder *r);
+int http_handler(void *responder, int client_fd);
+
+#endif
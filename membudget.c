@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+
+#include "membudget.h"
+
+
+/*
+ * Create a budget of <b>limit</b> bytes shared by all connections, each of
+ * which may hold at most <b>conn_limit</b>.  Zero picks the defaults.
+ * @return the budget, or NULL if out of memory.
+ */
+struct mem_budget *
+mem_budget_create(size_t limit, size_t conn_limit)
+{
+        struct mem_budget *mb;
+
+        mb = calloc(1, sizeof(*mb));
+        if (!mb)
+                return NULL;
+        mb->limit = limit ? limit : MEM_DEFAULT_LIMIT;
+        mb->conn_limit = conn_limit ? conn_limit : MEM_DEFAULT_CONN_LIMIT;
+        return mb;
+}
+
+
+void
+mem_budget_delete(struct mem_budget *mb)
+{
+        free(mb);
+}
+
+
+/* @return nonzero while <b>mb</b> (which may be NULL) is under pressure. */
+int
+mem_pressure(struct mem_budget *mb)
+{
+        return mb && __atomic_load_n(&mb->pressure, __ATOMIC_RELAXED);
+}
+
+
+/* Start an empty account for one connection, charged to <b>mb</b> if it is
+ * not NULL. */
+void
+mem_account_init(struct mem_account *acct, struct mem_budget *mb)
+{
+        acct->budget = mb;
+        acct->used = 0;
+        acct->limit = mb ? mb->conn_limit : SIZE_MAX;
+}
+
+
+/*
+ * Charge <b>n</b> bytes to <b>acct</b>.  The shared budget is soft: going
+ * over it only switches on pressure mode.
+ * @return 0 on success, -ENOBUFS if the connection's own cap is reached.
+ */
+int
+mem_charge(struct mem_account *acct, size_t n)
+{
+        struct mem_budget *mb = acct->budget;
+        int zero = 0;
+
+        if (n > acct->limit - acct->used) {
+                if (mb)
+                        __atomic_add_fetch(&mb->refused, 1, __ATOMIC_RELAXED);
+                return -ENOBUFS;
+        }
+        acct->used += n;
+
+        if (mb && __atomic_add_fetch(&mb->used, n, __ATOMIC_RELAXED) >=
+                  mb->limit &&
+            __atomic_compare_exchange_n(&mb->pressure, &zero, 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                __atomic_add_fetch(&mb->pressured, 1, __ATOMIC_RELAXED);
+                net_debug("Buffers use %zu bytes; no longer reading from "
+                         "clients.\n", mb->limit);
+        }
+        return 0;
+}
+
+
+/* Give back <b>n</b> bytes charged to <b>acct</b>. */
+void
+mem_uncharge(struct mem_account *acct, size_t n)
+{
+        struct mem_budget *mb = acct->budget;
+
+        acct->used -= n;
+        if (mb && __atomic_sub_fetch(&mb->used, n, __ATOMIC_RELAXED) <=
+                  MEM_LOW_WATERMARK(mb->limit) &&
+            __atomic_load_n(&mb->pressure, __ATOMIC_RELAXED))
+                __atomic_store_n(&mb->pressure, 0, __ATOMIC_RELAXED);
+}
+
+
+/* Start an empty buffer charged to <b>acct</b>. */
+void
+mbuf_init(struct mbuf *b, struct mem_account *acct)
+{
+        memset(b, 0, sizeof(*b));
+        b->acct = acct;
+}
+
+
+void
+mbuf_free(struct mbuf *b)
+{
+        free(b->data);
+        if (b->cap)
+                mem_uncharge(b->acct, b->cap);
+        b->data = NULL;
+        b->off = b->len = b->cap = 0;
+}
+
+
+/*
+ * Make room for <b>n</b> more bytes after the buffered ones.
+ * @return 0 on success, -ENOBUFS if that would take the connection over
+ *      its cap and -ENOMEM if out of memory.
+ */
+int
+mbuf_reserve(struct mbuf *b, size_t n)
+{
+        size_t want, pending = mbuf_len(b);
+        char *data;
+        int err;
+
+        if (b->cap - b->len >= n)
+                return 0;
+        /* Slide what is left to the front before growing. */
+        if (b->off) {
+                memmove(b->data, b->data + b->off, pending);
+                b->off = 0;
+                b->len = pending;
+                if (b->cap - b->len >= n)
+                        return 0;
+        }
+
+        want = (pending + n + MBUF_CHUNK - 1) / MBUF_CHUNK * MBUF_CHUNK;
+        err = mem_charge(b->acct, want - b->cap);
+        if (err < 0)
+                return err;
+        data = realloc(b->data, want);
+        if (!data) {
+                mem_uncharge(b->acct, want - b->cap);
+                return -ENOMEM;
+        }
+        b->data = data;
+        b->cap = want;
+        return 0;
+}
+
+
+/* Drop the first <b>n</b> buffered bytes, and any memory beyond one chunk
+ * once the buffer is empty. */
+void
+mbuf_consume(struct mbuf *b, size_t n)
+{
+        char *data;
+
+        b->off += n;
+        if (b->off < b->len)
+                return;
+
+        b->off = b->len = 0;
+        if (b->cap > MBUF_CHUNK) {
+                data = realloc(b->data, MBUF_CHUNK);
+                if (data) {
+                        b->data = data;
+                        mem_uncharge(b->acct, b->cap - MBUF_CHUNK);
+                        b->cap = MBUF_CHUNK;
+                }
+        }
+}
+
+
+/*
+ * Read what <b>fd</b> has into <b>b</b>, as net_read().  Under memory
+ * pressure, a buffer holding data must be written out first; an empty one
+ * waits for the pressure to lift without touching the socket.
+ * @return the number of bytes read, 0 on EOF or a negative errno;
+ *      -ENOBUFS means the connection must write out what it holds
+ *      before it may read more.
+ */
+int
+mbuf_read(struct mbuf *b, int fd)
+{
+        int r;
+
+        while (mem_pressure(b->acct->budget)) {
+                if (mbuf_len(b))
+                        return -ENOBUFS;
+                /* No events: wake early only if the peer goes away. */
+                r = net_wait(fd, 0, MEM_PRESSURE_POLL_MS);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        break;
+        }
+
+        if (b->cap == b->len) {
+                r = mbuf_reserve(b, MBUF_CHUNK);
+                if (r < 0 && b->cap == b->len)
+                        return r;
+        }
+
+        r = net_read(fd, b->data + b->len, b->cap - b->len);
+        if (r > 0)
+                b->len += (size_t) r;
+        return r;
+}
+
+
+/*
+ * Write everything buffered in <b>b</b> to <b>fd</b>, as net_write().
+ * @return the number of bytes written, or a negative errno.
+ */
+int
+mbuf_write(struct mbuf *b, int fd)
+{
+        int r;
+
+        if (!mbuf_len(b))
+                return 0;
+        r = net_write(fd, b->data + b->off, mbuf_len(b));
+        if (r > 0)
+                mbuf_consume(b, (size_t) r);
+        return r;
+}
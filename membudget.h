@@ -0,0 +1,67 @@
+/* Memory accounting for connection buffers.
+ *
+ * Every buffer is charged to its connection's account, which is capped,
+ * and through it to a budget shared by all workers.  Once the budget is
+ * used up the server is under pressure: buffers stop reading from their
+ * sockets, so TCP flow control pushes back on fast senders, and the
+ * acceptor stops accepting, until usage falls below the low watermark. */
+
+#ifndef _MEMBUDGET_H
+#define _MEMBUDGET_H
+
+#include <stddef.h>
+
+#define MEM_DEFAULT_LIMIT (256 * 1024 * 1024)
+#define MEM_DEFAULT_CONN_LIMIT (1024 * 1024)
+/* Pressure ends once usage is back under 7/8 of the limit. */
+#define MEM_LOW_WATERMARK(limit) ((limit) - (limit) / 8)
+/* How often a reader held off by pressure looks again. */
+#define MEM_PRESSURE_POLL_MS 10
+
+/* Buffers grow in steps of this and shrink back to it once drained. */
+#define MBUF_CHUNK 16384
+
+struct mem_budget {
+        size_t limit;
+        size_t conn_limit;
+        size_t used;
+        int pressure;
+        /* Times pressure was entered, and charges refused by a conn cap. */
+        unsigned long pressured;
+        unsigned long refused;
+};
+
+struct mem_account {
+        struct mem_budget *budget;
+        size_t used;
+        size_t limit;
+};
+
+struct mbuf {
+        char *data;
+        /* Unconsumed bytes are data[off, len). */
+        size_t off;
+        size_t len;
+        size_t cap;
+        struct mem_account *acct;
+};
+
+struct mem_budget *mem_budget_create(size_t limit, size_t conn_limit);
+void mem_budget_delete(struct mem_budget *mb);
+int mem_pressure(struct mem_budget *mb);
+
+void mem_account_init(struct mem_account *acct, struct mem_budget *mb);
+int mem_charge(struct mem_account *acct, size_t n);
+void mem_uncharge(struct mem_account *acct, size_t n);
+
+void mbuf_init(struct mbuf *b, struct mem_account *acct);
+void mbuf_free(struct mbuf *b);
+int mbuf_reserve(struct mbuf *b, size_t n);
+void mbuf_consume(struct mbuf *b, size_t n);
+int mbuf_read(struct mbuf *b, int fd);
+int mbuf_write(struct mbuf *b, int fd);
+
+/* Bytes waiting in <b>b</b>. */
+#define mbuf_len(b) ((b)->len - (b)->off)
+
+#endif
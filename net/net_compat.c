@@ -1,15 +1,32 @@
 /** Modified and simplified tor_compat.c */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For accept4() and struct ucred. */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -19,7 +36,17 @@
 /** Headers for net_sockets */
 #include "net_util.h"
 #include "net_compat.h"
+#include "net_trace.h"
+#include "net_zerocopy.h"
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#if defined(__linux__) && !defined(HAVE_ACCEPT4)
+/* Saves two fcntl() calls per accepted connection. */
+#define HAVE_ACCEPT4
+#endif
 
 
 #if defined(_WIN32)
@@ -162,7 +189,7 @@ net_socket_make_exclusive_win32(net_socket_fd_t sock)
  * -1 on failure.
  */
 int
-net_socket_make_reuseable_unix(net_socket_t sock)
+net_socket_make_reuseable_unix(net_socket_fd_t sock)
 {
 // TODO: Check if tor uses these options on every socket including 1024+
         int one = 1;
@@ -209,11 +236,138 @@ _net_socket_set_nonblocking(net_socket_fd_t sock)
 }
 
 
+/* Best-effort setsockopt() of an int option; tuning failures are logged but
+ * never fatal.  Returns 0 on success, -1 on failure. */
+static int
+_net_setsockopt_int(net_socket_fd_t sock, int level, int name, int value,
+                    const char *what)
+{
+        if (setsockopt(sock, level, name, (void*) &value,
+                       (socklen_t) sizeof(value)) == -1) {
+                net_debug("Couldn't set %s: %s.\n", what,
+                          net_socket_strerror(net_socket_errno(sock)));
+                return -1;
+        }
+        return 0;
+}
+
+
+/**
+ * Apply the options of <b>prof</b> that make sense for a socket playing
+ * <b>role</b> (NET_SOCKOPT_LISTENER, NET_SOCKOPT_ACCEPTED or
+ * NET_SOCKOPT_CLIENT) in address family <b>domain</b>.
+ *
+ * Accepted sockets inherit buffer sizes, TCP_NODELAY, timestamping and the
+ * busy poll settings from their listener, so the only option set on them
+ * is TCP_QUICKACK, which the kernel clears again on its own.  TCP options
+ * are skipped for non-IP sockets.
+ *
+ * Returns the number of options that could not be set.
+ */
+int
+net_socket_apply_profile(net_socket_fd_t sock, int domain,
+                         const struct net_sockopt_profile *prof, int role)
+{
+        int failed = 0;
+        int is_tcp = (domain == AF_INET || domain == AF_INET6);
+
+        if (!prof)
+                return 0;
+
+        if (role == NET_SOCKOPT_ACCEPTED) {
+#ifdef TCP_QUICKACK
+                if (is_tcp && prof->quickack)
+                        failed -= _net_setsockopt_int(sock, IPPROTO_TCP,
+                                        TCP_QUICKACK, 1, "TCP_QUICKACK");
+#endif
+                return failed;
+        }
+
+        /* Buffer sizes must be set before listen() or connect() for the
+         * window scale to be negotiated accordingly. */
+        if (prof->rcvbuf)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET, SO_RCVBUF,
+                                              prof->rcvbuf, "SO_RCVBUF");
+        if (prof->sndbuf)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET, SO_SNDBUF,
+                                              prof->sndbuf, "SO_SNDBUF");
+#ifdef SO_BUSY_POLL
+        if (prof->busy_poll)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET, SO_BUSY_POLL,
+                                              prof->busy_poll, "SO_BUSY_POLL");
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+        if (prof->prefer_busy_poll)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET,
+                                        SO_PREFER_BUSY_POLL, 1,
+                                        "SO_PREFER_BUSY_POLL");
+#endif
+#ifdef SO_BUSY_POLL_BUDGET
+        if (prof->busy_poll_budget)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET,
+                                        SO_BUSY_POLL_BUDGET,
+                                        prof->busy_poll_budget,
+                                        "SO_BUSY_POLL_BUDGET");
+#endif
+#if defined(SO_TIMESTAMPING) && defined(__linux__)
+        /* Stamping is switched on in the stack only while some socket
+         * asks for it, so it must be on before the data arrives. */
+        if (prof->timestamping)
+                failed -= _net_setsockopt_int(sock, SOL_SOCKET,
+                                SO_TIMESTAMPING,
+                                SOF_TIMESTAMPING_RX_SOFTWARE |
+                                SOF_TIMESTAMPING_RX_HARDWARE |
+                                SOF_TIMESTAMPING_SOFTWARE |
+                                SOF_TIMESTAMPING_RAW_HARDWARE,
+                                "SO_TIMESTAMPING");
+#endif
+
+        if (!is_tcp)
+                return failed;
+
+        if (prof->nodelay)
+                failed -= _net_setsockopt_int(sock, IPPROTO_TCP, TCP_NODELAY,
+                                              1, "TCP_NODELAY");
+
+        if (role == NET_SOCKOPT_LISTENER) {
+#ifdef TCP_DEFER_ACCEPT
+                /* Do not wake the acceptor until the client sent data. */
+                if (prof->defer_accept)
+                        failed -= _net_setsockopt_int(sock, IPPROTO_TCP,
+                                        TCP_DEFER_ACCEPT, prof->defer_accept,
+                                        "TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+                if (prof->fastopen)
+                        failed -= _net_setsockopt_int(sock, IPPROTO_TCP,
+                                        TCP_FASTOPEN, prof->fastopen,
+                                        "TCP_FASTOPEN");
+#endif
+        } else {
+#ifdef TCP_FASTOPEN_CONNECT
+                /* connect() then returns at once and the SYN leaves with
+                 * the first write, carrying its data. */
+                if (prof->fastopen)
+                        failed -= _net_setsockopt_int(sock, IPPROTO_TCP,
+                                        TCP_FASTOPEN_CONNECT, 1,
+                                        "TCP_FASTOPEN_CONNECT");
+#endif
+#ifdef TCP_QUICKACK
+                if (prof->quickack)
+                        failed -= _net_setsockopt_int(sock, IPPROTO_TCP,
+                                        TCP_QUICKACK, 1, "TCP_QUICKACK");
+#endif
+        }
+        return failed;
+}
+
+
 /**
  * As socket().
  *
  * <b>cloexec</b> and <b>nonblock</b> should be either 0 or 1 to indicate
  * if the corresponding extension, SOCK_CLOEXEC or SOCK_NONBLOCK, should be used.
+ * If <b>prof</b> is not NULL its options for <b>role</b> are applied.
  *
  * Returns net_socket_fd_t, a macro to an int that holds socket fds.
  *
@@ -221,7 +375,8 @@ _net_socket_set_nonblocking(net_socket_fd_t sock)
  * read ernno.
  */
 net_socket_fd_t
-_net_socket(int domain, int type, int protocol, int cloexec, int nonblock)
+_net_socket(int domain, int type, int protocol, int cloexec, int nonblock,
+            const struct net_sockopt_profile *prof, int role)
 {
         net_socket_fd_t s;
         /*
@@ -284,6 +439,7 @@ _net_socket(int domain, int type, int protocol, int cloexec, int nonblock)
         goto net_socket_open_ok;
 
 net_socket_open_ok:
+        net_socket_apply_profile(s, domain, prof, role);
         return s;
 }
 
@@ -297,7 +453,7 @@ net_socket_open_ok:
 net_socket_fd_t
 net_socket_blocking(int domain, int type, int protocol)
 {
-        return _net_socket(domain, type, protocol, 1, 0);
+        return _net_socket(domain, type, protocol, 1, 0, NULL, 0);
 }
         
 
@@ -310,7 +466,21 @@ net_socket_blocking(int domain, int type, int protocol)
 net_socket_fd_t
 net_socket_nonblocking(int domain, int type, int protocol)
 {
-        return _net_socket(domain, type, protocol, 1, 1);
+        return _net_socket(domain, type, protocol, 1, 1, NULL, 0);
+}
+
+
+/**
+ * As net_socket_nonblocking(), tuned with <b>prof</b> for <b>role</b>
+ * (NET_SOCKOPT_LISTENER or NET_SOCKOPT_CLIENT).
+ *
+ * Returns -1 if an error occurred.  Use the macro net_socket_errno to read
+ * ernno. */
+net_socket_fd_t
+net_socket_nonblocking_tuned(int domain, int type, int protocol,
+                             const struct net_sockopt_profile *prof, int role)
+{
+        return _net_socket(domain, type, protocol, 1, 1, prof, role);
 }
 
 
@@ -352,11 +522,13 @@ net_close(net_socket_fd_t sock_fd)
  * and SOCK_NONBLOCK specified.
  *
  * <b>cloexec</b> and <b>nonblock</b> should be either 0 or 1 to indicate
- * if the corresponding extension should be used.
+ * if the corresponding extension should be used.  If <b>prof</b> is not
+ * NULL, the options that are not inherited from the listener are applied.
  */
 net_socket_fd_t
 _net_accept(net_socket_fd_t sock_fd, struct sockaddr *addr,
-            socklen_t *len, int cloexec, int nonblock)
+            socklen_t *len, int cloexec, int nonblock,
+            const struct net_sockopt_profile *prof)
 {
         /* The socket returned and connected to the new client. */
         net_socket_fd_t client_fd;
@@ -367,7 +539,7 @@ _net_accept(net_socket_fd_t sock_fd, struct sockaddr *addr,
         client_fd = accept4(sock_fd, addr, len, ext_flags);
         
         if (NET_SOCKET_OK(client_fd))
-                return client_fd;
+                goto net_accept_ok;
         /* If we got an error, see if it is ENOSYS. ENOSYS indicates that,
         * even though we were built on a system with accept4 support, we
         * are running on one without. Also, check for EINVAL, which indicates
@@ -404,6 +576,12 @@ _net_accept(net_socket_fd_t sock_fd, struct sockaddr *addr,
                 }
         }
 
+        goto net_accept_ok;
+
+net_accept_ok:
+        if (prof && addr)
+                net_socket_apply_profile(client_fd, addr->sa_family, prof,
+                                         NET_SOCKOPT_ACCEPTED);
         return client_fd;
 }
 
@@ -417,7 +595,7 @@ net_socket_fd_t
 net_accept_blocking(net_socket_fd_t sock_fd, struct sockaddr *addr,
                     socklen_t *len)
 {
-        return _net_accept(sock_fd, addr, len, 1, 0);
+        return _net_accept(sock_fd, addr, len, 1, 0, NULL);
 }
         
 
@@ -431,76 +609,978 @@ net_socket_fd_t
 net_accept_nonblocking(net_socket_fd_t sock_fd, struct sockaddr *addr,
                        socklen_t *len)
 {
-        return _net_accept(sock_fd, addr, len, 1, 1);
+        return _net_accept(sock_fd, addr, len, 1, 1, NULL);
+}
+
+
+/**
+ * As net_accept_nonblocking(), applying the per-connection options of
+ * <b>prof</b> to the new socket.
+ *
+ * Returns -1 if an error occurred.  Use the macro net_socket_errno to read
+ * ernno. */
+net_socket_fd_t
+net_accept_nonblocking_tuned(net_socket_fd_t sock_fd, struct sockaddr *addr,
+                             socklen_t *len,
+                             const struct net_sockopt_profile *prof)
+{
+        return _net_accept(sock_fd, addr, len, 1, 1, prof);
 }
 
 
-/* As write(), but retry on EINTR, and return the negative error code on
+/** As send(), but retry on EINTR, and return the negative error code on
  * error. */
 static int
-write_ni(int fd, const void *buf, size_t n)
+send_ni(net_socket_fd_t fd, const void *buf, size_t n, int flags)
 {
-  int r;
+        int r;
  again:
-  r = (int) write(fd, buf, n);
-  if (r < 0) {
-    if (errno == EINTR)
-      goto again;
-    else
-      return -errno;
-  }
-  return r;
-}
-/* As read(), but retry on EINTR, and return the negative error code on error.
- */
+        r = (int) send(fd, buf, n, flags);
+        if (r < 0) {
+                int error = net_socket_errno(fd);
+                if (NET_SOCKET_ERRNO_IS_EINTR(error))
+                        goto again;
+                else
+                        return -error;
+        }
+        return r;
+}
+
+/** As recv(), but retry on EINTR, and return the negative error code on
+ * error. */
 static int
-read_ni(int fd, void *buf, size_t n)
+recv_ni(net_socket_fd_t fd, void *buf, size_t n, int flags)
 {
-  int r;
+        int r;
  again:
-  r = (int) read(fd, buf, n);
-  if (r < 0) {
-    if (errno == EINTR)
-      goto again;
-    else
-      return -errno;
-  }
-  return r;
+        r = (int) recv(fd, buf, n, flags);
+        if (r < 0) {
+                int error = net_socket_errno(fd);
+                if (NET_SOCKET_ERRNO_IS_EINTR(error))
+                        goto again;
+                else
+                        return -error;
+        }
+        return r;
 }
+
+
+/** Consulted by net_wait() before it polls; see net_set_wait_hook(). */
+static net_wait_hook_fn net_wait_hook = NULL;
+
+/**
+ * Install <b>hook</b> (or NULL) for every later net_wait().  Call it before
+ * starting any thread that uses net_wait().
+ */
+void
+net_set_wait_hook(net_wait_hook_fn hook)
+{
+        net_wait_hook = hook;
+}
+
+
+/** Shown what net_read() returns; see net_set_read_hook(). */
+static net_read_hook_fn net_read_hook = NULL;
+
+/**
+ * Install <b>hook</b> (or NULL) for every later net_read().  Call it before
+ * starting any thread that uses net_read().
+ */
+void
+net_set_read_hook(net_read_hook_fn hook)
+{
+        net_read_hook = hook;
+}
+
+
+/**
+ * Wait until <b>sock_fd</b> is ready for <b>events</b> (POLLIN, POLLOUT),
+ * for at most <b>timeout_ms</b> milliseconds (-1 waits forever).
+ *
+ * Returns 1 when ready, 0 on timeout and the negative error code on error.
+ */
+int
+net_wait(net_socket_fd_t sock_fd, int events, int timeout_ms)
+{
+        struct pollfd pfd;
+        int r;
+
+        if (net_wait_hook && net_wait_hook(sock_fd, events, timeout_ms, &r))
+                return r;
+
+        pfd.fd = sock_fd;
+        pfd.events = (short) events;
+        pfd.revents = 0;
+ again:
+        r = poll(&pfd, 1, timeout_ms);
+        if (r < 0) {
+                if (errno == EINTR)
+                        goto again;
+                return -errno;
+        }
+        return r ? 1 : 0;
+}
+
+
+/**
+ * As recv() on a nonblocking socket, but wait up to NET_IO_TIMEOUT_MS for
+ * data instead of failing with EAGAIN.
+ *
+ * Returns the number of bytes read, 0 on EOF and the negative error code on
+ * error (-ETIMEDOUT if the peer sent nothing in time).
+ */
+int
+net_read(net_socket_fd_t sock_fd, void *buf, size_t n)
+{
+        int r;
+
+        for (;;) {
+                r = recv_ni(sock_fd, buf, n, 0);
+                if (r > 0) {
+                        net_trace(NET_TRACE_READ, sock_fd);
+                        if (net_read_hook)
+                                net_read_hook(sock_fd, buf, r);
+                }
+                if (r >= 0 || !NET_SOCKET_ERRNO_IS_EAGAIN(-r))
+                        return r;
+
+                r = net_wait(sock_fd, POLLIN, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+}
+
+
+/** Write all <b>n</b> bytes, as net_write() without batching, passing
+ * <b>flags</b> on to send(). */
+static int
+_net_write_all(net_socket_fd_t sock_fd, const void *buf, size_t n, int flags)
+{
+        const char *p = buf;
+        size_t left = n;
+        int r;
+
+        while (left) {
+                r = send_ni(sock_fd, p, left, MSG_NOSIGNAL | flags);
+                if (r >= 0) {
+                        p += r;
+                        left -= (size_t) r;
+                        continue;
+                }
+                if (!NET_SOCKET_ERRNO_IS_EAGAIN(-r))
+                        return r;
+
+                r = net_wait(sock_fd, POLLOUT, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+        net_trace(NET_TRACE_FLUSH, sock_fd);
+        return (int) n;
+}
+
+
+/** The batch net_write() fills on this thread; see net_batch_set(). */
+static __thread struct net_batch *net_batch_current;
+
+/**
+ * Allocate a batch for small writes to <b>sock_fd</b>.
+ *
+ * Returns the batch, or NULL if out of memory.
+ */
+struct net_batch *
+net_batch_new(net_socket_fd_t sock_fd)
+{
+        struct net_batch *b;
+
+        b = calloc(1, sizeof(*b) + NET_BATCH_SIZE);
+        if (!b)
+                return NULL;
+        b->fd = sock_fd;
+        b->buf = (char *) (b + 1);
+        b->flush_bytes = NET_BATCH_MIN_BYTES;
+        b->flush_ns = NET_BATCH_MIN_NS;
+        return b;
+}
+
+
+/** Free <b>b</b>, dropping anything still in it; flush it first.  Waits
+ * for the kernel to finish with any zerocopy buffers, so call it before
+ * closing the socket. */
+void
+net_batch_free(struct net_batch *b)
+{
+        if (!b)
+                return;
+        if (net_batch_current == b)
+                net_batch_current = NULL;
+        if (b->zc) {
+                net_zc_sock_drain(b->zc, NET_BATCH_ZC_DRAIN_MS);
+                free(b->zc);
+        }
+        free(b);
+}
+
+
+/**
+ * Have writes of at least <b>threshold</b> bytes (0 for
+ * NET_ZC_DEFAULT_THRESHOLD) through <b>b</b> go out with MSG_ZEROCOPY from
+ * buffers of <b>pool</b>; smaller ones are still copied.  Completions are
+ * reaped as later writes go out, and by net_batch_free().
+ *
+ * Returns 0 on success, -1 if out of memory.
+ */
+int
+net_batch_zerocopy(struct net_batch *b, struct net_zc_pool *pool,
+                   size_t threshold)
+{
+        b->zc = malloc(sizeof(*b->zc));
+        if (!b->zc)
+                return -1;
+        net_zc_sock_init(b->zc, b->fd, threshold);
+        b->zc_pool = pool;
+        return 0;
+}
+
+
+/**
+ * Make net_write() to <b>b</b>'s socket on this thread collect into
+ * <b>b</b> until the next call; NULL writes straight through again.  Whoever
+ * sets a batch calls net_flush() before the data is due, at the latest
+ * before waiting for anything else.
+ */
+void
+net_batch_set(struct net_batch *b)
+{
+        net_batch_current = b;
+}
+
+
+/** Size <b>b</b>'s thresholds to the path's smoothed RTT: a far client
+ * hardly notices a short hold and gains most from fewer packets, while on
+ * a fast path holding for long costs more than it saves. */
+static void
+_net_batch_tune(struct net_batch *b)
+{
+        uint64_t bytes = NET_BATCH_MIN_BYTES, ns = NET_BATCH_MIN_NS;
+#if defined(TCP_INFO)
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+
+        if (getsockopt(b->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 &&
+            ti.tcpi_rtt) {
+                b->rtt_us = ti.tcpi_rtt;
+                bytes = (uint64_t) ti.tcpi_rtt * NET_BATCH_BYTES_PER_US;
+                ns = (uint64_t) ti.tcpi_rtt * 1000 / NET_BATCH_RTT_DIV;
+        }
 #endif
+        if (bytes < NET_BATCH_MIN_BYTES)
+                bytes = NET_BATCH_MIN_BYTES;
+        if (bytes > NET_BATCH_SIZE)
+                bytes = NET_BATCH_SIZE;
+        if (ns < NET_BATCH_MIN_NS)
+                ns = NET_BATCH_MIN_NS;
+        if (ns > NET_BATCH_MAX_NS)
+                ns = NET_BATCH_MAX_NS;
+        b->flush_bytes = (size_t) bytes;
+        b->flush_ns = ns;
+}
 
-/** As send(), but retry on EINTR, and return the negative error code on
- * error. */
+
+/** Send what <b>b</b> holds.  With <b>more</b> the kernel is told more is
+ * coming and keeps a partial segment back; without, everything held so
+ * far, here or in the kernel, goes out now. */
 static int
-send_ni(int fd, const void *buf, size_t n, int flags)
+_net_batch_flush(struct net_batch *b, int more)
 {
-  int r;
- again:
-  r = (int) send(fd, buf, n, flags);
-  if (r < 0) {
-    int error = tor_socket_errno(fd);
-    if (ERRNO_IS_EINTR(error))
-      goto again;
-    else
-      return -error;
-  }
-  return r;
+        int r;
+
+        if (b->len) {
+                b->flushing = 1;
+                r = _net_write_all(b->fd, b->buf, b->len,
+                                   more ? MSG_MORE : 0);
+                b->flushing = 0;
+                b->len = 0;
+                b->sends++;
+                if (b->sends % NET_BATCH_RETUNE == 0)
+                        _net_batch_tune(b);
+                if (r < 0)
+                        return r;
+                b->corked = more;
+                return 0;
+        }
+        if (!more && b->corked) {
+#if defined(TCP_CORK)
+                int off = 0;
+
+                /* Uncorking pushes what MSG_MORE held back. */
+                setsockopt(b->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+#endif
+                b->corked = 0;
+        }
+        return 0;
 }
 
-/** As recv(), but retry on EINTR, and return the negative error code on
- * error. */
+
+/** Write all <b>n</b> bytes through <b>b</b>'s zerocopy socket, copied
+ * into pooled buffers the kernel sends from and lets go of later; once the
+ * pool runs dry the rest is copied by the kernel as usual. */
 static int
-recv_ni(int fd, void *buf, size_t n, int flags)
+_net_batch_zc_write(struct net_batch *b, const void *buf, size_t n)
 {
-  int r;
- again:
-  r = (int) recv(fd, buf, n, flags);
-  if (r < 0) {
-    int error = tor_socket_errno(fd);
-    if (ERRNO_IS_EINTR(error))
-      goto again;
-    else
-      return -error;
-  }
-  return r;
+        struct net_zc_sock *zs = b->zc;
+        const char *p = buf;
+        size_t left = n;
+        int r;
+
+        r = net_zc_reap(zs);
+        if (r < 0)
+                return r;
+        while (left) {
+                struct net_zc_buf *zb = net_zc_buf_get(b->zc_pool);
+                size_t len, sent = 0;
+
+                if (!zb) {
+                        r = _net_write_all(b->fd, p, left, 0);
+                        return r < 0 ? r : (int) n;
+                }
+                len = zb->len = left < zb->cap ? left : zb->cap;
+                memcpy(zb->data, p, len);
+                while (sent < len) {
+                        r = net_zc_send(zs, zb, sent);
+                        if (r >= 0) {
+                                sent += (size_t) r;
+                                continue;
+                        }
+                        if (!NET_SOCKET_ERRNO_IS_EAGAIN(-r))
+                                break;
+                        /* Completions show up as POLLERR, which wakes us
+                         * as well. */
+                        r = net_wait(b->fd, POLLOUT, NET_IO_TIMEOUT_MS);
+                        if (r == 0)
+                                r = -ETIMEDOUT;
+                        if (r < 0)
+                                break;
+                        net_zc_reap(zs);
+                }
+                /* Back to the pool with its last completion. */
+                net_zc_release(zs, zb);
+                if (r < 0)
+                        return r;
+                p += len;
+                left -= len;
+                net_zc_reap(zs);
+        }
+        net_trace(NET_TRACE_FLUSH, b->fd);
+        return (int) n;
+}
+
+
+/** net_write() into batch <b>b</b>. */
+static int
+_net_batch_write(struct net_batch *b, const void *buf, size_t n)
+{
+        uint64_t now;
+        int r, zc;
+
+        if (!b->sends && !b->len && !b->rtt_us)
+                _net_batch_tune(b);
+
+        zc = b->zc && n >= b->zc->threshold;
+        if (zc || n >= b->flush_bytes || b->len + n > NET_BATCH_SIZE) {
+                /* Too big to be worth copying: goes out behind what is held,
+                 * and pushes it all. */
+                r = _net_batch_flush(b, 1);
+                if (r < 0)
+                        return r;
+                if (zc || n >= b->flush_bytes) {
+                        b->corked = 0;
+                        if (zc)
+                                return _net_batch_zc_write(b, buf, n);
+                        return _net_write_all(b->fd, buf, n, 0);
+                }
+        }
+
+        now = net_now_ns();
+        if (!b->len)
+                b->first_ns = now;
+        memcpy(b->buf + b->len, buf, n);
+        b->len += n;
+        if (b->len >= b->flush_bytes || now - b->first_ns >= b->flush_ns) {
+                r = _net_batch_flush(b, 1);
+                if (r < 0)
+                        return r;
+        }
+        return (int) n;
+}
+
+
+/**
+ * Send whatever the current batch holds for <b>sock_fd</b>, if any.  Pass
+ * <b>more</b> if the caller is about to write to the socket itself, e.g.
+ * with sendfile(), so that what is held goes in the same segments as what
+ * follows; otherwise it is all pushed out now.
+ *
+ * Returns 0 on success and the negative error code on error.
+ */
+int
+net_flush(net_socket_fd_t sock_fd, int more)
+{
+        struct net_batch *b = net_batch_current;
+
+        if (!b || b->fd != sock_fd || b->flushing)
+                return 0;
+        return _net_batch_flush(b, more);
+}
+
+
+/**
+ * As send() on a nonblocking socket, but keep going until all <b>n</b>
+ * bytes are written, waiting up to NET_IO_TIMEOUT_MS each time the socket
+ * buffer is full.  While a batch for <b>sock_fd</b> is set, small writes
+ * are only copied into it and go out together; see net_batch_set().
+ *
+ * Returns <b>n</b> on success and the negative error code on error.
+ */
+int
+net_write(net_socket_fd_t sock_fd, const void *buf, size_t n)
+{
+        struct net_batch *b = net_batch_current;
+
+        if (b && b->fd == sock_fd && !b->flushing)
+                return _net_batch_write(b, buf, n);
+        return _net_write_all(sock_fd, buf, n, 0);
+}
+
+
+/**
+ * Peek at when the next unread byte on <b>sock_fd</b> arrived, as stamped
+ * by the kernel (<b>sw_ns</b>) and the NIC (<b>hw_ns</b>) once the socket
+ * has SO_TIMESTAMPING on; see net_sockopt_profile.  Both are CLOCK_REALTIME
+ * nanoseconds, or 0 when that stamp is missing.  Hardware stamps are in the
+ * NIC's clock, which is only comparable if it is synced to the system's.
+ * Nothing is consumed and the call never waits.
+ *
+ * Returns 1 with the stamps, 0 if no data is queued yet and the negative
+ * error code on error.
+ */
+int
+net_rx_timestamp(net_socket_fd_t sock_fd, uint64_t *sw_ns, uint64_t *hw_ns)
+{
+        char byte;
+        union {
+                char buf[CMSG_SPACE(3 * sizeof(struct timespec))];
+                struct cmsghdr align;
+        } control;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        ssize_t r;
+
+        *sw_ns = *hw_ns = 0;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        do {
+                r = recvmsg(sock_fd, &msg, MSG_PEEK | MSG_DONTWAIT);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0)
+                return NET_SOCKET_ERRNO_IS_EAGAIN(errno) ? 0 : -errno;
+        if (r == 0)
+                return 0;
+
+#ifdef SCM_TIMESTAMPING
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                struct timespec ts[3];
+
+                if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_TIMESTAMPING)
+                        continue;
+                /* ts[0] is the software stamp, ts[2] the raw hardware
+                 * one; ts[1] is unused. */
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+                *sw_ns = (uint64_t) ts[0].tv_sec * 1000000000u +
+                         (uint64_t) ts[0].tv_nsec;
+                *hw_ns = (uint64_t) ts[2].tv_sec * 1000000000u +
+                         (uint64_t) ts[2].tv_nsec;
+        }
+#else
+        (void) cmsg;
+#endif
+        return 1;
+}
+
+
+/**
+ * Fill <b>sun</b> with the AF_UNIX address <b>path</b>; a leading '@'
+ * stands for the abstract namespace, as in ss(8).  Stores the address
+ * length in *<b>len</b>.
+ *
+ * Returns 0 on success and -ENAMETOOLONG if <b>path</b> does not fit.
+ */
+static int
+_net_unix_addr(const char *path, struct sockaddr_un *sun, socklen_t *len)
+{
+        size_t n = strlen(path);
+
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        if (n >= sizeof(sun->sun_path))
+                return -ENAMETOOLONG;
+        memcpy(sun->sun_path, path, n);
+        if (path[0] == '@') {
+                /* Abstract names are not NUL terminated; the length
+                 * says where they end. */
+                sun->sun_path[0] = '\0';
+                *len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) +
+                                    n);
+        } else {
+                *len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) +
+                                    n + 1);
+        }
+        return 0;
+}
+
+
+/**
+ * Open a nonblocking AF_UNIX listener of <b>type</b> (SOCK_STREAM or
+ * SOCK_SEQPACKET) on <b>path</b>, "@name" for the abstract namespace.  A
+ * stale socket file left at <b>path</b> is replaced.  With
+ * <b>passcred</b>, SO_PASSCRED is set and inherited by accepted sockets,
+ * so that net_unix_recv_cred() sees who sent each message.  <b>prof</b>
+ * (may be NULL) is applied as for a TCP listener, minus the TCP options.
+ *
+ * Returns the socket, or NET_INVALID_SOCKET on failure with errno set.
+ */
+net_socket_fd_t
+net_unix_listen(const char *path, int type, int passcred,
+                const struct net_sockopt_profile *prof)
+{
+        struct sockaddr_un sun;
+        struct stat st;
+        socklen_t len;
+        net_socket_fd_t s;
+        int err;
+
+        err = _net_unix_addr(path, &sun, &len);
+        if (err < 0) {
+                errno = -err;
+                return NET_INVALID_SOCKET;
+        }
+        s = net_socket_nonblocking_tuned(AF_UNIX, type, 0, prof,
+                                         NET_SOCKOPT_LISTENER);
+        if (!NET_SOCKET_OK(s))
+                return s;
+
+#ifdef SO_PASSCRED
+        if (passcred && _net_setsockopt_int(s, SOL_SOCKET, SO_PASSCRED, 1,
+                                            "SO_PASSCRED") < 0)
+                goto err;
+#else
+        (void) passcred;
+#endif
+        /* Only ever remove a socket, never a file someone mistyped. */
+        if (path[0] != '@' && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(path);
+        if (bind(s, (struct sockaddr *) &sun, len) < 0)
+                goto err;
+        if (listen(s, (prof && prof->backlog) ? prof->backlog
+                                              : SOMAXCONN) < 0)
+                goto err;
+        return s;
+
+ err:
+        err = errno;
+        net_close(s);
+        errno = err;
+        return NET_INVALID_SOCKET;
+}
+
+
+/**
+ * Open a nonblocking AF_UNIX socket of <b>type</b> connected to
+ * <b>path</b>, "@name" for the abstract namespace, tuned with <b>prof</b>
+ * (may be NULL).  Unlike TCP the connection is made, or refused, at once;
+ * a full backlog fails with EAGAIN.
+ *
+ * Returns the socket, or NET_INVALID_SOCKET on failure with errno set.
+ */
+net_socket_fd_t
+net_unix_connect(const char *path, int type,
+                 const struct net_sockopt_profile *prof)
+{
+        struct sockaddr_un sun;
+        socklen_t len;
+        net_socket_fd_t s;
+        int err;
+
+        err = _net_unix_addr(path, &sun, &len);
+        if (err < 0) {
+                errno = -err;
+                return NET_INVALID_SOCKET;
+        }
+        s = net_socket_nonblocking_tuned(AF_UNIX, type, 0, prof,
+                                         NET_SOCKOPT_CLIENT);
+        if (!NET_SOCKET_OK(s))
+                return s;
+        while (connect(s, (struct sockaddr *) &sun, len) < 0) {
+                if (errno == EINTR)
+                        continue;
+                err = errno;
+                net_close(s);
+                errno = err;
+                return NET_INVALID_SOCKET;
+        }
+        return s;
+}
+
+
+/**
+ * Look up who is on the other end of the AF_UNIX socket <b>sock</b>, as of
+ * when it connected (SO_PEERCRED).  Any of the out pointers may be NULL.
+ *
+ * Returns 0 on success and the negative error code on error.
+ */
+int
+net_unix_peer_cred(net_socket_fd_t sock, pid_t *pid, uid_t *uid, gid_t *gid)
+{
+#ifdef SO_PEERCRED
+        struct ucred cred;
+        socklen_t len = (socklen_t) sizeof(cred);
+
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, (void *) &cred,
+                       &len) < 0)
+                return -errno;
+        if (pid)
+                *pid = cred.pid;
+        if (uid)
+                *uid = cred.uid;
+        if (gid)
+                *gid = cred.gid;
+        return 0;
+#else
+        (void) sock; (void) pid; (void) uid; (void) gid;
+        return -ENOSYS;
+#endif
+}
+
+
+/**
+ * As net_write(), but send <b>buf</b> as one message carrying our
+ * credentials (SCM_CREDENTIALS), which the kernel checks, so that a peer
+ * using net_unix_recv_cred() can trust them.
+ *
+ * Returns <b>n</b> on success and the negative error code on error.
+ */
+int
+net_unix_send_cred(net_socket_fd_t sock, const void *buf, size_t n)
+{
+#ifdef SCM_CREDENTIALS
+        union {
+                char buf[CMSG_SPACE(sizeof(struct ucred))];
+                struct cmsghdr align;
+        } control;
+        struct ucred cred;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        ssize_t r;
+
+        cred.pid = getpid();
+        cred.uid = geteuid();
+        cred.gid = getegid();
+        iov.iov_base = (void *) buf;
+        iov.iov_len = n;
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_CREDENTIALS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+        memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+
+        for (;;) {
+                r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+                if (r >= 0)
+                        break;
+                if (errno == EINTR)
+                        continue;
+                if (!NET_SOCKET_ERRNO_IS_EAGAIN(errno))
+                        return -errno;
+                r = net_wait(sock, POLLOUT, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return (int) r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+        /* The credentials went with the first part; the rest is plain. */
+        if ((size_t) r < n) {
+                r = net_write(sock, (const char *) buf + r, n - (size_t) r);
+                if (r < 0)
+                        return (int) r;
+        }
+        return (int) n;
+#else
+        return net_write(sock, buf, n);
+#endif
+}
+
+
+/**
+ * As net_read(), but also report the credentials of whoever sent the data
+ * (SCM_CREDENTIALS).  The socket must have SO_PASSCRED, see
+ * net_unix_listen(); the kernel then fills them in whether or not the
+ * sender used net_unix_send_cred().  *<b>uid</b> is set to -1 when none
+ * came along.  Any of the out pointers may be NULL.
+ *
+ * Returns the number of bytes read, 0 on EOF and the negative error code on
+ * error.
+ */
+int
+net_unix_recv_cred(net_socket_fd_t sock, void *buf, size_t n, pid_t *pid,
+                   uid_t *uid, gid_t *gid)
+{
+#ifdef SCM_CREDENTIALS
+        union {
+                char buf[CMSG_SPACE(sizeof(struct ucred))];
+                struct cmsghdr align;
+        } control;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        ssize_t r;
+
+        if (uid)
+                *uid = (uid_t) -1;
+        for (;;) {
+                iov.iov_base = buf;
+                iov.iov_len = n;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buf;
+                msg.msg_controllen = sizeof(control.buf);
+
+                r = recvmsg(sock, &msg, 0);
+                if (r >= 0)
+                        break;
+                if (errno == EINTR)
+                        continue;
+                if (!NET_SOCKET_ERRNO_IS_EAGAIN(errno))
+                        return -errno;
+                r = net_wait(sock, POLLIN, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return (int) r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                struct ucred cred;
+
+                if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_CREDENTIALS)
+                        continue;
+                memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+                if (pid)
+                        *pid = cred.pid;
+                if (uid)
+                        *uid = cred.uid;
+                if (gid)
+                        *gid = cred.gid;
+        }
+        if (r > 0 && net_read_hook)
+                net_read_hook(sock, buf, (int) r);
+        return (int) r;
+#else
+        if (uid)
+                *uid = (uid_t) -1;
+        (void) pid; (void) gid;
+        return net_read(sock, buf, n);
+#endif
+}
+
+
+/**
+ * Send the <b>n</b> descriptors in <b>fds</b> (at most NET_MAX_PASS_FDS)
+ * over the AF_UNIX socket <b>sock</b> with SCM_RIGHTS, along with a one
+ * byte message.  The receiver gets its own copies; ours stay open.
+ *
+ * Returns 0 on success and the negative error code on error.
+ */
+int
+net_send_fds(net_socket_fd_t sock, const int *fds, unsigned int n)
+{
+        union {
+                char buf[CMSG_SPACE(sizeof(int) * NET_MAX_PASS_FDS)];
+                struct cmsghdr align;
+        } control;
+        char byte = (char) n;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        int r;
+
+        if (n == 0 || n > NET_MAX_PASS_FDS)
+                return -EINVAL;
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+        for (;;) {
+                if (sendmsg(sock, &msg, MSG_NOSIGNAL) >= 0)
+                        return 0;
+                if (errno == EINTR)
+                        continue;
+                if (!NET_SOCKET_ERRNO_IS_EAGAIN(errno))
+                        return -errno;
+                r = net_wait(sock, POLLOUT, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+}
+
+
+/**
+ * Receive up to <b>max</b> descriptors sent with net_send_fds() into
+ * <b>fds</b>.  They come close-on-exec.  Any beyond <b>max</b> are closed.
+ *
+ * Returns the number received, 0 on EOF and the negative error code on
+ * error.
+ */
+int
+net_recv_fds(net_socket_fd_t sock, int *fds, unsigned int max)
+{
+        union {
+                char buf[CMSG_SPACE(sizeof(int) * NET_MAX_PASS_FDS)];
+                struct cmsghdr align;
+        } control;
+        char byte;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        unsigned int got = 0, i, k;
+        ssize_t r;
+
+        for (;;) {
+                iov.iov_base = &byte;
+                iov.iov_len = 1;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buf;
+                msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+                r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+#else
+                r = recvmsg(sock, &msg, 0);
+#endif
+                if (r >= 0)
+                        break;
+                if (errno == EINTR)
+                        continue;
+                if (!NET_SOCKET_ERRNO_IS_EAGAIN(errno))
+                        return -errno;
+                r = net_wait(sock, POLLIN, NET_IO_TIMEOUT_MS);
+                if (r < 0)
+                        return (int) r;
+                if (r == 0)
+                        return -ETIMEDOUT;
+        }
+        if (r == 0)
+                return 0;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                unsigned int n;
+
+                if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS)
+                        continue;
+                n = (unsigned int) ((cmsg->cmsg_len - CMSG_LEN(0)) /
+                                    sizeof(int));
+                for (i = 0; i < n; i++) {
+                        int fd;
+
+                        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int),
+                               sizeof(fd));
+                        if (got < max) {
+                                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                                fds[got++] = fd;
+                        } else {
+                                close(fd);
+                        }
+                }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+                for (k = 0; k < got; k++)
+                        close(fds[k]);
+                return -EMSGSIZE;
+        }
+        return (int) got;
+}
+
+
+/**
+ * Pick up to <b>max</b> listening sockets passed in by whoever started us,
+ * systemd style: LISTEN_PID is our pid and LISTEN_FDS says how many there
+ * are, from fd 3 on.  The variables are removed so that our children do
+ * not take them too.
+ *
+ * Returns the number of sockets stored in <b>fds</b>, 0 if none were
+ * passed.
+ */
+int
+net_listen_fds(int *fds, unsigned int max)
+{
+        const char *pid_env = getenv("LISTEN_PID");
+        const char *fds_env = getenv("LISTEN_FDS");
+        long n, pid;
+        unsigned int i;
+
+        if (!pid_env || !fds_env)
+                return 0;
+        pid = strtol(pid_env, NULL, 10);
+        n = strtol(fds_env, NULL, 10);
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+        if (pid != (long) getpid() || n <= 0)
+                return 0;
+
+        for (i = 0; i < (unsigned int) n && i < max; i++) {
+                fds[i] = NET_LISTEN_FDS_START + (int) i;
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        /* Not ours to keep open if we cannot use them. */
+        for (; i < (unsigned int) n; i++)
+                close(NET_LISTEN_FDS_START + (int) i);
+        return (int) (n < (long) max ? n : (long) max);
 }
@@ -2,7 +2,6 @@
 
 #ifndef _NET_COMPAT_H
 #define _NET_COMPAT_H
-#endif
 
 /* --- Windows Macros for Networking Compatibility --- */
 #ifdef _WIN32
@@ -20,13 +19,153 @@
 #define NET_SOCKET_FD_T_FORMAT "%d"
 #endif
 
+/** Socket tuning applied as sockets are created and accepted.  A zero
+ * field leaves the kernel default alone. */
+struct net_sockopt_profile {
+        /* TCP_NODELAY on listeners (inherited) and clients. */
+        int nodelay;
+        /* TCP_QUICKACK on accepted and client sockets. */
+        int quickack;
+        /* TCP_DEFER_ACCEPT seconds on listeners. */
+        int defer_accept;
+        /* TCP_FASTOPEN queue length on listeners; TCP_FASTOPEN_CONNECT on
+         * clients when non-zero. */
+        int fastopen;
+        /* SO_RCVBUF and SO_SNDBUF in bytes. */
+        int rcvbuf;
+        int sndbuf;
+        /* SO_BUSY_POLL microseconds. */
+        int busy_poll;
+        /* listen() backlog; 0 uses SOMAXCONN. */
+        int backlog;
+        /* SO_PREFER_BUSY_POLL, and the SO_BUSY_POLL_BUDGET packets per
+         * poll, for busy-polling servers. */
+        int prefer_busy_poll;
+        int busy_poll_budget;
+        /* SO_TIMESTAMPING of received data, software and hardware, on
+         * listeners (inherited) and clients; see net_rx_timestamp(). */
+        int timestamping;
+};
+
+/** Leave every option at the kernel default. */
+#define NET_SOCKOPT_PROFILE_DEFAULT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+/** Short request/response traffic: no Nagle, immediate ACKs, wake the
+ * acceptor only once data arrived and skip a round trip with Fast Open. */
+#define NET_SOCKOPT_PROFILE_LOW_LATENCY { 1, 1, 1, 256, 0, 0, 0, 0, 0, 0, 0 }
+/** As low latency, and poll the device queue from the receiving thread
+ * rather than waiting for the interrupt. */
+#define NET_SOCKOPT_PROFILE_BUSY_POLL { 1, 1, 1, 256, 0, 0, 50, 0, 1, 64, 0 }
+
+/** Roles for net_socket_apply_profile(). */
+#define NET_SOCKOPT_LISTENER 0
+#define NET_SOCKOPT_ACCEPTED 1
+#define NET_SOCKOPT_CLIENT 2
+
+int net_socket_apply_profile(net_socket_fd_t sock, int domain,
+                             const struct net_sockopt_profile *prof, int role);
+
 int net_close(net_socket_fd_t sock_fd);
+/* Spelling used by the server and client. */
+#define net_socket_close(sock_fd) \
+        net_close(sock_fd)
 net_socket_fd_t net_socket_blocking(int domain, int type, int protocol);
 net_socket_fd_t net_socket_nonblocking(int domain, int type, int protocol);
 net_socket_fd_t net_accept_blocking(net_socket_fd_t sock_fd,
                                     struct sockaddr *addr, socklen_t *len);
 net_socket_fd_t net_accept_nonblocking(net_socket_fd_t sock_fd,
                                        struct sockaddr *addr, socklen_t *len);
+net_socket_fd_t net_socket_nonblocking_tuned(int domain, int type,
+                                int protocol,
+                                const struct net_sockopt_profile *prof,
+                                int role);
+net_socket_fd_t net_accept_nonblocking_tuned(net_socket_fd_t sock_fd,
+                                struct sockaddr *addr, socklen_t *len,
+                                const struct net_sockopt_profile *prof);
+
+/** How long net_read() and net_write() wait on an idle peer. */
+#define NET_IO_TIMEOUT_MS 30000
+
+/** A hook that may take over net_wait(), e.g. to suspend a coroutine
+ * instead of blocking the thread.  It returns 0 to let net_wait() poll as
+ * usual, or 1 after storing net_wait()'s return value in *<b>result</b>. */
+typedef int (*net_wait_hook_fn)(net_socket_fd_t sock_fd, int events,
+                                int timeout_ms, int *result);
+
+/** A hook shown every chunk net_read() returns, e.g. to capture it. */
+typedef void (*net_read_hook_fn)(net_socket_fd_t sock_fd, const void *buf,
+                                 int n);
+
+struct net_zc_sock;
+struct net_zc_pool;
+
+/** Small writes collected for one socket, sent together; see
+ * net_batch_set(). */
+struct net_batch {
+        net_socket_fd_t fd;
+        char *buf;
+        size_t len;
+        /* CLOCK_MONOTONIC ns when the oldest byte held came in. */
+        uint64_t first_ns;
+        /* Send once this much is held, or the oldest byte is this old. */
+        size_t flush_bytes;
+        uint64_t flush_ns;
+        /* Smoothed RTT the thresholds were sized for, in us; 0 unknown. */
+        unsigned int rtt_us;
+        unsigned long sends;
+        /* Sent with MSG_MORE; the kernel may still hold some of it. */
+        int corked;
+        int flushing;
+        /* Large writes go out with MSG_ZEROCOPY from buffers of zc_pool;
+         * NULL when off.  See net_batch_zerocopy(). */
+        struct net_zc_sock *zc;
+        struct net_zc_pool *zc_pool;
+};
+
+/** Most a batch holds, and the most it waits for. */
+#define NET_BATCH_SIZE 16384
+/** Least a batch waits for: about a segment. */
+#define NET_BATCH_MIN_BYTES 1400
+/** A batch waits for this many bytes per us of RTT... */
+#define NET_BATCH_BYTES_PER_US 16
+/** ... and holds its oldest byte for up to this share of it. */
+#define NET_BATCH_RTT_DIV 4
+#define NET_BATCH_MIN_NS 20000
+#define NET_BATCH_MAX_NS 2000000
+/** Sends between looks at the RTT. */
+#define NET_BATCH_RETUNE 64
+/** How long net_batch_free() waits for the kernel to let go of zerocopy
+ * buffers. */
+#define NET_BATCH_ZC_DRAIN_MS 1000
+
+void net_set_wait_hook(net_wait_hook_fn hook);
+void net_set_read_hook(net_read_hook_fn hook);
+int net_wait(net_socket_fd_t sock_fd, int events, int timeout_ms);
+int net_read(net_socket_fd_t sock_fd, void *buf, size_t n);
+int net_write(net_socket_fd_t sock_fd, const void *buf, size_t n);
+struct net_batch *net_batch_new(net_socket_fd_t sock_fd);
+void net_batch_free(struct net_batch *b);
+void net_batch_set(struct net_batch *b);
+int net_batch_zerocopy(struct net_batch *b, struct net_zc_pool *pool,
+                       size_t threshold);
+int net_flush(net_socket_fd_t sock_fd, int more);
+net_socket_fd_t net_unix_listen(const char *path, int type, int passcred,
+                                const struct net_sockopt_profile *prof);
+net_socket_fd_t net_unix_connect(const char *path, int type,
+                                 const struct net_sockopt_profile *prof);
+int net_unix_peer_cred(net_socket_fd_t sock, pid_t *pid, uid_t *uid,
+                       gid_t *gid);
+int net_unix_send_cred(net_socket_fd_t sock, const void *buf, size_t n);
+int net_unix_recv_cred(net_socket_fd_t sock, void *buf, size_t n, pid_t *pid,
+                       uid_t *uid, gid_t *gid);
+/** Most descriptors net_send_fds() passes in one go. */
+#define NET_MAX_PASS_FDS 64
+/** First fd of those passed by socket activation, see net_listen_fds(). */
+#define NET_LISTEN_FDS_START 3
+int net_send_fds(net_socket_fd_t sock, const int *fds, unsigned int n);
+int net_recv_fds(net_socket_fd_t sock, int *fds, unsigned int max);
+int net_listen_fds(int *fds, unsigned int max);
+int net_rx_timestamp(net_socket_fd_t sock_fd, uint64_t *sw_ns,
+                     uint64_t *hw_ns);
 
 /* --- Windows Sockets ---
  * For historical reasons, windows sockets have an independent
@@ -125,4 +264,6 @@ int net_socket_make_reuseable_unix(net_socket_fd_t sock);
         ((e) == EMFILE || (e) == ENFILE || (e) == ENOBUFS || (e) == ENOMEM)
 #define NET_SOCKET_ERRNO_IS_EADDRINUSE(e) \
         (((e) == EADDRINUSE) || 0)
-#endif
\ No newline at end of file
+#endif
+
+#endif
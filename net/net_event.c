@@ -0,0 +1,259 @@
+/** Structured events; see net_event.h.
+ *
+ * The log is one ring in a file mapped shared, so records survive a crash
+ * and can be decoded while the process runs.  Writers claim a slot with an
+ * atomic add on the header's head and mark it complete with its sequence
+ * number; a slot lapped by a writer before it is read is simply skipped
+ * by the reader. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+
+#include "net_util.h"
+#include "net_event.h"
+
+struct _net_event_info {
+        const char *name;
+        int payload;
+};
+
+static const struct _net_event_info net_event_info[NET_EVENTS] = {
+        { "event", NET_EVENT_RAW },
+        { "accept() failed; listener closed", NET_EVENT_RAW },
+        { "accept() out of resources", NET_EVENT_RAW },
+        { "client rate limited", NET_EVENT_ADDR },
+        { "no memory for a connection", NET_EVENT_RAW },
+        { "upstream failed", NET_EVENT_ADDR },
+};
+
+/* What the summaries have said about each id so far. */
+struct _net_event_stat {
+        unsigned long count;
+        unsigned long reported;
+        /* CLOCK_MONOTONIC ns before which the id stays quiet. */
+        uint64_t next_ns;
+        int last_fd;
+        int last_err;
+};
+
+static struct _net_event_stat net_event_stats[NET_EVENTS];
+
+/* The log, if one is open. */
+static struct net_event_header *net_event_log;
+static size_t net_event_log_size;
+
+
+/**
+ * Record events into the ring file <b>path</b>, replaced, of <b>nrecs</b>
+ * slots (0 for NET_EVENT_DEFAULT_RECS; rounded up to a power of two).
+ * Call it before any thread records an event.
+ *
+ * Returns 0 on success and the negative error code on error.
+ */
+int
+net_event_open(const char *path, uint32_t nrecs)
+{
+        struct net_event_header *h;
+        struct timespec ts;
+        uint32_t n = 1;
+        size_t size;
+        int fd, err;
+
+        if (!nrecs)
+                nrecs = NET_EVENT_DEFAULT_RECS;
+        while (n < nrecs)
+                n <<= 1;
+        size = sizeof(*h) + (size_t) n * sizeof(struct net_event_rec);
+
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+                return -errno;
+        if (ftruncate(fd, (off_t) size) < 0) {
+                err = -errno;
+                close(fd);
+                return err;
+        }
+        h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        err = -errno;
+        close(fd);
+        if (h == MAP_FAILED)
+                return err;
+
+        h->nrecs = n;
+        h->rec_size = (uint32_t) sizeof(struct net_event_rec);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        h->start_mono_ns = net_now_ns();
+        h->start_real_ns = (uint64_t) ts.tv_sec * 1000000000u +
+                           (uint64_t) ts.tv_nsec;
+        memcpy(h->magic, NET_EVENT_MAGIC, sizeof(h->magic));
+        net_event_log_size = size;
+        __atomic_store_n(&net_event_log, h, __ATOMIC_RELEASE);
+        return 0;
+}
+
+
+/** Report what the summaries have not yet said and unmap the log.  Nobody
+ * may record meanwhile. */
+void
+net_event_close(void)
+{
+        net_event_report();
+        if (!net_event_log)
+                return;
+        munmap(net_event_log, net_event_log_size);
+        net_event_log = NULL;
+}
+
+
+/** The name of event <b>id</b>. */
+const char *
+net_event_name(unsigned int id)
+{
+        return net_event_info[id < NET_EVENTS ? id : 0].name;
+}
+
+
+/** How the payload of event <b>id</b> reads, one of NET_EVENT_RAW and
+ * NET_EVENT_ADDR. */
+int
+net_event_payload(unsigned int id)
+{
+        return net_event_info[id < NET_EVENTS ? id : 0].payload;
+}
+
+
+/** Print one summary line for <b>id</b>, covering <b>n</b> events over
+ * the last <b>ms</b>, or only the latest if <b>n</b> is 1. */
+static void
+_net_event_summarize(unsigned int id, unsigned long n, unsigned int ms)
+{
+        struct _net_event_stat *st = &net_event_stats[id];
+        int err = __atomic_load_n(&st->last_err, __ATOMIC_RELAXED);
+        int fd = __atomic_load_n(&st->last_fd, __ATOMIC_RELAXED);
+
+        if (n == 1)
+                net_warn("%s (fd %d): %s.\n", net_event_info[id].name, fd,
+                         err ? strerror(err) : "no error");
+        else
+                net_warn("%s (fd %d): %s; %lu times in %ums.\n",
+                         net_event_info[id].name, fd,
+                         err ? strerror(err) : "no error", n, ms);
+}
+
+
+/**
+ * Record event <b>id</b> about <b>fd</b> with errno <b>err</b> and up to
+ * NET_EVENT_DATA bytes of <b>data</b>.  Safe from any thread, and costs no
+ * syscalls save the summary line due at most once per
+ * NET_EVENT_SUMMARY_MS for each id.
+ */
+void
+net_event(unsigned int id, int fd, int err, const void *data, size_t len)
+{
+        struct net_event_header *h;
+        struct _net_event_stat *st;
+        struct net_event_rec *rec;
+        uint64_t now = net_now_ns(), seq, next;
+        unsigned long n, last;
+
+        if (id >= NET_EVENTS)
+                id = 0;
+        if (len > NET_EVENT_DATA)
+                len = NET_EVENT_DATA;
+
+        h = __atomic_load_n(&net_event_log, __ATOMIC_ACQUIRE);
+        if (h) {
+                seq = __atomic_fetch_add(&h->head, 1, __ATOMIC_RELAXED);
+                rec = (struct net_event_rec *) (h + 1) +
+                      (seq & (h->nrecs - 1));
+                __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                rec->t_ns = now;
+                rec->id = id;
+                rec->fd = fd;
+                rec->err = err;
+                rec->len = (uint32_t) len;
+                if (len)
+                        memcpy(rec->data, data, len);
+                __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+        }
+
+        st = &net_event_stats[id];
+        n = __atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->last_fd, fd, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->last_err, err, __ATOMIC_RELAXED);
+
+        /* One thread a period gets to say something; the rest only
+         * count. */
+        next = __atomic_load_n(&st->next_ns, __ATOMIC_RELAXED);
+        if (now < next || !__atomic_compare_exchange_n(&st->next_ns, &next,
+                        now + (uint64_t) NET_EVENT_SUMMARY_MS * 1000000, 0,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return;
+        last = __atomic_exchange_n(&st->reported, n, __ATOMIC_RELAXED);
+        _net_event_summarize(id, n - last, next ?
+                             (unsigned int) ((now - next) / 1000000) +
+                             NET_EVENT_SUMMARY_MS : 0);
+}
+
+
+/** Record event <b>id</b> with the address <b>sa</b> as its payload. */
+void
+net_event_addr(unsigned int id, int fd, int err, const struct sockaddr *sa)
+{
+        struct net_event_addr a;
+
+        memset(&a, 0, sizeof(a));
+        a.family = sa->sa_family;
+        if (sa->sa_family == AF_INET) {
+                const struct sockaddr_in *in = (const void *) sa;
+
+                a.port = in->sin_port;
+                memcpy(a.addr, &in->sin_addr, sizeof(in->sin_addr));
+        } else if (sa->sa_family == AF_INET6) {
+                const struct sockaddr_in6 *in6 = (const void *) sa;
+
+                a.port = in6->sin6_port;
+                memcpy(a.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+        }
+        net_event(id, fd, err, &a, sizeof(a));
+}
+
+
+/** Print a summary of every id with events the summaries have not covered
+ * yet, e.g. at the tail of a burst, on the way out. */
+void
+net_event_report(void)
+{
+        unsigned int id;
+
+        for (id = 0; id < NET_EVENTS; id++) {
+                struct _net_event_stat *st = &net_event_stats[id];
+                unsigned long n = __atomic_load_n(&st->count,
+                                                  __ATOMIC_RELAXED);
+                unsigned long last = __atomic_exchange_n(&st->reported, n,
+                                                         __ATOMIC_RELAXED);
+                uint64_t now = net_now_ns();
+                uint64_t since = __atomic_load_n(&st->next_ns,
+                                                 __ATOMIC_RELAXED);
+
+                if (n == last)
+                        continue;
+                /* next_ns is a period past the last line. */
+                since = since > (uint64_t) NET_EVENT_SUMMARY_MS * 1000000 ?
+                        since - (uint64_t) NET_EVENT_SUMMARY_MS * 1000000 :
+                        0;
+                _net_event_summarize(id, n - last, since && now > since ?
+                                     (unsigned int) ((now - since) /
+                                                     1000000) : 0);
+        }
+}
@@ -0,0 +1,83 @@
+/** Structured events for the error paths.
+ *
+ * Failures that can come in floods (accept() out of descriptors, clients
+ * turned away, upstreams down) are recorded as fixed size binary records
+ * instead of formatted text: an event id, the fd, the errno, a timestamp
+ * and a few bytes of payload.  Recording one is an atomic add and a copy
+ * into a ring in a shared file mapping, which the evlog tool decodes, so
+ * an error storm costs little more than the errors themselves.  Each id is
+ * also summarized on stderr, at most once per NET_EVENT_SUMMARY_MS, with a
+ * count of what happened since the last line. */
+
+#ifndef _NET_EVENT_H
+#define _NET_EVENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+/** Event ids; keep net_event_info in net_event.c in step. */
+#define NET_EVENT_ACCEPT_FAILED 1
+#define NET_EVENT_ACCEPT_LIMIT 2
+#define NET_EVENT_RATELIMITED 3
+#define NET_EVENT_CONN_NOMEM 4
+#define NET_EVENT_UPSTREAM_FAILED 5
+#define NET_EVENTS 6
+
+/** How an event's payload reads; see net_event_addr(). */
+#define NET_EVENT_RAW 0
+#define NET_EVENT_ADDR 1
+
+#define NET_EVENT_MAGIC "NBEVLOG1"
+/** Records in a log by default; a power of two. */
+#define NET_EVENT_DEFAULT_RECS 65536
+#define NET_EVENT_DATA 32
+#define NET_EVENT_SUMMARY_MS 1000
+
+struct net_event_header {
+        char magic[8];
+        /* Slots in the ring, and the size of each. */
+        uint32_t nrecs;
+        uint32_t rec_size;
+        /* Records ever written; the ring holds the last nrecs. */
+        uint64_t head;
+        /* The same moment on CLOCK_REALTIME and CLOCK_MONOTONIC, to put
+         * records on the wall clock. */
+        uint64_t start_real_ns;
+        uint64_t start_mono_ns;
+        uint64_t pad[3];
+};
+
+struct net_event_rec {
+        /* Position in the log plus one, stored last: a reader that finds
+         * anything else has caught a record half written or overwritten. */
+        uint64_t seq;
+        /* CLOCK_MONOTONIC ns. */
+        uint64_t t_ns;
+        uint32_t id;
+        int32_t fd;
+        /* Positive errno, 0 for none. */
+        int32_t err;
+        uint32_t len;
+        unsigned char data[NET_EVENT_DATA];
+};
+
+/** Address payload: family, port and address, in network byte order. */
+struct net_event_addr {
+        uint16_t family;
+        uint16_t port;
+        unsigned char addr[16];
+};
+
+int net_event_open(const char *path, uint32_t nrecs);
+void net_event_close(void);
+void net_event(unsigned int id, int fd, int err, const void *data,
+               size_t len);
+void net_event_addr(unsigned int id, int fd, int err,
+                    const struct sockaddr *sa);
+void net_event_report(void);
+const char *net_event_name(unsigned int id);
+int net_event_payload(unsigned int id);
+
+#endif
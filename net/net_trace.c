@@ -0,0 +1,240 @@
+/** Hot path tracing; see net_trace.h.
+ *
+ * Rings are allocated by each thread on its first event and never freed,
+ * so the dumper can walk them at any time.  A dump races with writers: the
+ * oldest events of a busy ring may be overwritten while being read, which
+ * at worst garbles a few of them. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+
+#include "net_util.h"
+#include "net_trace.h"
+
+#ifdef NET_TRACING
+
+__thread struct net_trace_buf *net_trace_tls;
+
+/* Every thread's ring. */
+static struct net_trace_buf *net_trace_bufs;
+
+/* Counter reading and CLOCK_MONOTONIC ns at calibration, and the ns per
+ * tick between them. */
+static pthread_once_t net_trace_once = PTHREAD_ONCE_INIT;
+static uint64_t net_trace_base_ticks;
+static uint64_t net_trace_base_ns;
+static double net_trace_ns_per_tick = 1.0;
+
+static const char *const net_trace_names[NET_TRACE_PROBES] = {
+        "accept", "enqueue", "dequeue", "read", "flush", "close"
+};
+
+
+/** Time the counter against the monotonic clock for 10ms. */
+static void
+_net_trace_calibrate(void)
+{
+        struct timespec nap = { 0, 10 * 1000 * 1000 };
+        uint64_t ticks, ns;
+
+        net_trace_base_ns = net_now_ns();
+        net_trace_base_ticks = net_trace_ticks();
+        nanosleep(&nap, NULL);
+        ns = net_now_ns() - net_trace_base_ns;
+        ticks = net_trace_ticks() - net_trace_base_ticks;
+        if (ticks)
+                net_trace_ns_per_tick = (double) ns / (double) ticks;
+}
+
+
+/** Give the calling thread its ring.  Returns NULL if out of memory. */
+struct net_trace_buf *
+_net_trace_buf_new(void)
+{
+        struct net_trace_buf *b;
+
+        pthread_once(&net_trace_once, &_net_trace_calibrate);
+        b = calloc(1, sizeof(*b));
+        if (!b)
+                return NULL;
+#ifdef SYS_gettid
+        b->tid = (int) syscall(SYS_gettid);
+#else
+        b->tid = (int) getpid();
+#endif
+        b->next = __atomic_load_n(&net_trace_bufs, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&net_trace_bufs, &b->next, b, 1,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+                ;
+        net_trace_tls = b;
+        return b;
+}
+
+
+/**
+ * Write every thread's ring to <b>path</b> as a Chrome trace.  Timestamps
+ * are CLOCK_MONOTONIC microseconds.
+ *
+ * Returns the number of events written and the negative error code on
+ * error.
+ */
+int
+net_trace_dump(const char *path)
+{
+        struct net_trace_buf *b;
+        FILE *f;
+        int pid = (int) getpid(), n = 0;
+
+        f = fopen(path, "w");
+        if (!f)
+                return -errno;
+
+        fputs("{\"traceEvents\":[\n", f);
+        for (b = __atomic_load_n(&net_trace_bufs, __ATOMIC_ACQUIRE); b;
+             b = b->next) {
+                uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+                uint64_t i = head > NET_TRACE_EVENTS ?
+                             head - NET_TRACE_EVENTS : 0;
+
+                for (; i < head; i++) {
+                        struct net_trace_event e =
+                                b->ev[i & (NET_TRACE_EVENTS - 1)];
+                        double us;
+
+                        if (e.probe >= NET_TRACE_PROBES)
+                                continue;
+                        us = ((double) net_trace_base_ns +
+                              (double) (int64_t) (e.ticks -
+                                                  net_trace_base_ticks) *
+                              net_trace_ns_per_tick) / 1000.0;
+                        /* Accept opens the connection's track and close
+                         * ends it; the rest are marks on it. */
+                        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"conn\","
+                                "\"ph\":\"%s\",\"id\":%u,\"ts\":%.3f,"
+                                "\"pid\":%d,\"tid\":%d}",
+                                n ? ",\n" : "", net_trace_names[e.probe],
+                                e.probe == NET_TRACE_ACCEPT ? "b" :
+                                e.probe == NET_TRACE_CLOSE ? "e" : "n",
+                                e.id, us, pid, b->tid);
+                        n++;
+                }
+        }
+        fputs("\n]}\n", f);
+
+        if (fclose(f) != 0)
+                return -errno;
+        return n;
+}
+
+
+/* Written to by the signal handler, read by the dumper thread. */
+static int net_trace_pipe[2] = { -1, -1 };
+
+
+static void
+_net_trace_signal(int sig)
+{
+        int saved = errno;
+        char c = (char) sig;
+        ssize_t r;
+
+        /* Only async-signal-safe calls in here; a full pipe means a dump
+         * is pending anyway. */
+        r = write(net_trace_pipe[1], &c, 1);
+        (void) r;
+        errno = saved;
+}
+
+
+static void *
+_net_trace_dumper(void *arg)
+{
+        const char *dir = (const char *) arg;
+        char path[4096];
+        unsigned int seq = 0;
+        char c;
+        int n;
+
+        for (;;) {
+                n = (int) read(net_trace_pipe[0], &c, 1);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+                snprintf(path, sizeof(path), "%s/trace-%d-%u.json", dir,
+                         (int) getpid(), seq++);
+                n = net_trace_dump(path);
+                if (n < 0)
+                        net_warn("Couldn't dump trace to %s: %s.\n", path,
+                                 strerror(-n));
+                else
+                        net_print("Dumped %d trace events to %s.\n", n,
+                                  path);
+        }
+        return NULL;
+}
+
+
+/**
+ * Dump the trace into <b>dir</b>, which must outlive the process's use of
+ * it, each time the process gets NET_TRACE_SIGNAL.  Call it once.
+ *
+ * Returns 0 on success and the negative error code on error.
+ */
+int
+net_trace_start_dumper(const char *dir)
+{
+        struct sigaction sa;
+        pthread_t thread;
+        int err;
+
+        if (pipe(net_trace_pipe) < 0)
+                return -errno;
+        fcntl(net_trace_pipe[1], F_SETFL, O_NONBLOCK);
+        err = pthread_create(&thread, NULL, &_net_trace_dumper,
+                             (void *) dir);
+        if (err) {
+                close(net_trace_pipe[0]);
+                close(net_trace_pipe[1]);
+                return -err;
+        }
+        pthread_detach(thread);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &_net_trace_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(NET_TRACE_SIGNAL, &sa, NULL) < 0)
+                return -errno;
+        return 0;
+}
+
+#else
+
+int
+net_trace_dump(const char *path)
+{
+        (void) path;
+        return -ENOSYS;
+}
+
+
+int
+net_trace_start_dumper(const char *dir)
+{
+        (void) dir;
+        return -ENOSYS;
+}
+
+#endif
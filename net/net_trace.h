@@ -0,0 +1,92 @@
+/** Hot path tracing with CPU timestamp counters.
+ *
+ * Built only with -DNET_TRACING; otherwise every net_trace() compiles to
+ * nothing.  Each thread appends fixed size events to its own ring of
+ * NET_TRACE_EVENTS, overwriting the oldest, so recording is a counter read
+ * and a store with no locks or syscalls.  net_trace_dump() writes all rings
+ * in the Chrome trace event format (chrome://tracing, Perfetto), one async
+ * track per connection. */
+
+#ifndef _NET_TRACE_H
+#define _NET_TRACE_H
+
+#include <stdint.h>
+
+/** Probe points, in the order a connection passes them. */
+#define NET_TRACE_ACCEPT 0
+#define NET_TRACE_ENQUEUE 1
+#define NET_TRACE_DEQUEUE 2
+#define NET_TRACE_READ 3
+#define NET_TRACE_FLUSH 4
+#define NET_TRACE_CLOSE 5
+#define NET_TRACE_PROBES 6
+
+/** Events kept per thread; a power of two. */
+#define NET_TRACE_EVENTS 16384
+
+/** Signal that dumps the trace, see net_trace_start_dumper(). */
+#define NET_TRACE_SIGNAL SIGUSR2
+
+struct net_trace_event {
+        uint64_t ticks;
+        /* The connection's socket. */
+        uint32_t id;
+        uint32_t probe;
+};
+
+struct net_trace_buf {
+        struct net_trace_buf *next;
+        int tid;
+        /* Events ever recorded; the ring holds the last NET_TRACE_EVENTS. */
+        uint64_t head;
+        struct net_trace_event ev[NET_TRACE_EVENTS];
+};
+
+#ifdef NET_TRACING
+
+extern __thread struct net_trace_buf *net_trace_tls;
+struct net_trace_buf *_net_trace_buf_new(void);
+
+/** Read the CPU's timestamp counter; cheap and not serializing. */
+static inline uint64_t
+net_trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+        uint64_t v;
+
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (v));
+        return v;
+#else
+        return net_now_ns();
+#endif
+}
+
+static inline void
+net_trace_record(unsigned int probe, uint32_t id)
+{
+        struct net_trace_buf *b = net_trace_tls;
+        struct net_trace_event *e;
+
+        if (PREDICT_UNLIKELY(!b) && !(b = _net_trace_buf_new()))
+                return;
+        e = &b->ev[b->head & (NET_TRACE_EVENTS - 1)];
+        e->ticks = net_trace_ticks();
+        e->id = id;
+        e->probe = probe;
+        __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+}
+
+#define net_trace(probe, id) net_trace_record((probe), (uint32_t) (id))
+
+#else
+
+#define net_trace(probe, id) ((void) 0)
+
+#endif
+
+int net_trace_dump(const char *path);
+int net_trace_start_dumper(const char *dir);
+
+#endif
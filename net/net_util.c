@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "net_util.h"
 
@@ -73,3 +74,35 @@ net_error(const char* format, ...)
         va_end(valist);
         return;
 }
+
+
+/**
+ * Return a monotonic timestamp in nanoseconds, for measuring intervals.
+ */
+uint64_t
+net_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+
+/**
+ * Convert the CLOCK_REALTIME timestamp <b>real_ns</b>, as the kernel stamps
+ * packets with, to the clock of net_now_ns().  Returns 0 for 0.
+ */
+uint64_t
+net_realtime_to_mono_ns(uint64_t real_ns)
+{
+        struct timespec ts;
+        uint64_t now_real, now_mono;
+
+        if (!real_ns)
+                return 0;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now_mono = net_now_ns();
+        now_real = (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+        return now_mono - (now_real - real_ns);
+}
@@ -1,11 +1,14 @@
 #ifndef _NET_UTIL_H
 #define _NET_UTIL_H
-#endif
+
+#include <stdint.h>
 
 void net_debug(const char* format, ...);
 void net_print(const char* format, ...);
 void net_warn(const char* format, ...);
 void net_error(const char* format, ...);
+uint64_t net_now_ns(void);
+uint64_t net_realtime_to_mono_ns(uint64_t real_ns);
 
 #if defined(__GNUC__) && __GNUC__ >= 3
 /** Macro: Evaluates to <b>exp</b> and hints the compiler that the value
@@ -29,6 +32,16 @@ void net_error(const char* format, ...);
 #define PREDICT_UNLIKELY(exp) (exp)
 #endif
 
+/** Macro: Tell the CPU we are in a spin-wait loop, so that it can save
+ * power and give the sibling hyperthread the pipeline. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NET_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define NET_CPU_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define NET_CPU_RELAX() ((void) 0)
+#endif
+
 #ifdef __GNUC__
 /** STMT_BEGIN and STMT_END are used to wrap blocks inside macros so that
  * the macro can be used as if it were a single C statement. */
@@ -57,3 +70,4 @@ STMT_END
         }                                                                      \
 STMT_END
 
+#endif
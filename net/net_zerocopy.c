@@ -0,0 +1,367 @@
+/** MSG_ZEROCOPY send path.
+ *
+ * Large responses are sent straight from pooled buffers with MSG_ZEROCOPY;
+ * the kernel pins the pages and later posts a notification on the socket's
+ * error queue once it no longer needs them.  Until then the buffer is
+ * pinned and cannot go back to the pool.  Small writes, and kernels or
+ * routes where zerocopy does not pay off, fall back to a plain copy. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#include "net_util.h"
+#include "net_compat.h"
+#include "net_zerocopy.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) \
+        && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Notification ids are 32 bit and wrap; compare them as a sequence. */
+#define ZC_ID_BEFORE(a, b) ((int32_t) ((a) - (b)) < 0)
+
+
+/**
+ * Initialise <b>pool</b> to hand out buffers of <b>buf_size</b> bytes,
+ * allocating at most <b>max</b> of them (0 for no limit).
+ * Return 0 on success, -1 on failure.
+ */
+int
+net_zc_pool_init(struct net_zc_pool *pool, size_t buf_size, unsigned int max)
+{
+        memset(pool, 0, sizeof(*pool));
+        if (pthread_mutex_init(&pool->lock, NULL))
+                return -1;
+        pool->buf_size = buf_size;
+        pool->max = max;
+        return 0;
+}
+
+
+/**
+ * Free every buffer sitting in <b>pool</b>.  Buffers still pinned by the
+ * kernel are deliberately leaked by their sockets; see net_zc_sock_drain().
+ */
+void
+net_zc_pool_destroy(struct net_zc_pool *pool)
+{
+        struct net_zc_buf *buf, *next;
+
+        for (buf = pool->free; buf; buf = next) {
+                next = buf->next;
+                free(buf);
+        }
+        pool->free = NULL;
+        pthread_mutex_destroy(&pool->lock);
+}
+
+
+/**
+ * Take a buffer out of <b>pool</b>, allocating one if the free list is
+ * empty.  Returns NULL when the pool is at its limit or malloc fails.
+ */
+struct net_zc_buf *
+net_zc_buf_get(struct net_zc_pool *pool)
+{
+        struct net_zc_buf *buf;
+
+        pthread_mutex_lock(&pool->lock);
+        buf = pool->free;
+        if (buf) {
+                pool->free = buf->next;
+        } else if (!pool->max || pool->nalloc < pool->max) {
+                buf = malloc(sizeof(*buf) + pool->buf_size);
+                if (buf)
+                        pool->nalloc++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (buf) {
+                memset(buf, 0, sizeof(*buf));
+                buf->pool = pool;
+                buf->cap = pool->buf_size;
+        }
+        return buf;
+}
+
+
+static void
+_net_zc_buf_put(struct net_zc_buf *buf)
+{
+        struct net_zc_pool *pool = buf->pool;
+
+        pthread_mutex_lock(&pool->lock);
+        buf->next = pool->free;
+        pool->free = buf;
+        pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Prepare <b>zs</b> for sending on <b>fd</b>.  Sends of at least
+ * <b>threshold</b> bytes use MSG_ZEROCOPY when the kernel supports it.
+ * Always returns 0; if SO_ZEROCOPY cannot be enabled every send simply
+ * copies.
+ */
+int
+net_zc_sock_init(struct net_zc_sock *zs, net_socket_fd_t fd, size_t threshold)
+{
+        memset(zs, 0, sizeof(*zs));
+        zs->fd = fd;
+        zs->threshold = threshold ? threshold : NET_ZC_DEFAULT_THRESHOLD;
+
+#ifdef HAVE_MSG_ZEROCOPY
+        {
+                int one = 1;
+                if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, (void*) &one,
+                               (socklen_t) sizeof(one)) == 0)
+                        zs->enabled = 1;
+                else
+                        net_debug("SO_ZEROCOPY unavailable: %s.\n",
+                                  net_socket_strerror(net_socket_errno(fd)));
+        }
+#endif
+        return 0;
+}
+
+
+/* Append <b>buf</b> to the pinned list unless it is already its tail. */
+static void
+_net_zc_pin(struct net_zc_sock *zs, struct net_zc_buf *buf, uint32_t id)
+{
+        if (buf->pins++ == 0) {
+                buf->id_lo = id;
+                buf->next = NULL;
+                if (zs->pinned_tail)
+                        zs->pinned_tail->next = buf;
+                else
+                        zs->pinned_head = buf;
+                zs->pinned_tail = buf;
+                zs->npinned++;
+        }
+        buf->id_hi = id;
+}
+
+
+/**
+ * Send <b>buf</b> from offset <b>off</b> to its end on <b>zs</b>.
+ *
+ * Returns the number of bytes queued, or the negative socket error code
+ * (which may be EAGAIN).  A buffer must be sent to completion, or given up
+ * with net_zc_release(), before the next buffer is sent on the same socket.
+ */
+int
+net_zc_send(struct net_zc_sock *zs, struct net_zc_buf *buf, size_t off)
+{
+        size_t n = buf->len - off;
+        int r, err;
+
+#ifdef HAVE_MSG_ZEROCOPY
+        if (zs->enabled && n >= zs->threshold) {
+ again_zc:
+                r = (int) send(zs->fd, buf->data + off, n,
+                               MSG_ZEROCOPY | MSG_NOSIGNAL);
+                if (r >= 0) {
+                        _net_zc_pin(zs, buf, zs->next_id++);
+                        return r;
+                }
+                err = net_socket_errno(zs->fd);
+                if (NET_SOCKET_ERRNO_IS_EINTR(err))
+                        goto again_zc;
+                /* ENOBUFS means we ran out of optmem for notifications;
+                 * copying is still possible. */
+                if (err != ENOBUFS)
+                        return -err;
+        }
+#endif
+
+ again:
+        r = (int) send(zs->fd, buf->data + off, n, MSG_NOSIGNAL);
+        if (r < 0) {
+                err = net_socket_errno(zs->fd);
+                if (NET_SOCKET_ERRNO_IS_EINTR(err))
+                        goto again;
+                return -err;
+        }
+        return r;
+}
+
+
+/**
+ * Hand <b>buf</b> back.  It returns to its pool immediately if the kernel
+ * holds no references to it, otherwise once its last completion arrives.
+ */
+void
+net_zc_release(struct net_zc_sock *zs, struct net_zc_buf *buf)
+{
+        (void) zs;
+
+        if (buf->pins)
+                buf->released = 1;
+        else
+                _net_zc_buf_put(buf);
+}
+
+
+#ifdef HAVE_MSG_ZEROCOPY
+/* Unpin every send whose id lies in [lo, hi]. */
+static void
+_net_zc_complete(struct net_zc_sock *zs, uint32_t lo, uint32_t hi)
+{
+        struct net_zc_buf **link = &zs->pinned_head;
+        struct net_zc_buf *buf, *prev = NULL;
+
+        while ((buf = *link) != NULL) {
+                uint32_t from, to;
+
+                /* The list is in id order; nothing past hi can match. */
+                if (ZC_ID_BEFORE(hi, buf->id_lo))
+                        break;
+
+                from = ZC_ID_BEFORE(buf->id_lo, lo) ? lo : buf->id_lo;
+                to = ZC_ID_BEFORE(hi, buf->id_hi) ? hi : buf->id_hi;
+                if (!ZC_ID_BEFORE(to, from))
+                        buf->pins -= (to - from) + 1;
+
+                if (buf->pins == 0) {
+                        *link = buf->next;
+                        if (zs->pinned_tail == buf)
+                                zs->pinned_tail = prev;
+                        zs->npinned--;
+                        if (buf->released)
+                                _net_zc_buf_put(buf);
+                        continue;
+                }
+                prev = buf;
+                link = &buf->next;
+        }
+}
+#endif
+
+
+/**
+ * Read zerocopy completions off the error queue of <b>zs</b> and unpin the
+ * buffers they cover.  Call this when the socket polls with POLLERR.
+ *
+ * Returns the number of notifications processed, or the negative socket
+ * error code.
+ */
+int
+net_zc_reap(struct net_zc_sock *zs)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+        int n = 0;
+
+        while (zs->npinned) {
+                char control[CMSG_SPACE(sizeof(struct sock_extended_err))
+                             + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+                struct msghdr msg;
+                struct cmsghdr *cm;
+                int err;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (recvmsg(zs->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                        err = net_socket_errno(zs->fd);
+                        if (NET_SOCKET_ERRNO_IS_EINTR(err))
+                                continue;
+                        if (NET_SOCKET_ERRNO_IS_EAGAIN(err))
+                                break;
+                        return -err;
+                }
+
+                for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                        struct sock_extended_err *serr;
+
+                        if (!((cm->cmsg_level == SOL_IP &&
+                               cm->cmsg_type == IP_RECVERR) ||
+                              (cm->cmsg_level == SOL_IPV6 &&
+                               cm->cmsg_type == IPV6_RECVERR)))
+                                continue;
+
+                        serr = (struct sock_extended_err *) CMSG_DATA(cm);
+                        if (serr->ee_errno != 0 ||
+                            serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                                continue;
+
+                        zs->completed++;
+                        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                                zs->copied++;
+                        _net_zc_complete(zs, serr->ee_info, serr->ee_data);
+                        n++;
+                }
+        }
+
+        /* If the kernel keeps copying for us we only pay for the pinning
+         * and the notifications; stop asking. */
+        if (zs->enabled && zs->completed >= NET_ZC_COPIED_SAMPLE) {
+                if (zs->copied * 2 > zs->completed) {
+                        net_debug("Zerocopy deferred to copy on fd "
+                                  NET_SOCKET_FD_T_FORMAT "; disabling.\n",
+                                  zs->fd);
+                        zs->enabled = 0;
+                }
+                zs->completed = zs->copied = 0;
+        }
+        return n;
+#else
+        (void) zs;
+        return 0;
+#endif
+}
+
+
+/**
+ * Wait up to <b>timeout_ms</b> for every pinned buffer of <b>zs</b> to be
+ * released; call before closing the socket.  Buffers still pinned when the
+ * wait gives up are leaked rather than reused, since the kernel may still
+ * be reading them.  Returns the number of buffers leaked.
+ */
+int
+net_zc_sock_drain(struct net_zc_sock *zs, int timeout_ms)
+{
+        int leaked;
+
+        while (zs->npinned && timeout_ms > 0) {
+                struct pollfd pfd;
+
+                pfd.fd = zs->fd;
+                pfd.events = 0;
+                pfd.revents = 0;
+                /* POLLERR is always reported; poll in small steps so that a
+                 * peer that never acks cannot hold us for long. */
+                if (poll(&pfd, 1, timeout_ms < 10 ? timeout_ms : 10) < 0 &&
+                    errno != EINTR)
+                        break;
+                timeout_ms -= 10;
+                if (net_zc_reap(zs) < 0)
+                        break;
+        }
+
+        leaked = (int) zs->npinned;
+        if (leaked)
+                net_warn("Leaking %d zerocopy buffers still held by the "
+                         "kernel.\n", leaked);
+        zs->pinned_head = zs->pinned_tail = NULL;
+        zs->npinned = 0;
+        return leaked;
+}
@@ -0,0 +1,78 @@
+/** MSG_ZEROCOPY send path for large payloads. */
+
+#ifndef _NET_ZEROCOPY_H
+#define _NET_ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "net_compat.h"
+
+/** Below this many bytes a plain copying send() is cheaper than pinning
+ * pages and reaping a completion; the kernel documentation puts the break
+ * even point at around 10KB. */
+#define NET_ZC_DEFAULT_THRESHOLD (16 * 1024)
+
+/** If more than this share of completions report that the kernel copied
+ * the data anyway (loopback, devices without scatter-gather) zerocopy is
+ * pure overhead and the socket falls back to copying. */
+#define NET_ZC_COPIED_SAMPLE 64
+
+/** A pooled send buffer.  While <b>pins</b> is non-zero the kernel still
+ * references the pages and the buffer must not be written or reused. */
+struct net_zc_buf {
+        struct net_zc_buf *next;
+        struct net_zc_pool *pool;
+        /* Range of zerocopy notification ids covering our sends. */
+        uint32_t id_lo;
+        uint32_t id_hi;
+        unsigned int pins;
+        /* Set once the owner is done with the buffer; it goes back to the
+         * pool when the last pin is released. */
+        int released;
+        size_t len;
+        size_t cap;
+        char data[];
+};
+
+/** A free list of equally sized send buffers shared by all sockets. */
+struct net_zc_pool {
+        pthread_mutex_t lock;
+        struct net_zc_buf *free;
+        size_t buf_size;
+        unsigned int nalloc;
+        unsigned int max;
+};
+
+/** Per socket zerocopy state.  Not thread safe; owned by whichever thread
+ * owns the socket. */
+struct net_zc_sock {
+        net_socket_fd_t fd;
+        int enabled;
+        size_t threshold;
+        /* The kernel numbers every successful MSG_ZEROCOPY send, starting
+         * at zero for each socket. */
+        uint32_t next_id;
+        /* Pinned buffers in send (and thus id) order. */
+        struct net_zc_buf *pinned_head;
+        struct net_zc_buf *pinned_tail;
+        unsigned int npinned;
+        unsigned int completed;
+        unsigned int copied;
+};
+
+int net_zc_pool_init(struct net_zc_pool *pool, size_t buf_size,
+                     unsigned int max);
+void net_zc_pool_destroy(struct net_zc_pool *pool);
+struct net_zc_buf *net_zc_buf_get(struct net_zc_pool *pool);
+
+int net_zc_sock_init(struct net_zc_sock *zs, net_socket_fd_t fd,
+                     size_t threshold);
+int net_zc_send(struct net_zc_sock *zs, struct net_zc_buf *buf, size_t off);
+void net_zc_release(struct net_zc_sock *zs, struct net_zc_buf *buf);
+int net_zc_reap(struct net_zc_sock *zs);
+int net_zc_sock_drain(struct net_zc_sock *zs, int timeout_ms);
+
+#endif
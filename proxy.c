@@ -0,0 +1,248 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* For memmem(). */
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+#include "net/net_event.h"
+
+#include "balancer.h"
+#include "client.h"
+#include "membudget.h"
+#include "proxy.h"
+#include "respcache.h"
+
+
+/* Find the Content-Length in the request head <b>head</b> of <b>len</b>
+ * bytes.  @return the length, or 0 if there is none. */
+static size_t
+_proxy_content_length(const char *head, size_t len)
+{
+        static const char name[] = "\r\ncontent-length:";
+        const char *p, *end = head + len;
+
+        for (p = head; p + sizeof(name) - 1 < end; p++) {
+                if (strncasecmp(p, name, sizeof(name) - 1) == 0)
+                        return (size_t) strtoul(p + sizeof(name) - 1, NULL,
+                                                10);
+        }
+        return 0;
+}
+
+
+/* Read the client's request head into <b>req</b>.  @return the length of
+ * the head including the blank line, or a negative errno. */
+static int
+_proxy_read_head(struct mbuf *req, int client_fd)
+{
+        const char *end;
+        int r;
+
+        for (;;) {
+                end = memmem(req->data + req->off, mbuf_len(req),
+                             "\r\n\r\n", 4);
+                if (end)
+                        return (int) (end + 4 - (req->data + req->off));
+                if (mbuf_len(req) >= PROXY_HEAD_MAX)
+                        return -EMSGSIZE;
+                r = mbuf_read(req, client_fd);
+                if (r == 0)
+                        return -ECONNRESET;
+                if (r < 0)
+                        return r;
+        }
+}
+
+
+/* Pick upstreams until one accepts a connection and the request head
+ * buffered in <b>req</b>.  @return the connected socket, or
+ * NET_INVALID_SOCKET; *<b>upp</b> is then NULL. */
+static net_socket_fd_t
+_proxy_connect(struct proxy *px, uint64_t key, struct mbuf *req,
+               struct upstream **upp)
+{
+        struct upstream *up, *failed = NULL;
+        net_socket_fd_t fd;
+        int tries, err;
+
+        for (tries = 0; tries < PROXY_TRIES; tries++) {
+                up = balancer_pick(px->bal, key);
+                /* A dead upstream looks idle to the load aware policies;
+                 * give the retry to someone else if we can. */
+                if (up && up == failed) {
+                        balancer_done(px->bal, up, 0);
+                        up = balancer_pick(px->bal, key ^ (uint64_t) tries);
+                }
+                if (!up)
+                        break;
+
+                fd = _client_tcp_connect_addr((struct sockaddr *) &up->addr,
+                                              up->addrlen, &px->sockopts);
+                if (!NET_SOCKET_OK(fd)) {
+                        balancer_done(px->bal, up, 1);
+                        failed = up;
+                        continue;
+                }
+                err = client_connect_wait(fd, PROXY_CONNECT_TIMEOUT_MS);
+                /* Keep the request buffered until it is sent, in case
+                 * it has to go to another upstream. */
+                if (!err)
+                        err = net_write(fd, req->data + req->off,
+                                        mbuf_len(req));
+                if (err < 0) {
+                        net_event_addr(NET_EVENT_UPSTREAM_FAILED, fd, -err,
+                                       (struct sockaddr *) &up->addr);
+                        net_socket_close(fd);
+                        balancer_done(px->bal, up, 1);
+                        failed = up;
+                        continue;
+                }
+                mbuf_consume(req, mbuf_len(req));
+                *upp = up;
+                return fd;
+        }
+        *upp = NULL;
+        return NET_INVALID_SOCKET;
+}
+
+
+/* Copy <b>n</b> bytes (or until EOF, if <b>n</b> is -1) from <b>from</b>
+ * to <b>to</b> through <b>buf</b>, keeping a copy in *<b>fill</b> if
+ * there is one; a response too big to cache drops the fill on the way.
+ * @return the number of bytes copied, or a negative errno. */
+static long
+_proxy_pump(struct proxy *px, struct mbuf *buf, int from, int to, long n,
+            struct resp_entry **fill)
+{
+        long copied = 0;
+        int r;
+
+        while (n < 0 || copied < n) {
+                r = mbuf_read(buf, from);
+                if (r == 0)
+                        break;
+                if (r < 0 && r != -ENOBUFS)
+                        return r;
+                if (r > 0)
+                        copied += r;
+                if (r > 0 && fill && *fill &&
+                    resp_cache_append(px->cache, *fill,
+                                      buf->data + buf->len - r,
+                                      (size_t) r) < 0) {
+                        resp_cache_publish(px->cache, *fill, 0);
+                        *fill = NULL;
+                }
+                r = mbuf_write(buf, to);
+                if (r < 0)
+                        return r;
+        }
+        return copied;
+}
+
+
+/* Look the request head in <b>req</b> up in <b>px</b>'s cache, if it is
+ * a GET.  @return as resp_cache_get(). */
+static int
+_proxy_cache_get(struct proxy *px, struct mbuf *req, int head, int client_fd,
+                 struct resp_entry **entry)
+{
+        *entry = NULL;
+        if (!px->cache || mbuf_len(req) != (size_t) head ||
+            strncmp(req->data + req->off, "GET ", 4) != 0)
+                return RESP_CACHE_MISS;
+        return resp_cache_get(px->cache, req->data + req->off, (size_t) head,
+                              client_fd, entry);
+}
+
+
+/*
+ * Connection handler for server_run(): forward one request from
+ * <b>client_fd</b> to an upstream of <b>arg</b> (a struct proxy) and relay
+ * the response until the upstream closes, as HTTP/1.0 does.  A GET the
+ * cache has the answer to is answered from there.
+ */
+int
+proxy_handler(void *arg, int client_fd)
+{
+        static const char bad_gateway[] =
+                "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+        struct proxy *px = (struct proxy *) arg;
+        struct sockaddr_storage peer;
+        socklen_t peerlen = (socklen_t) sizeof(peer);
+        struct mem_account acct;
+        struct mbuf req, resp;
+        struct upstream *up;
+        struct resp_entry *entry = NULL;
+        net_socket_fd_t up_fd;
+        uint64_t key = 0;
+        long body, sent;
+        int head, failed = 0, r;
+
+        if (getpeername(client_fd, (struct sockaddr *) &peer, &peerlen) == 0)
+                key = balancer_key((struct sockaddr *) &peer, peerlen);
+
+        mem_account_init(&acct, px->membudget);
+        mbuf_init(&req, &acct);
+        mbuf_init(&resp, &acct);
+
+        head = _proxy_read_head(&req, client_fd);
+        if (head < 0)
+                goto out;
+        body = (long) _proxy_content_length(req.data + req.off,
+                                            (size_t) head);
+        /* Whatever of the body came along with the head goes now. */
+        body -= (long) mbuf_len(&req) - head;
+
+        r = body > 0 ? RESP_CACHE_MISS :
+            _proxy_cache_get(px, &req, head, client_fd, &entry);
+        if (r < 0)
+                goto out;
+        if (r == RESP_CACHE_HIT) {
+                /* Straight from the shared buffer. */
+                net_write(client_fd, entry->data, entry->len);
+                resp_entry_put(px->cache, entry);
+                goto out;
+        }
+
+        up_fd = _proxy_connect(px, key, &req, &up);
+        if (!NET_SOCKET_OK(up_fd)) {
+                net_write(client_fd, bad_gateway, sizeof(bad_gateway) - 1);
+                failed = 1;
+                goto fill;
+        }
+
+        if (body > 0 &&
+            _proxy_pump(px, &req, client_fd, up_fd, body, NULL) < 0)
+                failed = 1;
+        if (!failed) {
+                sent = _proxy_pump(px, &resp, up_fd, client_fd, -1, &entry);
+                /* An upstream that hangs up without a word has failed; a
+                 * client that went away has not. */
+                failed = sent == 0;
+                /* Only a response read to the end is worth keeping. */
+                if (sent < 0 && entry) {
+                        resp_cache_publish(px->cache, entry, 0);
+                        entry = NULL;
+                }
+        }
+
+        balancer_done(px->bal, up, failed);
+        net_socket_close(up_fd);
+ fill:
+        if (entry)
+                resp_cache_publish(px->cache, entry, !failed);
+ out:
+        mbuf_free(&req);
+        mbuf_free(&resp);
+        return 0;
+}
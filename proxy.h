@@ -0,0 +1,30 @@
+/* Reverse proxy handler: forwards each client's request to an upstream
+ * chosen by a balancer and relays the response back. */
+
+#ifndef _PROXY_H
+#define _PROXY_H
+
+/* Upstreams tried per request before giving up with a 502. */
+#define PROXY_TRIES 2
+#define PROXY_CONNECT_TIMEOUT_MS 3000
+/* Longest request head accepted from a client. */
+#define PROXY_HEAD_MAX (64 * 1024)
+
+struct balancer;
+struct mem_budget;
+struct resp_cache;
+
+struct proxy {
+        struct balancer *bal;
+        /* Charged for request and response buffers; may be NULL. */
+        struct mem_budget *membudget;
+        /* Tuning for upstream connections. */
+        struct net_sockopt_profile sockopts;
+        /* Answers GET requests seen before without asking an upstream;
+         * may be NULL.  See respcache.h. */
+        struct resp_cache *cache;
+};
+
+int proxy_handler(void *proxy, int client_fd);
+
+#endif
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "net/net_util.h"
+
+#include "ratelimit.h"
+
+/* Token counts are kept in thousandths so that slow rates refill smoothly
+ * at millisecond granularity. */
+#define RL_MILLI 1000u
+
+
+/*
+ * Create a limiter allowing each client <b>rate</b> connections per second
+ * with bursts of up to <b>burst</b>, tracking about <b>slots</b> clients.
+ * Clients are grouped by their first <b>v4_prefix</b> or <b>v6_prefix</b>
+ * address bits (at most 64 for IPv6); zero arguments pick the defaults.
+ * @return the limiter, or NULL on failure.
+ */
+struct ratelimit *
+ratelimit_create(unsigned int rate, unsigned int burst, unsigned int slots,
+                 unsigned int v4_prefix, unsigned int v6_prefix)
+{
+        struct ratelimit *rl;
+        unsigned int i, per_shard;
+
+        if (!rate)
+                return NULL;
+        if (!burst)
+                burst = rate;
+        /* The bucket must fit in 31 bits of milli-tokens, the other one
+         * being for the debt of reservations. */
+        if (burst > INT32_MAX / RL_MILLI)
+                burst = INT32_MAX / RL_MILLI;
+        if (!slots)
+                slots = RL_DEFAULT_SLOTS;
+
+        rl = aligned_alloc(64, sizeof(*rl));
+        if (!rl)
+                return NULL;
+        memset(rl, 0, sizeof(*rl));
+
+        per_shard = RL_PROBE_MAX;
+        while (per_shard * RL_SHARDS < slots)
+                per_shard *= 2;
+
+        for (i = 0; i < RL_SHARDS; i++) {
+                rl->shards[i].slots = calloc(per_shard,
+                                             sizeof(struct rl_slot));
+                if (!rl->shards[i].slots) {
+                        ratelimit_delete(rl);
+                        return NULL;
+                }
+                rl->shards[i].mask = per_shard - 1;
+        }
+
+        rl->rate = rate;
+        rl->burst = burst;
+        rl->v4_prefix = (v4_prefix && v4_prefix <= 32) ? v4_prefix
+                                                       : RL_DEFAULT_V4_PREFIX;
+        rl->v6_prefix = (v6_prefix && v6_prefix <= 64) ? v6_prefix
+                                                       : RL_DEFAULT_V6_PREFIX;
+        rl->epoch_ns = net_now_ns();
+        /* Keep clients from picking addresses that collide on purpose. */
+        rl->seed = rl->epoch_ns ^ (uint64_t) (uintptr_t) rl;
+        return rl;
+}
+
+
+void
+ratelimit_delete(struct ratelimit *rl)
+{
+        unsigned int i;
+
+        for (i = 0; i < RL_SHARDS; i++)
+                free(rl->shards[i].slots);
+        free(rl);
+}
+
+
+/*
+ * Map <b>addr</b> to its table key: the masked IPv4 address with bit 32
+ * set, or the masked top 64 bits of an IPv6 address.  Both live in the
+ * reserved ::/8 range for IPv6, so neither collides with a real /64.
+ * @return the key, or 0 for addresses that are not rate limited.
+ */
+static uint64_t
+_rl_key(const struct ratelimit *rl, const struct sockaddr *addr,
+        socklen_t addrlen)
+{
+        const struct sockaddr_in6 *sin6;
+        const unsigned char *b;
+        uint64_t key;
+        uint32_t v4;
+        int i;
+
+        if (addr->sa_family == AF_INET &&
+            addrlen >= (socklen_t) sizeof(struct sockaddr_in)) {
+                v4 = ntohl(((const struct sockaddr_in *)
+                            addr)->sin_addr.s_addr);
+                goto ipv4;
+        }
+        if (addr->sa_family != AF_INET6 ||
+            addrlen < (socklen_t) sizeof(struct sockaddr_in6))
+                return 0;
+
+        sin6 = (const struct sockaddr_in6 *) addr;
+        b = sin6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+                v4 = (uint32_t) b[12] << 24 | (uint32_t) b[13] << 16 |
+                     (uint32_t) b[14] << 8 | b[15];
+                goto ipv4;
+        }
+        key = 0;
+        for (i = 0; i < 8; i++)
+                key = key << 8 | b[i];
+        key &= ~(uint64_t) 0 << (64 - rl->v6_prefix);
+        /* ::/64 itself is reserved; don't mistake it for a free slot. */
+        return key ? key : 2;
+
+ ipv4:
+        if (rl->v4_prefix < 32)
+                v4 &= ~(uint32_t) 0 << (32 - rl->v4_prefix);
+        return (uint64_t) 1 << 32 | v4;
+}
+
+
+/* 64-bit finalizer from MurmurHash3. */
+static uint64_t
+_rl_hash(uint64_t x)
+{
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+}
+
+
+/* Milli-tokens in the bucket <b>state</b> as of <b>now_ms</b>; negative
+ * while reservations are outstanding. */
+static int64_t
+_rl_tokens(const struct ratelimit *rl, uint64_t state, uint32_t now_ms)
+{
+        int64_t full = (int64_t) rl->burst * RL_MILLI;
+        int64_t tokens;
+        uint64_t refill;
+
+        if (!state)
+                return full;
+        /* rate tokens/s is rate milli-tokens/ms.  The subtraction wraps
+         * correctly every 49 days. */
+        tokens = (int32_t) (uint32_t) (state >> 32);
+        refill = (uint64_t) (now_ms - (uint32_t) state) * rl->rate;
+        return refill >= (uint64_t) (full - tokens) ? full
+                                                    : tokens + (int64_t) refill;
+}
+
+
+/* Find or claim the slot for <b>key</b>, or return NULL if the table is
+ * too crowded around it. */
+static struct rl_slot *
+_rl_slot(struct ratelimit *rl, uint64_t key, uint32_t now_ms)
+{
+        uint64_t h = _rl_hash(key ^ rl->seed);
+        struct rl_shard *shard = &rl->shards[(h >> 32) % RL_SHARDS];
+        struct rl_slot *reuse = NULL;
+        uint64_t reuse_key = 0;
+        unsigned int i;
+
+        for (i = 0; i < RL_PROBE_MAX; i++) {
+                struct rl_slot *slot = &shard->slots[(h + i) & shard->mask];
+                uint64_t k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+
+                if (k == key)
+                        return slot;
+                if (!k) {
+                        if (__atomic_compare_exchange_n(&slot->key, &k, key,
+                                        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                            || k == key)
+                                return slot;
+                        continue;
+                }
+                /* A bucket that has refilled completely carries no
+                 * information, so its slot may go to someone else. */
+                if (!reuse && _rl_tokens(rl, __atomic_load_n(&slot->state,
+                                __ATOMIC_RELAXED), now_ms) ==
+                              (int64_t) rl->burst * RL_MILLI) {
+                        reuse = slot;
+                        reuse_key = k;
+                }
+        }
+
+        if (reuse && __atomic_compare_exchange_n(&reuse->key, &reuse_key, key,
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                /* A concurrent update for the old key may still land here;
+                 * it costs this client at most one token. */
+                __atomic_store_n(&reuse->state, 0, __ATOMIC_RELEASE);
+                return reuse;
+        }
+        return NULL;
+}
+
+
+/*
+ * Take a token for the client at <b>addr</b>, or if there is none, reserve
+ * the next one, provided it comes within <b>max_wait_ms</b>: the bucket
+ * goes into debt, so that each client waiting on it waits for a token of
+ * its own.  *<b>took</b> says whether either happened.
+ * @return 0 with a token, otherwise the ms until the next one is due.
+ */
+static int
+_rl_take(struct ratelimit *rl, const struct sockaddr *addr,
+         socklen_t addrlen, unsigned int max_wait_ms, int *took)
+{
+        uint64_t key = _rl_key(rl, addr, addrlen);
+        uint32_t now_ms;
+        struct rl_slot *slot;
+        uint64_t old;
+        int64_t tokens;
+        int wait_ms;
+
+        *took = 1;
+        if (!key)
+                return 0;
+
+        now_ms = (uint32_t) ((net_now_ns() - rl->epoch_ns) / 1000000);
+        slot = _rl_slot(rl, key, now_ms);
+        if (!slot) {
+                __atomic_add_fetch(&rl->untracked, 1, __ATOMIC_RELAXED);
+                return 0;
+        }
+        /* Keep the debt within the bucket's 32 bits. */
+        if ((uint64_t) max_wait_ms * rl->rate > INT32_MAX / 2)
+                max_wait_ms = INT32_MAX / 2 / rl->rate;
+
+        old = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        do {
+                tokens = _rl_tokens(rl, old, now_ms);
+                wait_ms = 0;
+                if (tokens < RL_MILLI)
+                        wait_ms = (int) ((RL_MILLI - tokens + rl->rate - 1) /
+                                         rl->rate);
+                *took = (unsigned int) wait_ms <= max_wait_ms;
+                if (*took)
+                        tokens -= RL_MILLI;
+                /* Never store 0, which would read back as a full bucket. */
+        } while (!__atomic_compare_exchange_n(&slot->state, &old,
+                                (uint64_t) (uint32_t) tokens << 32 | now_ms |
+                                (!tokens && !now_ms),
+                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+        if (wait_ms)
+                __atomic_add_fetch(&rl->limited, 1, __ATOMIC_RELAXED);
+        else
+                __atomic_add_fetch(&rl->allowed, 1, __ATOMIC_RELAXED);
+        return wait_ms;
+}
+
+
+/*
+ * Take a token for the client at <b>addr</b>.
+ * @return 0 if the client is within its limit, otherwise the number of
+ *      milliseconds until it will be.
+ */
+int
+ratelimit_take(struct ratelimit *rl, const struct sockaddr *addr,
+               socklen_t addrlen)
+{
+        int took;
+
+        return _rl_take(rl, addr, addrlen, 0, &took);
+}
+
+
+/*
+ * As ratelimit_take(), but a client over its limit may have the next
+ * token that comes free, if that is within <b>max_wait_ms</b>, and wait
+ * for it.  Clients reserving one after another get successive tokens.
+ * @return 0 if the client is within its limit, the number of milliseconds
+ *      it has to wait for its token, or -1 if that would be too long.
+ */
+int
+ratelimit_reserve(struct ratelimit *rl, const struct sockaddr *addr,
+                  socklen_t addrlen, unsigned int max_wait_ms)
+{
+        int took, wait_ms;
+
+        wait_ms = _rl_take(rl, addr, addrlen, max_wait_ms, &took);
+        return took ? wait_ms : -1;
+}
@@ -0,0 +1,62 @@
+/* Per-client-address token bucket rate limiting.
+ *
+ * Buckets live in a fixed size, sharded open addressing table keyed by the
+ * client's address prefix.  Lookups and updates are lock-free: a slot is
+ * claimed with a compare-and-swap on its key, and the bucket itself is one
+ * 64-bit word updated with compare-and-swap. */
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define RL_SHARDS 16
+/* Slots looked at before giving up on tracking an address. */
+#define RL_PROBE_MAX 16
+#define RL_DEFAULT_SLOTS 65536
+/* Group IPv6 clients by their /64 by default: one host usually owns one. */
+#define RL_DEFAULT_V4_PREFIX 32
+#define RL_DEFAULT_V6_PREFIX 64
+
+struct rl_slot {
+        /* 0 when free; see _rl_key(). */
+        uint64_t key;
+        /* Milli-tokens in the high half, signed, as reservations may run
+         * the bucket into debt; ms timestamp of the last update in the low
+         * half.  0 stands for a full bucket. */
+        uint64_t state;
+};
+
+struct rl_shard {
+        struct rl_slot *slots;
+        unsigned int mask;
+} __attribute__ ((aligned(64)));
+
+struct ratelimit {
+        struct rl_shard shards[RL_SHARDS];
+        /* Tokens per second, and the most a bucket holds. */
+        unsigned int rate;
+        unsigned int burst;
+        unsigned int v4_prefix;
+        unsigned int v6_prefix;
+        uint64_t seed;
+        uint64_t epoch_ns;
+
+        unsigned long allowed;
+        unsigned long limited;
+        /* Let through because the table was too full to track them. */
+        unsigned long untracked;
+};
+
+struct ratelimit *ratelimit_create(unsigned int rate, unsigned int burst,
+                                   unsigned int slots, unsigned int v4_prefix,
+                                   unsigned int v6_prefix);
+void ratelimit_delete(struct ratelimit *rl);
+int ratelimit_take(struct ratelimit *rl, const struct sockaddr *addr,
+                   socklen_t addrlen);
+int ratelimit_reserve(struct ratelimit *rl, const struct sockaddr *addr,
+                      socklen_t addrlen, unsigned int max_wait_ms);
+
+#endif
@@ -0,0 +1,288 @@
+/* Replay a capture (see capture.h) against a server.
+ *
+ *      replay <capture> <host> <port> [speed]
+ *
+ * Every captured connection is opened, fed the bytes its client sent and
+ * half-closed at the original offsets from the start, divided by speed (1
+ * by default; 0 sends everything as fast as possible).  Whatever the server
+ * answers is read and counted, so that it never stalls on a full socket. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+
+#include "capture.h"
+#include "client.h"
+
+#define REPLAY_CONNECT_TIMEOUT_MS 3000
+/* How long to wait for the server to finish once everything is sent. */
+#define REPLAY_LINGER_MS 10000
+
+/* Connection states. */
+#define REPLAY_UNOPENED 0
+#define REPLAY_CONNECTING 1
+#define REPLAY_OPEN 2
+#define REPLAY_DONE 3
+
+struct replay_conn {
+        int fd;
+        int state;
+};
+
+struct replay {
+        struct replay_conn *conns;
+        uint32_t nconns;
+        /* Connections with an open socket. */
+        uint32_t *live;
+        uint32_t nlive;
+        struct pollfd *pfds;
+
+        unsigned long opened;
+        unsigned long failed;
+        unsigned long long sent;
+        unsigned long long received;
+};
+
+
+/* Sort key: capture time, then position in the file, which keeps each
+ * connection's records in the order they were made. */
+struct replay_ev {
+        uint64_t t_ns;
+        size_t seq;
+        const struct capture_rec *rec;
+};
+
+
+static int
+_replay_ev_cmp(const void *a, const void *b)
+{
+        const struct replay_ev *x = a, *y = b;
+
+        if (x->t_ns != y->t_ns)
+                return x->t_ns < y->t_ns ? -1 : 1;
+        return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+
+static void
+_replay_close(struct replay *rp, uint32_t i)
+{
+        struct replay_conn *c = &rp->conns[i];
+        uint32_t k;
+
+        net_socket_close(c->fd);
+        c->fd = -1;
+        c->state = REPLAY_DONE;
+        for (k = 0; k < rp->nlive; k++) {
+                if (rp->live[k] == i) {
+                        rp->live[k] = rp->live[--rp->nlive];
+                        break;
+                }
+        }
+}
+
+
+/* Read and count whatever the server sent, for up to <b>timeout_ms</b>.
+ * Connections the server closed are closed too. */
+static void
+_replay_drain(struct replay *rp, int timeout_ms)
+{
+        char buf[65536];
+        uint32_t k, n = rp->nlive;
+        int r;
+
+        for (k = 0; k < n; k++) {
+                rp->pfds[k].fd = rp->conns[rp->live[k]].fd;
+                rp->pfds[k].events = POLLIN;
+                rp->pfds[k].revents = 0;
+        }
+        r = poll(rp->pfds, n, timeout_ms);
+        if (r <= 0)
+                return;
+
+        /* Walk backwards: closing moves the last live entry into k. */
+        for (k = n; k-- > 0;) {
+                uint32_t i = rp->live[k];
+
+                if (!rp->pfds[k].revents)
+                        continue;
+                for (;;) {
+                        r = (int) recv(rp->conns[i].fd, buf, sizeof(buf), 0);
+                        if (r > 0) {
+                                rp->received += (unsigned long long) r;
+                                continue;
+                        }
+                        if (r < 0 && errno == EINTR)
+                                continue;
+                        if (r < 0 && NET_SOCKET_ERRNO_IS_EAGAIN(errno))
+                                break;
+                        if (r < 0)
+                                rp->failed++;
+                        _replay_close(rp, i);
+                        break;
+                }
+        }
+}
+
+
+/* Act out one captured record against <b>server</b>. */
+static void
+_replay_apply(struct replay *rp, const struct capture_rec *rec,
+              const struct addrinfo *server)
+{
+        struct replay_conn *c = &rp->conns[rec->conn];
+        int err;
+
+        switch (rec->type) {
+        case CAPTURE_OPEN:
+                if (c->state != REPLAY_UNOPENED)
+                        return;
+                c->fd = _client_tcp_connect_addr(server->ai_addr,
+                                                 server->ai_addrlen, NULL);
+                if (!NET_SOCKET_OK(c->fd)) {
+                        c->state = REPLAY_DONE;
+                        rp->failed++;
+                        return;
+                }
+                c->state = REPLAY_CONNECTING;
+                rp->live[rp->nlive++] = rec->conn;
+                rp->opened++;
+                return;
+        case CAPTURE_DATA:
+                if (c->state == REPLAY_CONNECTING) {
+                        err = client_connect_wait(c->fd,
+                                                  REPLAY_CONNECT_TIMEOUT_MS);
+                        if (err < 0) {
+                                net_warn("Connection %u failed: %s.\n",
+                                         rec->conn, strerror(-err));
+                                rp->failed++;
+                                _replay_close(rp, rec->conn);
+                                return;
+                        }
+                        c->state = REPLAY_OPEN;
+                }
+                if (c->state != REPLAY_OPEN)
+                        return;
+                err = net_write(c->fd, rec + 1, rec->len);
+                if (err < 0) {
+                        rp->failed++;
+                        _replay_close(rp, rec->conn);
+                        return;
+                }
+                rp->sent += rec->len;
+                return;
+        case CAPTURE_CLOSE:
+                /* Keep reading until the server is done too. */
+                if (c->state == REPLAY_OPEN || c->state == REPLAY_CONNECTING)
+                        shutdown(c->fd, SHUT_WR);
+                return;
+        }
+}
+
+
+int
+main(int argc, char **argv)
+{
+        struct capture_reader rd;
+        const struct capture_rec *rec;
+        struct addrinfo hints, *server;
+        struct replay rp;
+        struct replay_ev *evs = NULL;
+        size_t nevs = 0, i;
+        uint64_t start, now, due, last_ns = 0, linger;
+        double speed = 1.0;
+        int err;
+
+        if (argc < 4) {
+                fprintf(stderr, "usage: %s <capture> <host> <port> "
+                        "[speed]\n", argv[0]);
+                return 2;
+        }
+        if (argc > 4)
+                speed = atof(argv[4]);
+
+        err = capture_reader_open(&rd, argv[1]);
+        if (err < 0) {
+                net_error("Couldn't read capture %s: %s.\n", argv[1],
+                          strerror(-err));
+                return 1;
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(argv[2], argv[3], &hints, &server)) {
+                net_error("Failed to get addrinfo.\n");
+                return 1;
+        }
+
+        /* Put every record on one timeline. */
+        memset(&rp, 0, sizeof(rp));
+        while ((rec = capture_next(&rd)))
+                if (rec->conn >= rp.nconns)
+                        rp.nconns = rec->conn + 1;
+        rd.off = sizeof(struct capture_header);
+        evs = calloc(rd.size / sizeof(*rec) + 1, sizeof(*evs));
+        rp.conns = calloc(rp.nconns + 1, sizeof(*rp.conns));
+        rp.live = calloc(rp.nconns + 1, sizeof(*rp.live));
+        rp.pfds = calloc(rp.nconns + 1, sizeof(*rp.pfds));
+        if (!evs || !rp.conns || !rp.live || !rp.pfds) {
+                net_error("Out of memory.\n");
+                return 1;
+        }
+        while ((rec = capture_next(&rd))) {
+                evs[nevs].t_ns = rec->t_ns;
+                evs[nevs].seq = nevs;
+                evs[nevs].rec = rec;
+                nevs++;
+        }
+        qsort(evs, nevs, sizeof(*evs), &_replay_ev_cmp);
+        for (i = 0; i < rp.nconns; i++)
+                rp.conns[i].fd = -1;
+
+        start = net_now_ns();
+        for (i = 0; i < nevs; i++) {
+                due = start + (speed > 0.0 ?
+                               (uint64_t) ((double) evs[i].t_ns / speed) : 0);
+                while ((now = net_now_ns()) < due)
+                        _replay_drain(&rp, (int) ((due - now + 999999) /
+                                                  1000000));
+                /* Answers to earlier requests should not pile up. */
+                if (speed <= 0.0)
+                        _replay_drain(&rp, 0);
+                _replay_apply(&rp, evs[i].rec, server);
+                last_ns = evs[i].t_ns;
+        }
+
+        linger = net_now_ns() + (uint64_t) REPLAY_LINGER_MS * 1000000;
+        while (rp.nlive && net_now_ns() < linger)
+                _replay_drain(&rp, 100);
+
+        now = net_now_ns();
+        net_print("Replayed %lu connections, %llu bytes sent, %llu received, "
+                  "%lu failed, %lu unfinished, in %.3fs (captured %.3fs).\n",
+                  rp.opened, rp.sent, rp.received, rp.failed,
+                  (unsigned long) rp.nlive, (double) (now - start) / 1e9,
+                  (double) last_ns / 1e9);
+
+        for (i = rp.nlive; i-- > 0;)
+                _replay_close(&rp, rp.live[i]);
+        freeaddrinfo(server);
+        capture_reader_close(&rd);
+        free(evs);
+        free(rp.conns);
+        free(rp.live);
+        free(rp.pfds);
+        return rp.failed ? 1 : 0;
+}
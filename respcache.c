@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "net/net_util.h"
+#include "net/net_compat.h"
+
+#include "respcache.h"
+
+
+static uint64_t
+_resp_hash(const void *key, size_t len)
+{
+        /* FNV-1a */
+        const unsigned char *p = key;
+        uint64_t h = 14695981039346656037u;
+
+        while (len--) {
+                h ^= *p++;
+                h *= 1099511628211u;
+        }
+        /* Requests differ in their last few bytes, which FNV leaves in
+         * the low bits; spread them to the shard bits too. */
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdu;
+        h ^= h >> 33;
+        return h;
+}
+
+
+static struct resp_shard *
+_resp_shard(struct resp_cache *cache, uint64_t hash)
+{
+        /* The bucket takes the low bits. */
+        return &cache->shards[(hash >> 32) % RESP_CACHE_SHARDS];
+}
+
+
+/* Bytes <b>entry</b> counts for against its shard's bound. */
+static size_t
+_resp_size(const struct resp_entry *entry)
+{
+        return sizeof(*entry) + entry->klen + entry->len;
+}
+
+
+/*
+ * Make a cache of at most <b>max_bytes</b> (0 for the default) of
+ * responses up to <b>max_entry</b> bytes each (0 for the default), kept
+ * for <b>ttl_ms</b> (0 for the default).
+ * @return the cache, or NULL if out of memory.
+ */
+struct resp_cache *
+resp_cache_create(size_t max_bytes, size_t max_entry, unsigned int ttl_ms)
+{
+        struct resp_cache *cache;
+        unsigned int i;
+
+        if (posix_memalign((void **) &cache, 64, sizeof(*cache)))
+                return NULL;
+        memset(cache, 0, sizeof(*cache));
+        if (!max_bytes)
+                max_bytes = RESP_CACHE_DEFAULT_MAX_BYTES;
+        cache->shard_bytes = max_bytes / RESP_CACHE_SHARDS;
+        cache->max_entry = max_entry ? max_entry
+                                     : RESP_CACHE_DEFAULT_MAX_ENTRY;
+        cache->ttl_ns = (uint64_t) (ttl_ms ? ttl_ms
+                                           : RESP_CACHE_DEFAULT_TTL_MS) *
+                        1000000;
+        for (i = 0; i < RESP_CACHE_SHARDS; i++)
+                pthread_mutex_init(&cache->shards[i].lock, NULL);
+        return cache;
+}
+
+
+static void
+_resp_entry_free(struct resp_entry *entry)
+{
+        free(entry->data);
+        free(entry);
+}
+
+
+/*
+ * Drop a reference to <b>entry</b>, freeing it when the last one goes.
+ * Safe to call without the shard lock.
+ */
+void
+resp_entry_put(struct resp_cache *cache, struct resp_entry *entry)
+{
+        (void) cache;
+
+        if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0)
+                _resp_entry_free(entry);
+}
+
+
+/* Take <b>entry</b> out of its hash chain, so that nobody finds it again.
+ * A ready entry stays queued, holding the table's reference and counted
+ * in the shard's bytes until the CLOCK hand comes by, so that dead entries
+ * still push the hand round.  Caller holds the shard lock. */
+static void
+_resp_unhash(struct resp_shard *sh, struct resp_entry *entry)
+{
+        struct resp_entry **link;
+
+        link = &sh->buckets[entry->hash & (RESP_CACHE_BUCKETS - 1)];
+        while (*link != entry)
+                link = &(*link)->hnext;
+        *link = entry->hnext;
+        entry->in_table = 0;
+}
+
+
+/* Free everything in the cache.  Nobody may use it meanwhile. */
+void
+resp_cache_delete(struct resp_cache *cache)
+{
+        struct resp_entry *entry, *next;
+        unsigned int i, b;
+
+        for (i = 0; i < RESP_CACHE_SHARDS; i++) {
+                struct resp_shard *sh = &cache->shards[i];
+
+                /* Entries still filling are not queued. */
+                for (b = 0; b < RESP_CACHE_BUCKETS; b++) {
+                        for (entry = sh->buckets[b]; entry; entry = next) {
+                                next = entry->hnext;
+                                if (entry->state != RESP_READY)
+                                        resp_entry_put(cache, entry);
+                        }
+                }
+                for (entry = sh->qhead; entry; entry = next) {
+                        next = entry->qnext;
+                        resp_entry_put(cache, entry);
+                }
+                pthread_mutex_destroy(&sh->lock);
+        }
+        free(cache);
+}
+
+
+static struct resp_entry *
+_resp_lookup(struct resp_shard *sh, const void *key, size_t klen,
+             uint64_t hash)
+{
+        struct resp_entry *entry;
+
+        entry = sh->buckets[hash & (RESP_CACHE_BUCKETS - 1)];
+        for (; entry; entry = entry->hnext) {
+                if (entry->hash == hash && entry->klen == klen &&
+                    !memcmp(entry->key, key, klen))
+                        return entry;
+        }
+        return NULL;
+}
+
+
+/* Wait for somebody else to fill <b>entry</b>, while <b>client_fd</b>'s
+ * client is still there.  @return RESP_CACHE_HIT, RESP_CACHE_MISS if the
+ * fill failed or takes too long, or -ECONNRESET. */
+static int
+_resp_wait(struct resp_cache *cache, struct resp_entry *entry, int client_fd)
+{
+        uint64_t give_up = net_now_ns() +
+                           (uint64_t) RESP_CACHE_FILL_WAIT_MS * 1000000;
+        int ms = 1, state;
+
+        __atomic_add_fetch(&cache->coalesced, 1, __ATOMIC_RELAXED);
+        for (;;) {
+                state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+                if (state == RESP_READY) {
+                        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+                        return RESP_CACHE_HIT;
+                }
+                if (state == RESP_FAILED || net_now_ns() >= give_up)
+                        break;
+                /* As a rate limited connection sleeps: asking for no
+                 * events still wakes us if the client leaves. */
+                if (net_wait(client_fd, 0, ms) != 0) {
+                        resp_entry_put(cache, entry);
+                        return -ECONNRESET;
+                }
+                if (ms < RESP_CACHE_FILL_POLL_MS)
+                        ms *= 2;
+        }
+        resp_entry_put(cache, entry);
+        return RESP_CACHE_MISS;
+}
+
+
+/*
+ * Look up the request <b>key</b> of <b>klen</b> bytes for the client on
+ * <b>client_fd</b>.
+ * @return RESP_CACHE_HIT with a referenced, ready *<b>entry</b>, to be
+ *      sent and released with resp_entry_put(); RESP_CACHE_FILL with an
+ *      empty *<b>entry</b> the caller fills with resp_cache_append() and
+ *      hands back with resp_cache_publish(); RESP_CACHE_MISS if the
+ *      caller should just go to the upstream; or -ECONNRESET if the
+ *      client left while waiting for another's fill.
+ */
+int
+resp_cache_get(struct resp_cache *cache, const void *key, size_t klen,
+               int client_fd, struct resp_entry **entry)
+{
+        uint64_t hash = _resp_hash(key, klen);
+        struct resp_shard *sh = _resp_shard(cache, hash);
+        struct resp_entry *e;
+        int r;
+
+        *entry = NULL;
+        pthread_mutex_lock(&sh->lock);
+        e = _resp_lookup(sh, key, klen, hash);
+        if (e && e->state == RESP_READY && net_now_ns() >= e->expires_ns) {
+                _resp_unhash(sh, e);
+                e = NULL;
+        }
+        if (e) {
+                __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+                e->referenced = 1;
+                pthread_mutex_unlock(&sh->lock);
+                if (e->state == RESP_READY) {
+                        __atomic_add_fetch(&cache->hits, 1,
+                                           __ATOMIC_RELAXED);
+                        *entry = e;
+                        return RESP_CACHE_HIT;
+                }
+                r = _resp_wait(cache, e, client_fd);
+                if (r == RESP_CACHE_HIT)
+                        *entry = e;
+                return r;
+        }
+
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        e = malloc(sizeof(*e) + klen);
+        if (!e) {
+                pthread_mutex_unlock(&sh->lock);
+                return RESP_CACHE_MISS;
+        }
+        memset(e, 0, sizeof(*e));
+        memcpy(e->key, key, klen);
+        e->klen = klen;
+        e->hash = hash;
+        e->state = RESP_FILLING;
+        /* One reference for the table and one for the filler. */
+        e->refs = 2;
+        e->in_table = 1;
+        e->hnext = sh->buckets[hash & (RESP_CACHE_BUCKETS - 1)];
+        sh->buckets[hash & (RESP_CACHE_BUCKETS - 1)] = e;
+        pthread_mutex_unlock(&sh->lock);
+
+        *entry = e;
+        return RESP_CACHE_FILL;
+}
+
+
+/*
+ * Add <b>n</b> bytes of <b>buf</b> to the response filling <b>entry</b>.
+ * @return 0, or -1 if the response grew too big to keep or memory ran out;
+ *      the caller then publishes it as failed.
+ */
+int
+resp_cache_append(struct resp_cache *cache, struct resp_entry *entry,
+                  const void *buf, size_t n)
+{
+        size_t cap = entry->cap ? entry->cap : 4096;
+        char *data;
+
+        if (entry->len + n > cache->max_entry)
+                return -1;
+        while (cap < entry->len + n)
+                cap *= 2;
+        if (cap > entry->cap) {
+                data = realloc(entry->data, cap);
+                if (!data)
+                        return -1;
+                entry->data = data;
+                entry->cap = cap;
+        }
+        memcpy(entry->data + entry->len, buf, n);
+        entry->len += n;
+        return 0;
+}
+
+
+/* Is the response in <b>buf</b> one to give to other clients: a 200 that
+ * does not say otherwise? */
+static int
+_resp_cacheable(const char *buf, size_t len)
+{
+        static const char *const nots[] = { "no-store", "private",
+                                            "\r\nset-cookie:" };
+        size_t head, i, j;
+
+        if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0 ||
+            strncmp(buf + 8, " 200", 4) != 0)
+                return 0;
+        for (head = 0; head + 4 <= len; head++)
+                if (!memcmp(buf + head, "\r\n\r\n", 4))
+                        break;
+        if (head + 4 > len)
+                return 0;
+        for (i = 0; i < sizeof(nots) / sizeof(nots[0]); i++) {
+                size_t n = strlen(nots[i]);
+
+                for (j = 0; j + n <= head + 2; j++)
+                        if (!strncasecmp(buf + j, nots[i], n))
+                                return 0;
+        }
+        return 1;
+}
+
+
+/* Let the CLOCK hand go round <b>sh</b> until it is within bounds.
+ * Caller holds the lock. */
+static void
+_resp_evict(struct resp_cache *cache, struct resp_shard *sh)
+{
+        uint64_t now = net_now_ns();
+        struct resp_entry *e;
+
+        while (sh->bytes > cache->shard_bytes && (e = sh->qhead)) {
+                sh->qhead = e->qnext;
+                if (!sh->qhead)
+                        sh->qtail = NULL;
+                e->qnext = NULL;
+
+                if (e->in_table && e->referenced && now < e->expires_ns) {
+                        /* Hit since we last came by: another round. */
+                        e->referenced = 0;
+                        if (sh->qtail)
+                                sh->qtail->qnext = e;
+                        else
+                                sh->qhead = e;
+                        sh->qtail = e;
+                        continue;
+                }
+                sh->bytes -= _resp_size(e);
+                sh->nentries--;
+                if (e->in_table) {
+                        _resp_unhash(sh, e);
+                        __atomic_add_fetch(&cache->evictions, 1,
+                                           __ATOMIC_RELAXED);
+                }
+                resp_entry_put(cache, e);
+        }
+}
+
+
+/*
+ * The filler of <b>entry</b> is done with it: if <b>ok</b> and the
+ * response is fit to share, serve it from now on; otherwise drop it, and
+ * whoever waits for it goes to the upstream.  Releases the filler's
+ * reference.
+ */
+void
+resp_cache_publish(struct resp_cache *cache, struct resp_entry *entry,
+                   int ok)
+{
+        struct resp_shard *sh = _resp_shard(cache, entry->hash);
+
+        ok = ok && _resp_cacheable(entry->data, entry->len);
+
+        pthread_mutex_lock(&sh->lock);
+        if (ok && entry->in_table) {
+                entry->expires_ns = net_now_ns() + cache->ttl_ns;
+                entry->referenced = 0;
+                __atomic_store_n(&entry->state, RESP_READY,
+                                 __ATOMIC_RELEASE);
+                sh->bytes += _resp_size(entry);
+                sh->nentries++;
+                /* The table's reference goes with it into the queue. */
+                if (sh->qtail)
+                        sh->qtail->qnext = entry;
+                else
+                        sh->qhead = entry;
+                sh->qtail = entry;
+                _resp_evict(cache, sh);
+        } else {
+                if (entry->in_table) {
+                        _resp_unhash(sh, entry);
+                        resp_entry_put(cache, entry);
+                }
+                __atomic_store_n(&entry->state, RESP_FAILED,
+                                 __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&sh->lock);
+        resp_entry_put(cache, entry);
+}
@@ -0,0 +1,104 @@
+/* Cache of upstream responses for the proxy.
+ *
+ * Entries are keyed by the whole request as the client sent it and hold
+ * the whole response as the upstream sent it, for a fixed time to live.
+ * The table is split in shards, each with its own lock and byte bound, and
+ * evicts with CLOCK: entries queue in the order they were filled and one
+ * that was hit since it last came up gets another round instead of going.
+ * Entries are refcounted, so hits are sent straight from the cached
+ * buffer, and one that is evicted meanwhile goes once its last sender is
+ * done.
+ *
+ * The first client to miss fills the entry while relaying its response;
+ * others asking for the same thing meanwhile wait for it rather than go to
+ * the upstream too. */
+
+#ifndef _RESPCACHE_H
+#define _RESPCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define RESP_CACHE_SHARDS 16
+/* Hash buckets per shard; a power of two. */
+#define RESP_CACHE_BUCKETS 1024
+#define RESP_CACHE_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+/* Responses larger than this are relayed but not kept. */
+#define RESP_CACHE_DEFAULT_MAX_ENTRY (1024 * 1024)
+#define RESP_CACHE_DEFAULT_TTL_MS 10000
+/* How long a client waits for another to fill an entry before going to
+ * the upstream itself, and how often it looks meanwhile, at most. */
+#define RESP_CACHE_FILL_WAIT_MS 5000
+#define RESP_CACHE_FILL_POLL_MS 16
+
+/* What resp_cache_get() found. */
+#define RESP_CACHE_MISS 0
+#define RESP_CACHE_HIT 1
+#define RESP_CACHE_FILL 2
+
+/* Entry states. */
+#define RESP_FILLING 0
+#define RESP_READY 1
+#define RESP_FAILED 2
+
+struct resp_entry {
+        /* Hash chain and CLOCK queue, protected by the shard lock. */
+        struct resp_entry *hnext;
+        struct resp_entry *qnext;
+        uint64_t hash;
+        /* References held by senders and the filler, plus one while in
+         * the table or queue. */
+        unsigned int refs;
+        int in_table;
+        /* Hit since the CLOCK hand last passed. */
+        int referenced;
+        /* One of RESP_*; set by the filler, polled by waiters. */
+        int state;
+        /* CLOCK_MONOTONIC ns after which the entry is stale. */
+        uint64_t expires_ns;
+        /* The response; grown by the filler until it is ready. */
+        char *data;
+        size_t len;
+        size_t cap;
+        /* Kept whole, so that a hash collision is never served. */
+        size_t klen;
+        char key[];
+};
+
+struct resp_shard {
+        pthread_mutex_t lock;
+        struct resp_entry *buckets[RESP_CACHE_BUCKETS];
+        /* Oldest ready entry first. */
+        struct resp_entry *qhead;
+        struct resp_entry *qtail;
+        size_t bytes;
+        unsigned int nentries;
+} __attribute__ ((aligned(64)));
+
+struct resp_cache {
+        struct resp_shard shards[RESP_CACHE_SHARDS];
+        /* Bound on each shard's bytes. */
+        size_t shard_bytes;
+        size_t max_entry;
+        uint64_t ttl_ns;
+
+        unsigned long hits;
+        unsigned long misses;
+        /* Misses that waited for another client's fill. */
+        unsigned long coalesced;
+        unsigned long evictions;
+};
+
+struct resp_cache *resp_cache_create(size_t max_bytes, size_t max_entry,
+                                     unsigned int ttl_ms);
+void resp_cache_delete(struct resp_cache *cache);
+int resp_cache_get(struct resp_cache *cache, const void *key, size_t klen,
+                   int client_fd, struct resp_entry **entry);
+int resp_cache_append(struct resp_cache *cache, struct resp_entry *entry,
+                      const void *buf, size_t n);
+void resp_cache_publish(struct resp_cache *cache, struct resp_entry *entry,
+                        int ok);
+void resp_entry_put(struct resp_cache *cache, struct resp_entry *entry);
+
+#endif
@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "net/net_util.h"
+
+#include "scheduler.h"
+
+/* How many times a spinning worker checks its own queues between rounds of
+ * stealing, which touch every other worker's cache lines. */
+#define SCHED_SPIN_STEAL_EVERY 16
+
+/* The order thieves look at a victim's classes in. */
+static const unsigned int _sched_steal_order[SCHED_CLASSES] = {
+        SCHED_CLASS_INTERACTIVE, SCHED_CLASS_DEFAULT, SCHED_CLASS_BULK
+};
+
+
+/* Open <b>w</b>'s wake fd.  @return 0, or the negative errno. */
+static int
+_sched_wake_open(struct sched_worker *w)
+{
+#ifdef __linux__
+        w->wake_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->wake_fd[0] >= 0) {
+                w->wake_fd[1] = w->wake_fd[0];
+                return 0;
+        }
+#endif
+        if (pipe(w->wake_fd) < 0)
+                return -errno;
+        fcntl(w->wake_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(w->wake_fd[1], F_SETFL, O_NONBLOCK);
+        fcntl(w->wake_fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(w->wake_fd[1], F_SETFD, FD_CLOEXEC);
+        return 0;
+}
+
+
+static void
+_sched_wake_close(struct sched_worker *w)
+{
+        if (w->wake_fd[1] != w->wake_fd[0])
+                close(w->wake_fd[1]);
+        close(w->wake_fd[0]);
+}
+
+
+/*
+ * Create a scheduler for <b>nworkers</b> workers.  If <b>busy_poll</b> is
+ * set idle workers spin for up to <b>busy_idle_usec</b> before parking.
+ * @return the scheduler, or NULL on failure.
+ */
+struct sched *
+sched_create(unsigned int nworkers, unsigned int max_queued, int busy_poll,
+             unsigned int busy_idle_usec)
+{
+        struct sched *s;
+        unsigned int i, k;
+
+        s = calloc(1, sizeof(*s));
+        if (!s)
+                return NULL;
+        /* aligned_alloc() keeps each worker on its own cache lines. */
+        s->workers = aligned_alloc(64, nworkers * sizeof(*s->workers));
+        if (!s->workers) {
+                free(s);
+                return NULL;
+        }
+        memset(s->workers, 0, nworkers * sizeof(*s->workers));
+
+        for (i = 0; i < nworkers; i++) {
+                struct sched_worker *w = &s->workers[i];
+
+                for (k = 0; k < SCHED_CLASSES; k++)
+                        if (ws_init(&w->dq[k]) < 0)
+                                break;
+                if (k < SCHED_CLASSES || _sched_wake_open(w) < 0) {
+                        while (k--)
+                                ws_delete(&w->dq[k]);
+                        goto err;
+                }
+                pthread_mutex_init(&w->lock, NULL);
+                w->id = i;
+                w->rng = 2654435761u * (i + 1);
+                w->spin_window = (uint64_t) busy_idle_usec * 1000;
+        }
+
+        s->nworkers = nworkers;
+        s->max_queued = max_queued ? max_queued : SCHED_DEFAULT_MAX_QUEUED;
+        s->busy_poll = busy_poll;
+        s->busy_idle_usec = busy_idle_usec;
+        s->weights[SCHED_CLASS_DEFAULT] = SCHED_WEIGHT_DEFAULT;
+        s->weights[SCHED_CLASS_INTERACTIVE] = SCHED_WEIGHT_INTERACTIVE;
+        s->weights[SCHED_CLASS_BULK] = SCHED_WEIGHT_BULK;
+        pthread_mutex_init(&s->room_lock, NULL);
+        pthread_cond_init(&s->room, NULL);
+        return s;
+
+ err:
+        while (i--) {
+                for (k = 0; k < SCHED_CLASSES; k++)
+                        ws_delete(&s->workers[i].dq[k]);
+                _sched_wake_close(&s->workers[i]);
+                pthread_mutex_destroy(&s->workers[i].lock);
+        }
+        free(s->workers);
+        free(s);
+        return NULL;
+}
+
+
+/* Free the scheduler and close any connection still queued.  No worker may
+ * be running. */
+void
+sched_delete(struct sched *s)
+{
+        unsigned int i, k;
+
+        for (i = 0; i < s->nworkers; i++) {
+                struct sched_worker *w = &s->workers[i];
+                struct conn *c;
+
+                for (k = 0; k < SCHED_CLASSES; k++) {
+                        while ((c = ws_take(&w->dq[k])) != NULL)
+                                conn_free(c);
+                        ws_delete(&w->dq[k]);
+                }
+                while ((c = w->inbox_head) != NULL) {
+                        w->inbox_head = c->next;
+                        conn_free(c);
+                }
+                pthread_mutex_destroy(&w->lock);
+                _sched_wake_close(w);
+        }
+        pthread_mutex_destroy(&s->room_lock);
+        pthread_cond_destroy(&s->room);
+        free(s->workers);
+        free(s);
+}
+
+
+/*
+ * Have workers run up to <b>weight</b> connections of class <b>prio</b>
+ * in a row while other classes wait.  Safe while workers run.
+ * @return 0, or -EINVAL for no such class or a weight of 0.
+ */
+int
+sched_set_weight(struct sched *s, unsigned int prio, unsigned int weight)
+{
+        if (prio >= SCHED_CLASSES || !weight)
+                return -EINVAL;
+        __atomic_store_n(&s->weights[prio], weight, __ATOMIC_RELAXED);
+        return 0;
+}
+
+
+/* The deque <b>c</b>'s class queues in on <b>w</b>. */
+static struct ws_deque *
+_sched_dq(struct sched_worker *w, const struct conn *c)
+{
+        return &w->dq[c->prio < SCHED_CLASSES ? c->prio : SCHED_CLASS_DEFAULT];
+}
+
+
+/* Ready connections on <b>w</b>'s deques, all classes together. */
+static long
+_sched_size(struct sched_worker *w)
+{
+        long n = 0;
+        unsigned int k;
+
+        for (k = 0; k < SCHED_CLASSES; k++)
+                n += ws_size(&w->dq[k]);
+        return n;
+}
+
+
+/*
+ * Wake <b>w</b> if it is parked and nobody has woken it yet.
+ * @return 1 if this call woke it.
+ */
+static int
+_sched_wake(struct sched_worker *w)
+{
+        static const uint64_t one = 1;
+        ssize_t r;
+
+        /* Pairs with the store in sched_park(): either it sees our work or
+         * we see it parked. */
+        if (!__atomic_load_n(&w->parked, __ATOMIC_SEQ_CST) ||
+            __atomic_exchange_n(&w->wake_pending, 1, __ATOMIC_SEQ_CST))
+                return 0;
+        /* An eventfd wants 8 bytes; a pipe takes the first one, and a full
+         * one is as good as written. */
+        r = write(w->wake_fd[1], &one,
+                  w->wake_fd[1] == w->wake_fd[0] ? sizeof(one) : 1);
+        (void) r;
+        return 1;
+}
+
+
+/* Wake one parked worker, other than <b>self</b>, so that it can steal. */
+static void
+_sched_kick(struct sched *s, unsigned int self)
+{
+        unsigned int i;
+
+        if (!__atomic_load_n(&s->nparked, __ATOMIC_SEQ_CST))
+                return;
+
+        for (i = 1; i < s->nworkers; i++)
+                if (_sched_wake(&s->workers[(self + i) % s->nworkers]))
+                        return;
+}
+
+
+/* Append <b>c</b> to <b>w</b>'s inbox and wake it if it sleeps. */
+static void
+_sched_inbox_push(struct sched_worker *w, struct conn *c)
+{
+        c->next = NULL;
+        pthread_mutex_lock(&w->lock);
+        if (w->inbox_tail)
+                w->inbox_tail->next = c;
+        else
+                w->inbox_head = c;
+        w->inbox_tail = c;
+        __atomic_store_n(&w->inbox_len, w->inbox_len + 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&w->lock);
+        _sched_wake(w);
+}
+
+
+/* Wake every acceptor waiting for room; each looks for itself. */
+static void
+_sched_room(struct sched *s)
+{
+        if (!__atomic_load_n(&s->room_waiters, __ATOMIC_SEQ_CST))
+                return;
+        pthread_mutex_lock(&s->room_lock);
+        pthread_cond_broadcast(&s->room);
+        pthread_mutex_unlock(&s->room_lock);
+}
+
+
+/*
+ * Queue the accepted connection <b>c</b>, preferring a parked worker over
+ * piling onto a busy one.
+ * @return 0 on success, -1 if the scheduler is full; see sched_wait_room().
+ */
+int
+sched_submit(struct sched *s, struct conn *c)
+{
+        struct sched_worker *w = NULL;
+        unsigned int i, next;
+
+        /* Several acceptors may race for the last places; whoever takes
+         * one too many gives it back. */
+        if (__atomic_add_fetch(&s->queued, 1, __ATOMIC_SEQ_CST) >
+            s->max_queued) {
+                __atomic_sub_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+                _sched_room(s);
+                return -1;
+        }
+
+        next = __atomic_load_n(&s->next, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&s->nparked, __ATOMIC_RELAXED)) {
+                for (i = 0; i < s->nworkers; i++) {
+                        struct sched_worker *p;
+
+                        p = &s->workers[(next + i) % s->nworkers];
+                        if (__atomic_load_n(&p->parked, __ATOMIC_RELAXED)) {
+                                w = p;
+                                break;
+                        }
+                }
+        }
+        if (!w)
+                w = &s->workers[next % s->nworkers];
+        __atomic_store_n(&s->next, w->id + 1, __ATOMIC_RELAXED);
+
+        _sched_inbox_push(w, c);
+        return 0;
+}
+
+
+/*
+ * Queue <b>c</b> on worker <b>to</b>, whatever its load, e.g. to move it
+ * there from a busier one.  Peers may still steal it.
+ */
+void
+sched_handoff(struct sched *s, unsigned int to, struct conn *c)
+{
+        /* Counted before it is published; see sched_push_ready(). */
+        __atomic_add_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+        _sched_inbox_push(&s->workers[to], c);
+}
+
+
+/* Block the acceptor until the scheduler has room again. */
+void
+sched_wait_room(struct sched *s)
+{
+        pthread_mutex_lock(&s->room_lock);
+        __atomic_add_fetch(&s->room_waiters, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&s->queued, __ATOMIC_SEQ_CST) >= s->max_queued)
+                pthread_cond_wait(&s->room, &s->room_lock);
+        __atomic_sub_fetch(&s->room_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&s->room_lock);
+}
+
+
+/* Move everything in <b>w</b>'s inbox onto its deque, where thieves can see
+ * it.  Owner only. */
+static void
+_sched_drain_inbox(struct sched *s, struct sched_worker *w)
+{
+        struct conn *c, *next;
+        int pushed = 0;
+
+        if (!__atomic_load_n(&w->inbox_len, __ATOMIC_ACQUIRE))
+                return;
+
+        pthread_mutex_lock(&w->lock);
+        c = w->inbox_head;
+        w->inbox_head = w->inbox_tail = NULL;
+        __atomic_store_n(&w->inbox_len, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&w->lock);
+
+        for (; c; c = next) {
+                next = c->next;
+                if (ws_push(_sched_dq(w, c), c) < 0) {
+                        /* Out of memory; put the rest back. */
+                        pthread_mutex_lock(&w->lock);
+                        while (c) {
+                                next = c->next;
+                                c->next = w->inbox_head;
+                                w->inbox_head = c;
+                                if (!w->inbox_tail)
+                                        w->inbox_tail = c;
+                                w->inbox_len++;
+                                c = next;
+                        }
+                        pthread_mutex_unlock(&w->lock);
+                        break;
+                }
+                pushed++;
+        }
+
+        /* We can only run one of these; let a sleeping peer have the rest. */
+        if (pushed > 1)
+                _sched_kick(s, w->id);
+}
+
+
+/* Take one connection from <b>victim</b>: from its deques, interactive
+ * first, or failing that from an inbox it has not drained because it is
+ * busy running a handler. */
+static struct conn *
+_sched_steal_from(struct sched_worker *victim)
+{
+        struct conn *c = NULL;
+        unsigned int k;
+        int tries;
+
+        for (k = 0; k < SCHED_CLASSES; k++) {
+                struct ws_deque *dq = &victim->dq[_sched_steal_order[k]];
+
+                for (tries = 0; tries < 4; tries++) {
+                        c = ws_steal(dq);
+                        if (c != WS_ABORT)
+                                break;
+                }
+                if (c && c != WS_ABORT)
+                        return c;
+        }
+
+        if (!__atomic_load_n(&victim->inbox_len, __ATOMIC_ACQUIRE) ||
+            pthread_mutex_trylock(&victim->lock))
+                return NULL;
+        c = victim->inbox_head;
+        if (c) {
+                victim->inbox_head = c->next;
+                if (!victim->inbox_head)
+                        victim->inbox_tail = NULL;
+                __atomic_store_n(&victim->inbox_len, victim->inbox_len - 1,
+                                 __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&victim->lock);
+        return c;
+}
+
+
+/* One round over every other worker, starting at a random victim. */
+static struct conn *
+_sched_steal(struct sched *s, struct sched_worker *w)
+{
+        unsigned int i, start;
+        struct conn *c;
+
+        if (s->nworkers < 2)
+                return NULL;
+
+        /* xorshift32 */
+        w->rng ^= w->rng << 13;
+        w->rng ^= w->rng >> 17;
+        w->rng ^= w->rng << 5;
+        start = w->rng % s->nworkers;
+
+        for (i = 0; i < s->nworkers; i++) {
+                unsigned int v = (start + i) % s->nworkers;
+
+                if (v == w->id)
+                        continue;
+                c = _sched_steal_from(&s->workers[v]);
+                if (c) {
+                        w->stolen++;
+                        return c;
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * Deficit round robin over <b>w</b>'s classes: keep serving the current
+ * class while it has connections and deficit left, else refill the next
+ * one's deficit with its weight and move on.  A class found empty forfeits
+ * what it had left, so an idle class cannot save up a burst.  Each class
+ * is served newest first, for cache warmth.
+ */
+static struct conn *
+_sched_take(struct sched *s, struct sched_worker *w)
+{
+        unsigned int i, k;
+        struct conn *c;
+
+        for (i = 0; i <= SCHED_CLASSES; i++) {
+                k = w->cur;
+                if (w->deficit[k]) {
+                        c = ws_take(&w->dq[k]);
+                        if (c) {
+                                w->deficit[k]--;
+                                return c;
+                        }
+                }
+                w->deficit[k] = 0;
+                w->cur = (k + 1) % SCHED_CLASSES;
+                w->deficit[w->cur] = __atomic_load_n(&s->weights[w->cur],
+                                                     __ATOMIC_RELAXED);
+        }
+        return NULL;
+}
+
+
+/* Our own work, new connections included so that their class counts
+ * against what is already running, then other workers'. */
+static struct conn *
+_sched_find(struct sched *s, struct sched_worker *w, int steal)
+{
+        struct conn *c;
+
+        _sched_drain_inbox(s, w);
+        c = _sched_take(s, w);
+        if (c)
+                return c;
+        return steal ? _sched_steal(s, w) : NULL;
+}
+
+
+/*
+ * Busy-poll for work for up to the worker's spin window.  The window
+ * doubles, up to busy_idle_usec, whenever spinning pays off and halves
+ * whenever the worker ends up parking anyway.
+ */
+static struct conn *
+_sched_spin(struct sched *s, struct sched_worker *w)
+{
+        uint64_t max_ns = (uint64_t) s->busy_idle_usec * 1000;
+        uint64_t start = net_now_ns();
+        struct conn *c;
+        unsigned int i;
+
+        for (i = 1; ; i++) {
+                c = _sched_find(s, w, (i % SCHED_SPIN_STEAL_EVERY) == 0);
+                if (c) {
+                        w->spin_window *= 2;
+                        if (w->spin_window > max_ns)
+                                w->spin_window = max_ns;
+                        return c;
+                }
+                NET_CPU_RELAX();
+
+                /* Reading the clock costs more than a pause; batch it. */
+                if ((i & 63) == 0 && net_now_ns() - start > w->spin_window)
+                        break;
+        }
+
+        w->spin_window /= 2;
+        if (w->spin_window < 1000)
+                w->spin_window = 1000;
+        return NULL;
+}
+
+
+/* @return whether there is anything <b>w</b> could run or steal. */
+static int
+_sched_has_work(struct sched *s, struct sched_worker *w)
+{
+        unsigned int i;
+
+        if (__atomic_load_n(&w->inbox_len, __ATOMIC_SEQ_CST) ||
+            _sched_size(w) || __atomic_load_n(&s->stopped, __ATOMIC_SEQ_CST))
+                return 1;
+        for (i = 0; i < s->nworkers; i++) {
+                struct sched_worker *v = &s->workers[i];
+
+                if (v != w && (_sched_size(v) ||
+                               __atomic_load_n(&v->inbox_len,
+                                               __ATOMIC_RELAXED)))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/* Clear <b>w</b>'s parked state, and its wakeup if it had one or
+ * <b>slept</b>. */
+static void
+_sched_unpark(struct sched *s, struct sched_worker *w, int slept)
+{
+        uint64_t buf[8];
+
+        __atomic_store_n(&w->parked, 0, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&s->nparked, 1, __ATOMIC_SEQ_CST);
+        if (!slept && !__atomic_load_n(&w->wake_pending, __ATOMIC_SEQ_CST))
+                return;
+        /* A waker that comes in between finds us unparked and leaves at
+         * worst a stale count behind, which costs one spurious wakeup. */
+        while (read(w->wake_fd[0], buf, sizeof(buf)) > 0)
+                ;
+        __atomic_store_n(&w->wake_pending, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Get worker <b>self</b> ready to sleep until sched_wake_fd() is readable,
+ * which it will be as soon as there is work for it.  Call sched_unpark()
+ * once awake.
+ * @return 1 if parked, 0 if there is work to look at instead.
+ */
+int
+sched_park(struct sched *s, unsigned int self)
+{
+        struct sched_worker *w = &s->workers[self];
+
+        __atomic_store_n(&w->parked, 1, __ATOMIC_SEQ_CST);
+        /* Announce ourselves before looking one last time: a peer that
+         * queues work after our look is then sure to see us and wake us. */
+        __atomic_add_fetch(&s->nparked, 1, __ATOMIC_SEQ_CST);
+        if (!_sched_has_work(s, w))
+                return 1;
+        _sched_unpark(s, w, 0);
+        return 0;
+}
+
+
+/* Worker <b>self</b> is awake again; see sched_park(). */
+void
+sched_unpark(struct sched *s, unsigned int self)
+{
+        _sched_unpark(s, &s->workers[self], 1);
+}
+
+
+/* @return the fd that becomes readable when parked worker <b>self</b> has
+ * work, for its event loop to wait on. */
+int
+sched_wake_fd(struct sched *s, unsigned int self)
+{
+        return s->workers[self].wake_fd[0];
+}
+
+
+/* Wake every parked worker, e.g. to have it look at some flag of its
+ * owner's. */
+void
+sched_wake_all(struct sched *s)
+{
+        unsigned int i;
+
+        for (i = 0; i < s->nworkers; i++)
+                _sched_wake(&s->workers[i]);
+}
+
+
+/* Make sched_next() return NULL from now on, for workers to exit.  Work
+ * still queued stays there for sched_delete(). */
+void
+sched_stop(struct sched *s)
+{
+        __atomic_store_n(&s->stopped, 1, __ATOMIC_SEQ_CST);
+        sched_wake_all(s);
+}
+
+
+/* Sleep until the acceptor or a peer has something for us. */
+static void
+_sched_sleep(struct sched *s, struct sched_worker *w)
+{
+        struct pollfd pfd;
+
+        if (!sched_park(s, w->id))
+                return;
+        pfd.fd = w->wake_fd[0];
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+                ;
+        sched_unpark(s, w->id);
+}
+
+
+/* Account for <b>w</b> taking a connection off the queues. */
+static void
+_sched_took(struct sched *s, struct sched_worker *w)
+{
+        w->ran++;
+        __atomic_sub_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+        _sched_room(s);
+}
+
+
+/*
+ * Return the next connection for worker <b>self</b> to run, blocking until
+ * there is one.  The caller owns the connection, and its fd, from here on.
+ * Returns NULL once the scheduler is stopped.
+ */
+struct conn *
+sched_next(struct sched *s, unsigned int self)
+{
+        struct sched_worker *w = &s->workers[self];
+        struct conn *c;
+
+        for (;;) {
+                if (__atomic_load_n(&s->stopped, __ATOMIC_SEQ_CST))
+                        return NULL;
+                c = _sched_find(s, w, 1);
+                if (!c && s->busy_poll)
+                        c = _sched_spin(s, w);
+                if (c)
+                        break;
+                _sched_sleep(s, w);
+        }
+
+        _sched_took(s, w);
+        return c;
+}
+
+
+/*
+ * As sched_next(), but return NULL at once if there is nothing to run, for
+ * workers that have their own event loop to get back to.
+ */
+struct conn *
+sched_try_next(struct sched *s, unsigned int self)
+{
+        struct sched_worker *w = &s->workers[self];
+        struct conn *c;
+
+        c = _sched_find(s, w, 1);
+        if (c)
+                _sched_took(s, w);
+        return c;
+}
+
+
+/*
+ * Queue <b>c</b>, whose handler is ready to continue, on worker
+ * <b>self</b>'s own deque for its class.  Owner only.  Idle peers may steal it.
+ * @return 0 on success, -1 if out of memory.
+ */
+int
+sched_push_ready(struct sched *s, unsigned int self, struct conn *c)
+{
+        struct sched_worker *w = &s->workers[self];
+
+        /* Count it before a thief can see it, or the thief's decrement
+         * could come first and wrap queued. */
+        __atomic_add_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+        if (ws_push(_sched_dq(w, c), c) < 0) {
+                __atomic_sub_fetch(&s->queued, 1, __ATOMIC_SEQ_CST);
+                _sched_room(s);
+                return -1;
+        }
+        if (_sched_size(w) > 1)
+                _sched_kick(s, self);
+        return 0;
+}
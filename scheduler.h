@@ -0,0 +1,111 @@
+/* Work-stealing scheduler handing connections to workers.
+ *
+ * Every worker owns a Chase-Lev deque of ready connections plus a small
+ * locked inbox the acceptor hands new connections to.  A worker that runs
+ * dry steals from the others, so a few heavy clients landing on one worker
+ * no longer leave the rest idle.
+ *
+ * Connections come in priority classes, each queued apart.  A worker picks
+ * among its classes by deficit round robin, running up to a class's weight
+ * of its connections before moving on to the next, so that interactive
+ * traffic gets its share however much bulk work is queued ahead of it.
+ * Thieves take the interactive class first. */
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "wsdeque.h"
+#include "conn.h"
+
+/* Accepted connections not yet picked up by a worker; beyond this the
+ * acceptor stops accepting and lets the kernel backlog absorb the load. */
+#define SCHED_DEFAULT_MAX_QUEUED 4096
+
+/* Priority classes; see conn->prio. */
+#define SCHED_CLASS_DEFAULT 0
+#define SCHED_CLASS_INTERACTIVE 1
+#define SCHED_CLASS_BULK 2
+#define SCHED_CLASSES 3
+
+/* Connections of each class a worker runs per round, if others wait. */
+#define SCHED_WEIGHT_DEFAULT 4
+#define SCHED_WEIGHT_INTERACTIVE 16
+#define SCHED_WEIGHT_BULK 1
+
+struct sched_worker {
+        /* Ready connections of each class; pushed and taken by the owner
+         * only. */
+        struct ws_deque dq[SCHED_CLASSES];
+        /* Deficit round robin: the class being served, and how many more
+         * of its connections it may run this round. */
+        unsigned int cur;
+        unsigned int deficit[SCHED_CLASSES];
+
+        /* Protects the inbox. */
+        pthread_mutex_t lock;
+        struct conn *inbox_head;
+        struct conn *inbox_tail;
+        /* Read without the lock by spinning owners. */
+        unsigned int inbox_len;
+
+        /* A parked worker sleeps until wake_fd[0] is readable: an eventfd
+         * (both ends the same) or, without one, a pipe.  Peers write only
+         * to a worker that is parked and not already woken, so a burst of
+         * handoffs costs one write and a busy worker none at all. */
+        int wake_fd[2];
+        int parked;
+        int wake_pending;
+
+        unsigned int id;
+        unsigned int rng;
+        uint64_t spin_window;
+
+        unsigned long ran;
+        unsigned long stolen;
+} __attribute__ ((aligned(64)));
+
+struct sched {
+        struct sched_worker *workers;
+        unsigned int nworkers;
+        /* Round robin cursor.  Every listener's acceptor moves it, without
+         * a lock: a lost update only skews one pick. */
+        unsigned int next;
+        /* Workers asleep, or on their way to sleep. */
+        unsigned int nparked;
+
+        unsigned int queued;
+        unsigned int max_queued;
+        pthread_mutex_t room_lock;
+        pthread_cond_t room;
+        /* Acceptors asleep in sched_wait_room(). */
+        unsigned int room_waiters;
+
+        int busy_poll;
+        unsigned int busy_idle_usec;
+        /* Round robin weight of each class; see sched_set_weight(). */
+        unsigned int weights[SCHED_CLASSES];
+
+        /* Set by sched_stop(); sched_next() then returns NULL. */
+        int stopped;
+};
+
+struct sched *sched_create(unsigned int nworkers, unsigned int max_queued,
+                           int busy_poll, unsigned int busy_idle_usec);
+void sched_delete(struct sched *s);
+int sched_set_weight(struct sched *s, unsigned int prio, unsigned int weight);
+int sched_submit(struct sched *s, struct conn *c);
+void sched_handoff(struct sched *s, unsigned int to, struct conn *c);
+void sched_wait_room(struct sched *s);
+struct conn *sched_next(struct sched *s, unsigned int self);
+struct conn *sched_try_next(struct sched *s, unsigned int self);
+int sched_push_ready(struct sched *s, unsigned int self, struct conn *c);
+int sched_wake_fd(struct sched *s, unsigned int self);
+int sched_park(struct sched *s, unsigned int self);
+void sched_unpark(struct sched *s, unsigned int self);
+void sched_wake_all(struct sched *s);
+void sched_stop(struct sched *s);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h> // memset
 #include <stdlib.h>
 
@@ -10,22 +11,62 @@
 
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "net/net_util.h"
 #include "net/net_compat.h"
+#include "net/net_trace.h"
+#include "net/net_event.h"
 
-#include "ring.h"
+#include "conn.h"
+#include "coro.h"
+#include "evloop.h"
+#include "scheduler.h"
 #include "server.h"
+#include "balancer.h"
+#include "capture.h"
+#include "dispatch.h"
+#include "fileserve.h"
+#include "healthcheck.h"
+#include "histogram.h"
+#include "httpserve.h"
+#include "membudget.h"
+#include "proxy.h"
+#include "respcache.h"
+#include "ratelimit.h"
 
+/* Handler runs between non-blocking polls of a worker's event loop, so
+ * that suspended connections are not starved by a stream of ready ones. */
+#define SERVER_POLL_EVERY 16
+
+/* Rebalancing, see server_engine_rebalance().  Loads are in thousandths
+ * of a worker's time spent running handlers: a worker above HIGH sheds
+ * suspended connections to the least loaded one if that is GAP below it,
+ * at most BATCH at a time. */
+#define SERVER_REBALANCE_HIGH 750
+#define SERVER_REBALANCE_GAP 250
+#define SERVER_REBALANCE_BATCH 64
+
+/* How often server_engine_drain() checks on the connections in flight. */
+#define SERVER_DRAIN_POLL_MS 10
+/* How long handlers get to notice they were cancelled. */
+#define SERVER_CANCEL_MS 1000
+/* How long server_engine_handover() waits for the successor to confirm. */
+#define SERVER_HANDOVER_MS 5000
+/* How long the acceptor backs off when out of descriptors: the listener
+ * stays readable, so retrying at once only burns the CPU others need to
+ * finish and free some. */
+#define SERVER_ACCEPT_LIMIT_MS 10
 
 /*
  * Open a tcp socket and return it's fd.  Don't forget to close it when done!
+ * The listener is tuned with <b>prof</b>, which may be NULL.
  * @return net_socket_fd_t, the socket of a binded and listening socket.
  *      Returns the macro NET_INVALID_SOCKET on failure.  No outstanding
  *      memory or sockets on failure.
  */
 net_socket_fd_t
-_server_tcp_init(char *server_port)
+_server_tcp_init(char *server_port, const struct net_sockopt_profile *prof)
 {
         net_socket_fd_t sock_fd;
         int err;
@@ -48,8 +89,10 @@ _server_tcp_init(char *server_port)
                 return NET_INVALID_SOCKET;
         }
 
-        sock_fd = net_socket_nonblocking(server->ai_family, server->ai_socktype,
-                                         server->ai_protocol);
+        sock_fd = net_socket_nonblocking_tuned(server->ai_family,
+                                               server->ai_socktype,
+                                               server->ai_protocol, prof,
+                                               NET_SOCKOPT_LISTENER);
 
         if ( !NET_SOCKET_OK(sock_fd) ) {
                 /* We use the following macro to read errno. */
@@ -112,7 +155,8 @@ _server_tcp_init(char *server_port)
         }
 
         /* SOMAXCONN is provivded by <sys/socket.h>. */
-        if (listen(sock_fd, SOMAXCONN) < 0) {
+        if (listen(sock_fd, (prof && prof->backlog) ? prof->backlog
+                                                    : SOMAXCONN) < 0) {
                 err = net_socket_errno(sock_fd);
                 net_error("Error listening on port: %s. %s.\n", server_port,
                           net_socket_strerror(err));
@@ -125,110 +169,837 @@ _server_tcp_init(char *server_port)
 }
 
 
+/* What each worker thread is started with. */
+struct _server_worker {
+        struct server_engine *engine;
+        unsigned int id;
+        pthread_t thread;
+        /* Connections whose handler is suspended in net_wait(). */
+        struct evloop loop;
+        /* Ready connections that did not fit on the scheduler's deque. */
+        struct conn *overflow;
+
+        /* While rebalancing: time spent in handlers since the window
+         * started, when it ends, and the last window's load for peers to
+         * read. */
+        uint64_t busy_ns;
+        uint64_t window_end;
+        unsigned int load;
+        unsigned long migrated;
+};
+
+
+/* A listening socket and the thread accepting on it. */
+struct _server_listener {
+        struct _server_listener *next;
+        struct server_engine *engine;
+        struct _server_vars *s_vars;
+        net_socket_fd_t fd;
+        pthread_t thread;
+        /* With a dispatcher: connections whose client has not sent enough
+         * to route them yet, and the listener itself. */
+        struct evloop pending;
+};
+
+
+/* Worker threads and event loops shared by any number of listeners. */
+struct server_engine {
+        /* Hands accepted connections to the workers. */
+        struct sched *sched;
+        int worker_mode;
+        unsigned int busy_idle_usec;
+        unsigned int nworkers;
+        struct _server_worker *workers;
+        /* Load measuring window, or 0 not to rebalance. */
+        uint64_t rebalance_ns;
+
+        /* Connections queued or running on the workers. */
+        unsigned int active;
+        /* Readable once the acceptors are to stop; see server_engine_stop(). */
+        int stop_fd[2];
+        int stopping;
+        /* Workers wake whatever handler still waits with -ECANCELED. */
+        int cancel;
+
+        /* Guards the listeners list. */
+        pthread_mutex_t lock;
+        struct _server_listener *listeners;
+        /* The trace dumper is running. */
+        int traced;
+};
+
+
+/* The connection whose handler this worker is running, if any. */
+static __thread struct conn *_server_current;
+
+
+/* Coroutine body: run the server's handler on the connection. */
+static void
+_server_coro_main(void *arg)
+{
+        struct conn *conn = (struct conn *) arg;
+        struct _server_vars *s_vars = (struct _server_vars *) conn->srv;
+
+        /* Rate limited: sit on the connection without reading from it.
+         * Asking for no events still wakes us early if the client leaves. */
+        if (conn->delay_ms &&
+            net_wait(conn->fd, 0, (int) conn->delay_ms) != 0)
+                return;
+
+        if (s_vars->handler)
+                s_vars->handler(s_vars->handler_arg, conn->fd);
+        net_flush(conn->fd, 0);
+}
+
+
+/*
+ * net_wait() hook.  Inside a handler's coroutine, send what it batched,
+ * record what it waits for and yield back to the worker, which arms its
+ * event loop and resumes the handler, possibly on another worker, once the
+ * fd is ready or the timeout passes.  Anywhere else net_wait() polls as
+ * before.
+ */
+static int
+_server_coro_wait(net_socket_fd_t sock_fd, int events, int timeout_ms,
+                  int *result)
+{
+        struct coro *co = coro_current();
+        struct conn *conn;
+
+        if (timeout_ms == 0)
+                return 0;
+        /* Whatever the handler wrote so far is all it has for now. */
+        if (_server_current)
+                net_flush(_server_current->fd, 0);
+        if (!co)
+                return 0;
+
+        conn = (struct conn *) co->arg;
+        conn->wait_fd = sock_fd;
+        conn->wait_events = events;
+        conn->wait_deadline = timeout_ms < 0 ? 0 :
+                net_now_ns() + (uint64_t) timeout_ms * 1000000;
+        coro_yield();
+
+        *result = conn->wait_result;
+        return 1;
+}
+
+
+/* evloop callback: <b>conn</b>'s handler can continue. */
+static void
+_server_ready(struct conn *conn, void *arg)
+{
+        struct _server_worker *self = (struct _server_worker *) arg;
+
+        if (sched_push_ready(self->engine->sched, self->id, conn) < 0) {
+                conn->next = self->overflow;
+                self->overflow = conn;
+        }
+}
+
+
+/* Note when <b>conn</b>'s first unread byte reached the kernel, if the
+ * listener stamps them and there is one. */
+static void
+_server_rx_stamp(struct _server_vars *s_vars, struct conn *conn)
+{
+        uint64_t sw_ns, hw_ns;
+
+        if (!s_vars->sockopts.timestamping)
+                return;
+        /* The NIC's stamp only stands in for a missing software one. */
+        if (net_rx_timestamp(conn->fd, &sw_ns, &hw_ns) > 0)
+                conn->t_rx = net_realtime_to_mono_ns(sw_ns ? sw_ns : hw_ns);
+}
+
+
+/* Add the stages of <b>conn</b>, done at <b>now</b>, to the histograms of
+ * <b>self</b>. */
+static void
+_server_record(struct _server_worker *self, struct conn *conn, uint64_t now)
+{
+        struct _server_vars *s_vars = (struct _server_vars *) conn->srv;
+        struct hist *h = &s_vars->latency_hists[self->id * SERVER_STAGES];
+        uint64_t begin = conn->t_start, first = conn->t_accept;
+
+        if (conn->t_rx) {
+                if (conn->t_rx < conn->t_accept) {
+                        hist_record(&h[SERVER_STAGE_KERNEL],
+                                    conn->t_accept - conn->t_rx);
+                        first = conn->t_rx;
+                }
+                if (conn->t_rx > conn->t_start && conn->t_rx < now)
+                        begin = conn->t_rx;
+                hist_record(&h[SERVER_STAGE_REQUEST], begin - conn->t_start);
+        }
+        hist_record(&h[SERVER_STAGE_QUEUE], conn->t_start - conn->t_accept);
+        hist_record(&h[SERVER_STAGE_HANDLER], now - begin);
+        hist_record(&h[SERVER_STAGE_TOTAL], now - first);
+}
+
+
+/* net_read() hook: add what the running handler reads from its client to
+ * the capture. */
+static void
+_server_capture_read(net_socket_fd_t sock_fd, const void *buf, int n)
+{
+        struct conn *conn = _server_current;
+        struct _server_vars *s_vars;
+
+        if (!conn || conn->fd != sock_fd)
+                return;
+        s_vars = (struct _server_vars *) conn->srv;
+        if (s_vars->capture)
+                capture_record(s_vars->capture, conn->capture_id,
+                               CAPTURE_DATA, buf, (size_t) n);
+}
+
+
+/* <b>conn</b>'s handler returned: account for it and close it. */
+static void
+_server_done(struct _server_worker *self, struct conn *conn)
+{
+        struct _server_vars *s_vars = (struct _server_vars *) conn->srv;
+
+        if (s_vars->latency)
+                _server_record(self, conn, net_now_ns());
+        if (s_vars->capture)
+                capture_record(s_vars->capture, conn->capture_id,
+                               CAPTURE_CLOSE, NULL, 0);
+        net_batch_free(conn->batch);
+        conn_free(conn);
+        __atomic_sub_fetch(&self->engine->active, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Close <b>conn</b>, which a drain that ran out of time left waiting or
+ * queued, as _server_done() would have, its handler never to resume. */
+static void
+_server_abandon(struct server_engine *engine, struct conn *conn)
+{
+        struct _server_vars *s_vars = (struct _server_vars *) conn->srv;
+
+        if (s_vars->capture)
+                capture_record(s_vars->capture, conn->capture_id,
+                               CAPTURE_CLOSE, NULL, 0);
+        if (conn->co)
+                coro_free(conn->co);
+        net_batch_free(conn->batch);
+        conn_free(conn);
+        __atomic_sub_fetch(&engine->active, 1, __ATOMIC_RELEASE);
+}
+
+
+/* Start or resume <b>conn</b>'s handler until it finishes or waits. */
+static void
+_server_run(struct _server_worker *self, struct conn *conn)
+{
+        struct _server_vars *s_vars = (struct _server_vars *) conn->srv;
+        int err, done;
+
+        if (!conn->co) {
+                net_trace(NET_TRACE_DEQUEUE, conn->fd);
+                if (s_vars->latency) {
+                        conn->t_start = net_now_ns();
+                        _server_rx_stamp(s_vars, conn);
+                }
+                if (s_vars->coalesce)
+                        conn->batch = net_batch_new(conn->fd);
+                /* Failing that, large writes are just copied. */
+                if (conn->batch && s_vars->zerocopy)
+                        net_batch_zerocopy(conn->batch, s_vars->zerocopy,
+                                           s_vars->zerocopy_threshold);
+                conn->co = coro_create(&_server_coro_main, conn);
+                if (!conn->co) {
+                        /* No stack to spare: run the handler on ours, where
+                         * its waits block this worker as they used to. */
+                        _server_current = conn;
+                        net_batch_set(conn->batch);
+                        _server_coro_main(conn);
+                        net_batch_set(NULL);
+                        _server_current = NULL;
+                        _server_done(self, conn);
+                        return;
+                }
+        } else if (s_vars->latency && !conn->t_rx &&
+                   conn->wait_fd == conn->fd &&
+                   (conn->wait_events & POLLIN) && conn->wait_result > 0) {
+                /* The handler waited for the request; it is here now and
+                 * still unread. */
+                _server_rx_stamp(s_vars, conn);
+        }
+
+        _server_current = conn;
+        net_batch_set(conn->batch);
+        done = coro_resume(conn->co);
+        net_batch_set(NULL);
+        _server_current = NULL;
+        if (done) {
+                //SSL_free(ssl);
+                coro_free(conn->co);
+                _server_done(self, conn);
+                return;
+        }
+
+        err = evloop_arm(&self->loop, conn);
+        if (err < 0) {
+                /* Not pollable; let the handler see the error. */
+                conn->wait_result = err;
+                _server_ready(conn, self);
+        }
+}
+
+
+/* Drain is out of time: hand every handler waiting in <b>self</b>'s loop
+ * -ECANCELED, so that it gives up and returns. */
+static void
+_server_cancel(struct _server_worker *self)
+{
+        struct conn *c;
+
+        while ((c = evloop_last(&self->loop)) != NULL) {
+                evloop_detach(&self->loop, c);
+                c->wait_result = -ECANCELED;
+                _server_ready(c, self);
+        }
+}
+
+
+/* <b>conn</b> was moved here from a busier worker: take over its wait. */
+static void
+_server_adopt(struct _server_worker *self, struct conn *conn)
+{
+        int err;
+
+        conn->migrating = 0;
+        err = evloop_arm(&self->loop, conn);
+        if (err < 0) {
+                conn->wait_result = err;
+                _server_ready(conn, self);
+        }
+}
+
+
+/*
+ * End <b>self</b>'s load window at <b>now</b> and publish its load.  If it
+ * is overloaded, move some of the connections suspended in its loop to the
+ * least loaded worker, which takes them over through its inbox.  Those
+ * most recently suspended go first: they are the ones keeping us busy.
+ * Only called between handlers, so none of them is running.
+ */
+static void
+_server_rebalance(struct _server_worker *self, uint64_t now)
+{
+        struct server_engine *engine = self->engine;
+        struct _server_worker *to = NULL;
+        uint64_t span = now + engine->rebalance_ns - self->window_end;
+        unsigned int load, low, i, n, moved;
+        struct conn *c;
+
+        load = span && self->window_end ?
+               (unsigned int) (self->busy_ns * 1000 / span) : 0;
+        if (load > 1000)
+                load = 1000;
+        self->busy_ns = 0;
+        self->window_end = now + engine->rebalance_ns;
+        __atomic_store_n(&self->load, load, __ATOMIC_RELAXED);
+
+        if (load < SERVER_REBALANCE_HIGH || self->loop.nwaiting < 2)
+                return;
+        for (i = 0; i < engine->nworkers; i++) {
+                struct _server_worker *w = &engine->workers[i];
+
+                if (w != self && (!to ||
+                                  __atomic_load_n(&w->load, __ATOMIC_RELAXED) <
+                                  __atomic_load_n(&to->load,
+                                                  __ATOMIC_RELAXED)))
+                        to = w;
+        }
+        if (!to)
+                return;
+        low = __atomic_load_n(&to->load, __ATOMIC_RELAXED);
+        if (load - SERVER_REBALANCE_GAP < low)
+                return;
+
+        /* Even the two out, assuming the connections weigh the same. */
+        n = self->loop.nwaiting * (load - low) / (2 * load);
+        if (n > SERVER_REBALANCE_BATCH)
+                n = SERVER_REBALANCE_BATCH;
+        if (!n)
+                n = 1;
+        for (moved = 0; moved < n && (c = evloop_last(&self->loop));
+             moved++) {
+                evloop_detach(&self->loop, c);
+                c->migrating = 1;
+                sched_handoff(engine->sched, to->id, c);
+        }
+        self->migrated += moved;
+
+        /* Until it measures for itself, so that peers ending their window
+         * meanwhile look elsewhere. */
+        __atomic_add_fetch(&to->load, (load - low) / 2, __ATOMIC_RELAXED);
+        net_debug("Worker %u moved %u connections to worker %u.\n",
+                  self->id, moved, to->id);
+}
+
+
 void *
-_server_tcp_nonblocking_worker(void *vars)
+_server_tcp_nonblocking_worker(void *arg)
 {
         /* Return value is an int that is stored as a (void *). */
         void *ret_val = 0;
-        int client_fd;
-        struct _server_vars *s_vars = (struct _server_vars *) vars;
-        struct ring *rb = s_vars->rb;
-        pthread_mutex_t *mutex_sum = &(s_vars->rb_mutex_sum);
-        pthread_cond_t *not_full = &(s_vars->rb_not_full);
-        pthread_cond_t *not_empty = &(s_vars->rb_not_empty);
+        struct _server_worker *self = (struct _server_worker *) arg;
+        struct server_engine *engine = self->engine;
+        struct conn *conn;
+        unsigned int runs = 0;
+        /* In busy-poll mode, when we last ran something, or 0 while we
+         * do. */
+        uint64_t idle_since = 0;
 
         for(;;) {
-                pthread_mutex_lock(mutex_sum);
-                client_fd = rb_dequeue(rb);
-                while (client_fd == -1) {
-                        /* Try again! */
-                        pthread_cond_wait(not_empty, mutex_sum);
-                        client_fd = rb_dequeue(rb);
+                int timeout_ms = 0, parked = 0;
+
+                if (PREDICT_UNLIKELY(__atomic_load_n(&engine->cancel,
+                                                     __ATOMIC_RELAXED))) {
+                        /* Whatever still waits after the last chance is
+                         * abandoned. */
+                        if (__atomic_load_n(&engine->sched->stopped,
+                                            __ATOMIC_RELAXED))
+                                break;
+                        _server_cancel(self);
+                }
+                conn = self->overflow;
+                if (conn)
+                        self->overflow = conn->next;
+                else
+                        conn = sched_try_next(engine->sched, self->id);
+                /* Nothing suspended here: block (or spin, in busy-poll
+                 * mode) until there is a connection for us, possibly
+                 * stolen from another worker. */
+                if (!conn && !self->loop.nwaiting) {
+                        /* Nothing to give us a load while we sleep. */
+                        __atomic_store_n(&self->load, 0, __ATOMIC_RELAXED);
+                        conn = sched_next(engine->sched, self->id);
+                        /* Drained; see server_engine_drain(). */
+                        if (!conn)
+                                break;
                 }
-                pthread_cond_signal(not_full);
-                pthread_mutex_unlock(mutex_sum);
 
-                // TODO: Do something with the connection.
+                if (conn && conn->migrating) {
+                        _server_adopt(self, conn);
+                        continue;
+                }
+                if (conn)
+                        idle_since = 0;
+                if (conn && engine->rebalance_ns) {
+                        uint64_t start = net_now_ns(), now;
 
-server_nonblocking_worker_err:
-                //SSL_free(ssl);
-                // TODO: Fix EINTR
-                close(client_fd);
+                        _server_run(self, conn);
+                        now = net_now_ns();
+                        self->busy_ns += now - start;
+                        if (now >= self->window_end)
+                                _server_rebalance(self, now);
+                        if (++runs % SERVER_POLL_EVERY)
+                                continue;
+                } else if (conn) {
+                        _server_run(self, conn);
+                        if (++runs % SERVER_POLL_EVERY)
+                                continue;
+                } else if (engine->worker_mode == SERVER_WORKER_BUSY_POLL &&
+                           (!idle_since || net_now_ns() - idle_since <
+                            (uint64_t) engine->busy_idle_usec * 1000)) {
+                        /* Spin on our loop for as long as sched_next()
+                         * would on the queues, then park like the rest. */
+                        if (!idle_since)
+                                idle_since = net_now_ns();
+                } else {
+                        /* Sleep in our loop, where the wake fd brings new
+                         * connections as readily as sockets bring events. */
+                        idle_since = 0;
+                        parked = sched_park(engine->sched, self->id);
+                        if (!parked)
+                                continue;
+                        timeout_ms = evloop_timeout(&self->loop,
+                                                    net_now_ns());
+                }
+
+                if (self->loop.nwaiting) {
+                        evloop_poll(&self->loop, timeout_ms, &_server_ready,
+                                    self);
+                        evloop_sweep(&self->loop, net_now_ns(),
+                                     &_server_ready, self);
+                }
+                if (parked)
+                        sched_unpark(engine->sched, self->id);
         }
 
         return ret_val;
 }
 
 
-int
-_server_tcp_loop(struct _server_vars *s_vars, int sock_fd, int thread_pool_size)
+/*
+ * Start <b>nworkers</b> worker threads, idling as <b>worker_mode</b> (one of
+ * SERVER_WORKER_*) says, for any number of listeners to share; see
+ * server_engine_listen().  <b>busy_idle_usec</b> of 0 picks the default.
+ * @return the engine, or NULL on failure.
+ */
+struct server_engine *
+server_engine_create(unsigned int nworkers, int worker_mode,
+                     unsigned int busy_idle_usec)
 {
-        int i;
+        struct server_engine *engine;
+        unsigned int i;
+
+        if (worker_mode == SERVER_WORKER_BUSY_POLL && !busy_idle_usec)
+                busy_idle_usec = SERVER_BUSY_IDLE_USEC;
 
-        pthread_mutex_t *mutex_sum = &(s_vars->rb_mutex_sum);
-        pthread_cond_t *not_full = &(s_vars->rb_not_full);
-        pthread_cond_t *not_empty = &(s_vars->rb_not_empty);
+        engine = calloc(1, sizeof(*engine));
+        if (!engine)
+                return NULL;
+        engine->worker_mode = worker_mode;
+        engine->busy_idle_usec = busy_idle_usec;
+        engine->nworkers = nworkers;
+        pthread_mutex_init(&engine->lock, NULL);
+        if (pipe(engine->stop_fd) < 0) {
+                fprintf(stderr, "Error creating pipe.\n");
+                goto err;
+        }
+        fcntl(engine->stop_fd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(engine->stop_fd[1], F_SETFD, FD_CLOEXEC);
+        fcntl(engine->stop_fd[1], F_SETFL, O_NONBLOCK);
 
+        engine->sched = sched_create(nworkers, 0,
+                        worker_mode == SERVER_WORKER_BUSY_POLL,
+                        busy_idle_usec);
+        if (!engine->sched) {
+                fprintf(stderr, "Error creating scheduler.\n");
+                goto err_pipe;
+        }
         /**
         * TODO: Use tor's resizable array (container.h) for threads.
         */
-        pthread_t threads[thread_pool_size];
-
-        s_vars->rb = rb_create();
-        if (!s_vars->rb) {
-                fprintf(stderr, "Error creating ring buffer.\n");
-                return -1;
+        engine->workers = calloc(nworkers, sizeof(*engine->workers));
+        if (!engine->workers) {
+                fprintf(stderr, "Error allocating workers.\n");
+                goto err_sched;
         }
-        pthread_mutex_init(mutex_sum, NULL);
+
+        /* Handlers written with net_read()/net_write() yield to their
+         * worker's event loop instead of blocking it. */
+        net_set_wait_hook(&_server_coro_wait);
 
         /* Create a thread pool */
-        for(i = 0; i < thread_pool_size; i++) {
-                int err = pthread_create(&threads[i], NULL,
-                                         &_server_tcp_nonblocking_worker,
-                                         s_vars);
+        for(i = 0; i < nworkers; i++) {
+                struct _server_worker *w = &engine->workers[i];
+                int err;
+
+                w->engine = engine;
+                w->id = i;
+                w->overflow = NULL;
+                err = evloop_init(&w->loop);
+                if (!err)
+                        err = evloop_watch(&w->loop,
+                                           sched_wake_fd(engine->sched, i));
+                if (err < 0) {
+                        fprintf(stderr, "Error creating event loop: %s.\n",
+                                strerror(-err));
+                        evloop_destroy(&w->loop);
+                        goto err_workers;
+                }
+                err = pthread_create(&w->thread, NULL,
+                                     &_server_tcp_nonblocking_worker, w);
                 if (err) {
-                        rb_delete(s_vars->rb);
-                        pthread_mutex_destroy(mutex_sum);
                         fprintf(stderr, "Error creating pthread.\n");
-                        return -1;
+                        evloop_destroy(&w->loop);
+                        goto err_workers;
                 }
         }
+        return engine;
+
+ err_workers:
+        /* Nothing is queued yet: the workers started so far exit as soon
+         * as the scheduler stops. */
+        sched_stop(engine->sched);
+        while (i--) {
+                pthread_join(engine->workers[i].thread, NULL);
+                evloop_destroy(&engine->workers[i].loop);
+        }
+        free(engine->workers);
+ err_sched:
+        sched_delete(engine->sched);
+ err_pipe:
+        close(engine->stop_fd[0]);
+        close(engine->stop_fd[1]);
+ err:
+        pthread_mutex_destroy(&engine->lock);
+        free(engine);
+        return NULL;
+}
+
+
+/* @return whether <b>conn</b>'s client address falls in <b>p</b>. */
+static int
+_server_prefix_match(const struct server_prio_prefix *p,
+                     const struct conn *conn)
+{
+        const unsigned char *a;
+        unsigned int bits = p->bits, n;
+
+        if (conn->addr.ss_family == AF_INET) {
+                if (p->family != AF_INET)
+                        return 0;
+                a = (const unsigned char *)
+                    &((const struct sockaddr_in *) &conn->addr)->sin_addr;
+        } else if (conn->addr.ss_family == AF_INET6) {
+                const struct in6_addr *in6 =
+                        &((const struct sockaddr_in6 *) &conn->addr)->sin6_addr;
+
+                a = in6->s6_addr;
+                /* IPv4 clients of a dual stack listener. */
+                if (p->family == AF_INET && IN6_IS_ADDR_V4MAPPED(in6))
+                        a += 12;
+                else if (p->family != AF_INET6)
+                        return 0;
+        } else {
+                return 0;
+        }
+
+        n = bits / 8;
+        if (n && memcmp(a, p->addr, n) != 0)
+                return 0;
+        bits %= 8;
+        return !bits || ((a[n] ^ p->addr[n]) & (0xff00 >> bits) & 0xff) == 0;
+}
+
+
+/* The scheduling class <b>s_vars</b> puts <b>conn</b> in. */
+static unsigned int
+_server_prio(const struct _server_vars *s_vars, const struct conn *conn)
+{
+        unsigned int i;
+
+        for (i = 0; i < s_vars->nprio_prefixes; i++)
+                if (_server_prefix_match(&s_vars->prio_prefixes[i], conn))
+                        return s_vars->prio_prefixes[i].prio;
+        return s_vars->prio;
+}
+
+
+/* Queue <b>conn</b> for <b>s_vars</b>'s handler on its engine's workers. */
+static void
+_server_submit(struct _server_vars *s_vars, struct conn *conn)
+{
+        conn->srv = s_vars;
+        conn->prio = _server_prio(s_vars, conn);
+        if (s_vars->capture) {
+                conn->capture_id = capture_conn(s_vars->capture);
+                capture_record(s_vars->capture, conn->capture_id,
+                               CAPTURE_OPEN, NULL, 0);
+        }
+
+        /* Every worker is backed up; stop accepting until one catches up
+         * and let the kernel backlog push back. */
+        __atomic_add_fetch(&s_vars->engine->active, 1, __ATOMIC_RELAXED);
+        net_trace(NET_TRACE_ENQUEUE, conn->fd);
+        while (sched_submit(s_vars->sched, conn) < 0)
+                sched_wait_room(s_vars->sched);
+}
+
+
+/*
+ * Route <b>conn</b>, accepted on <b>l</b>, by what its client sent so far,
+ * without reading it.  If that is not enough to tell, park it in the
+ * listener's pending loop until more arrives; <b>final</b> says nothing
+ * more is coming and the fallback should do.
+ */
+static void
+_server_dispatch(struct _server_listener *l, struct conn *conn, int final)
+{
+        struct dispatch *d = l->s_vars->dispatch;
+        char buf[DISPATCH_PEEK_MAX];
+        void *target = NULL;
+        int n, lowat;
+
+        n = (int) recv(conn->fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && !NET_SOCKET_ERRNO_IS_EAGAIN(errno))) {
+                /* Gone before saying anything: no worker needs to know. */
+                evloop_forget(conn);
+                conn_free(conn);
+                return;
+        }
+        if (n < 0)
+                n = 0;
+        if ((size_t) n == sizeof(buf))
+                final = 1;
+
+        if (!dispatch_classify(d, buf, (size_t) n, final, &target)) {
+                /* Have poll wait for more than we have already seen. */
+                lowat = n + 1;
+                setsockopt(conn->fd, SOL_SOCKET, SO_RCVLOWAT, &lowat,
+                           sizeof(lowat));
+                conn->wait_fd = conn->fd;
+                conn->wait_events = POLLIN;
+                if (!conn->wait_deadline)
+                        conn->wait_deadline = net_now_ns() +
+                                (uint64_t) d->timeout_ms * 1000000;
+                if (evloop_arm(&l->pending, conn) == 0)
+                        return;
+                final = 1;
+                dispatch_classify(d, buf, (size_t) n, final, &target);
+        }
+
+        if (conn->wait_deadline) {
+                lowat = 1;
+                setsockopt(conn->fd, SOL_SOCKET, SO_RCVLOWAT, &lowat,
+                           sizeof(lowat));
+                conn->wait_deadline = 0;
+        }
+        _server_submit(target ? (struct _server_vars *) target : l->s_vars,
+                       conn);
+}
+
+
+/* evloop callback: more arrived from a pending client, it left, or it ran
+ * out of time. */
+static void
+_server_dispatch_ready(struct conn *conn, void *arg)
+{
+        _server_dispatch((struct _server_listener *) arg, conn,
+                         conn->wait_result <= 0);
+}
+
+
+/* Wait up to <b>timeout_ms</b> for a new connection on <b>l</b>, routing
+ * pending ones meanwhile. */
+static void
+_server_dispatch_wait(struct _server_listener *l, int timeout_ms)
+{
+        int t = evloop_timeout(&l->pending, net_now_ns());
+
+        if (t < 0 || (timeout_ms >= 0 && timeout_ms < t))
+                t = timeout_ms;
+        evloop_poll(&l->pending, t, &_server_dispatch_ready, l);
+        evloop_sweep(&l->pending, net_now_ns(), &_server_dispatch_ready, l);
+}
+
+
+/*
+ * Have <b>engine</b>'s workers measure their load every
+ * <b>interval_ms</b> and move suspended connections, with their handler's
+ * state and deadline, from overloaded workers to idle ones; 0 stops it.
+ * Long-lived connections otherwise stay with whichever worker last ran
+ * them, and peers only steal their work while idle themselves.
+ */
+void
+server_engine_rebalance(struct server_engine *engine, unsigned int interval_ms)
+{
+        __atomic_store_n(&engine->rebalance_ns,
+                         (uint64_t) interval_ms * 1000000, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Have <b>engine</b>'s workers run up to <b>weight</b> connections of
+ * class <b>prio</b> (one of SCHED_CLASS_*) in a row while those of other
+ * classes wait; the defaults are SCHED_WEIGHT_*.
+ * @return 0, or -EINVAL for no such class or a weight of 0.
+ */
+int
+server_engine_weight(struct server_engine *engine, unsigned int prio,
+                     unsigned int weight)
+{
+        return sched_set_weight(engine->sched, prio, weight);
+}
+
+
+/* Sleep until <b>l</b> has a connection to accept or its engine stops. */
+static void
+_server_accept_wait(struct _server_listener *l)
+{
+        struct pollfd pfd[2];
+
+        pfd[0].fd = l->fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = l->engine->stop_fd[0];
+        pfd[1].events = POLLIN;
+        while (poll(pfd, 2, -1) < 0 && errno == EINTR)
+                ;
+}
+
+
+/* Acceptor thread of one listener: hand its connections to the engine's
+ * workers until accept() fails for good or the engine stops. */
+static void *
+_server_accept_loop(void *arg)
+{
+        struct _server_listener *l = (struct _server_listener *) arg;
+        struct _server_vars *s_vars = l->s_vars;
+        net_socket_fd_t sock_fd = l->fd;
 
         /* Infinite loop for gathering requests */
-        for(;;) {
+        while (!__atomic_load_n(&l->engine->stopping, __ATOMIC_ACQUIRE)) {
                 /* net_socket_fd_t, a macro to an int that is used to hold
                  * socket fds. */
                 net_socket_fd_t client_fd;
 
-                struct sockaddr client_addr;
+                struct sockaddr_storage client_addr;
                 socklen_t addr_size = (socklen_t) sizeof(client_addr);
+                struct conn *conn;
+                uint64_t accepted_ns = 0;
+                int delay_ms;
 
                 /* For printing the connected client's ip address. */
-                char ip[INET_ADDRSTRLEN];
+                char ip[INET6_ADDRSTRLEN];
+
+                /* Buffers are over budget: leave new clients in the
+                 * kernel backlog rather than take on more. */
+                if (mem_pressure(s_vars->membudget)) {
+                        poll(NULL, 0, MEM_PRESSURE_POLL_MS);
+                        continue;
+                }
 
                 // TODO: Place accept handling into a seperate function.
                 /* If the original sock_fd is blocking, then this accept will
                  * block.  Creates a new *nonblocking* socket. */
-                client_fd = net_accept_nonblocking(sock_fd, &client_addr,
-                                                   &addr_size);
+                client_fd = net_accept_nonblocking_tuned(sock_fd,
+                                        (struct sockaddr *) &client_addr,
+                                        &addr_size, &s_vars->sockopts);
                 /* Check for error during accept() */
                 if (!NET_SOCKET_OK(client_fd)) {
-                        int err = net_socket_errno(conn->s);
+                        int err = net_socket_errno(sock_fd);
                         if (NET_SOCKET_ERRNO_IS_ACCEPT_EAGAIN(err)) {
                                 /* They hung up before we could accept();
                                  * that's fine.
                                  * TODO: Give the OOS (out-of-socket) handler
                                  * a chance to run. */
                                 //connection_check_oos(n_open_sockets(), 0);
+
+                                /* The listener is nonblocking: sleep until
+                                 * the next connection unless we were asked
+                                 * to spin for it. */
+                                if (s_vars->dispatch)
+                                        _server_dispatch_wait(l,
+                                                s_vars->worker_mode ==
+                                                SERVER_WORKER_BUSY_POLL ?
+                                                0 : -1);
+                                else if (s_vars->worker_mode ==
+                                         SERVER_WORKER_BUSY_POLL)
+                                        NET_CPU_RELAX();
+                                else
+                                        _server_accept_wait(l);
                                 continue;
                         } else if (NET_SOCKET_ERRNO_IS_RESOURCE_LIMIT(err)) {
                                 /* TODO: Exhaustion; tell the OOS handler. */
                                 //connection_check_oos(n_open_sockets(), 1);
+                                net_event(NET_EVENT_ACCEPT_LIMIT, sock_fd, err,
+                                          NULL, 0);
+                                poll(NULL, 0, SERVER_ACCEPT_LIMIT_MS);
                                 continue;
                         }
                         /* Otherwise there was a real error. */
-                        net_error("accept() failed: %s. Closing server loop.\n",
-                                 net_socket_strerror(err));
+                        net_event(NET_EVENT_ACCEPT_FAILED, sock_fd, err, NULL,
+                                  0);
                         /* TODO: Mark ourselves for close. Have the central
                          * loop check for closed sockets to free.
                          * Use mutexes ... */
@@ -237,88 +1008,735 @@ _server_tcp_loop(struct _server_vars *s_vars, int sock_fd, int thread_pool_size)
                         //connection_check_oos(n_open_sockets(), 0);
                         break;
                 }
-#ifdef _WIN32
-                /* Do not set exclusive on accepted file descriptor.
-                 * TODO: Why does Tor not need to make this exclusive?
-                 * 
-                 * Each exclusive socket must be shutdown.  Failure to do so
-                 * can cause a denial of service attack. 
-                 *
-                 * A socket with SO_EXCLUSIVEADDRUSE set cannot always be
-                 * reused immediately after socket closure. For example, if
-                 * a listening socket with the exclusive flag set accepts a
-                 * connection after which the listening socket is closed,
-                 * another socket cannot bind to the same port as the first
-                 * listening socket with the exclusive flag until the accepted
-                 * connection is no longer active. */
-#else
-                if (net_socket_make_reuseable_unix(client_fd) < 0) {
-                        if (net_socket_errno(client_fd) == EINVAL) {
-                                /* This can happen on OSX if we get a badly
-                                 * timed shutdown. */
-                                net_debug("net_socket_make_reuseable_unix \
-returned EINVAL.\n");
-                        } else {
-                                net_warn("Error setting SO_REUSEADDR flag. \
-%s.\n", net_socket_strerror(errno));
-                        }
-
-                        net_socket_close(client_fd);
-                        // Non-fatal error
-                        continue;
-                }
-#endif 
                 /* TODO: We accepted a new conn; run OOS handler. */
                 //connection_check_oos(get_n_open_sockets(), 0);
+                net_trace(NET_TRACE_ACCEPT, client_fd);
+                /* A route may lead to a server that records latency. */
+                if (s_vars->latency || s_vars->dispatch)
+                        accepted_ns = net_now_ns();
+
+                /* Turn abusive clients away before they take up a worker,
+                 * or a line in the log. */
+                delay_ms = 0;
+                if (s_vars->ratelimit) {
+                        /* A delayed client holds a token of its own, due
+                         * when it is let through. */
+                        if (s_vars->ratelimit_policy ==
+                            SERVER_RATELIMIT_DELAY)
+                                delay_ms = ratelimit_reserve(
+                                        s_vars->ratelimit,
+                                        (struct sockaddr *) &client_addr,
+                                        addr_size,
+                                        SERVER_RATELIMIT_MAX_DELAY_MS);
+                        else
+                                delay_ms = ratelimit_take(s_vars->ratelimit,
+                                        (struct sockaddr *) &client_addr,
+                                        addr_size) ? -1 : 0;
+                        if (delay_ms < 0) {
+                                net_event_addr(NET_EVENT_RATELIMITED,
+                                        client_fd, 0,
+                                        (struct sockaddr *) &client_addr);
+                                net_socket_close(client_fd);
+                                continue;
+                        }
+                }
 
                 /* Print the client's ip */
-                inet_ntop(AF_INET,
-                          &((struct sockaddr_in *) &client_addr)->sin_addr,
-                          ip, INET_ADDRSTRLEN);
+                if (client_addr.ss_family == AF_INET)
+                        inet_ntop(AF_INET, &((struct sockaddr_in *)
+                                             &client_addr)->sin_addr,
+                                  ip, sizeof(ip));
+                else if (client_addr.ss_family == AF_INET6)
+                        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)
+                                              &client_addr)->sin6_addr,
+                                  ip, sizeof(ip));
+                else
+                        snprintf(ip, sizeof(ip), "a local socket");
                 net_print("Accepted connection from %s.\n", ip);
 
-                pthread_mutex_lock(mutex_sum);
+                conn = conn_new(client_fd, (struct sockaddr *) &client_addr,
+                                addr_size);
+                if (!conn) {
+                        net_event(NET_EVENT_CONN_NOMEM, client_fd, ENOMEM,
+                                  NULL, 0);
+                        net_socket_close(client_fd);
+                        continue;
+                }
+                conn->delay_ms = (unsigned int) delay_ms;
+                conn->t_accept = accepted_ns;
+                if (s_vars->dispatch)
+                        _server_dispatch(l, conn, 0);
+                else
+                        _server_submit(s_vars, conn);
+        }
 
-                while(rb_enqueue(s_vars->rb, client_fd) != -1)
-                        pthread_cond_wait(not_full, mutex_sum);
+        /* Whoever is still making up their mind goes where it points now;
+         * the successor, if any, takes new clients. */
+        if (s_vars->dispatch) {
+                struct conn *c;
 
-                pthread_cond_signal(not_empty);
-                pthread_mutex_unlock(mutex_sum);
+                while ((c = evloop_last(&l->pending)) != NULL) {
+                        evloop_detach(&l->pending, c);
+                        _server_dispatch(l, c, 1);
+                }
         }
-        // TODO: Add an exit case and free threads
+        return NULL;
+}
 
-        rb_delete(s_vars->rb);
-        pthread_mutex_destroy(mutex_sum);
 
+/*
+ * Let <b>engine</b>'s workers run <b>s_vars</b>'s handler, for connections
+ * a listener's dispatcher routes there; listeners do it themselves.
+ * @return 0, or -1 on failure.
+ */
+int
+server_engine_attach(struct server_engine *engine,
+                     struct _server_vars *s_vars)
+{
+        s_vars->engine = engine;
+        s_vars->sched = engine->sched;
+        /* One set per worker, so recording never contends. */
+        if (s_vars->latency && !s_vars->latency_hists) {
+                s_vars->latency_hists = calloc((size_t) engine->nworkers *
+                                               SERVER_STAGES,
+                                               sizeof(struct hist));
+                if (!s_vars->latency_hists) {
+                        fprintf(stderr, "Error allocating histograms.\n");
+                        return -1;
+                }
+                s_vars->nworkers = engine->nworkers;
+        }
+        if (s_vars->capture)
+                net_set_read_hook(&_server_capture_read);
         return 0;
 }
 
 
+/*
+ * Serve connections accepted on the listening socket <b>sock_fd</b> with
+ * <b>s_vars</b>'s handler and settings, on <b>engine</b>'s workers.  A
+ * thread of its own accepts for it.  <b>s_vars</b> and the socket must
+ * stay around while the engine runs; server_engine_wait() closes the
+ * socket once its acceptor gives up.  With a dispatcher, every target must
+ * have been attached to an engine first.  The socket may be one inherited
+ * with server_takeover() or net_listen_fds().
+ * @return 0, or -1 on failure, in which case the socket is still the
+ *      caller's to close.
+ */
 int
-server_start(char *server_port)
+server_engine_listen_fd(struct server_engine *engine,
+                        struct _server_vars *s_vars, net_socket_fd_t sock_fd)
 {
-        int sock_fd;
-        /* The initial size of the thread pool (TODO: Resizeable pool) */
-        int thread_pool_size = 64;
+        struct _server_listener *l;
+        int attached = s_vars->engine == engine;
+        int had_hists = s_vars->latency_hists != NULL;
         int err;
 
-        struct _server_vars s_vars;
-        // IMPORTANT: Populate s_vars
-        // Create local scoped variables for addrinfo etc...
+        l = calloc(1, sizeof(*l));
+        if (!l)
+                return -1;
+        l->engine = engine;
+        l->s_vars = s_vars;
+        l->fd = sock_fd;
+        /* Inherited sockets may come blocking. */
+        fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+        l->pending.epfd = -1;
+
+        if (server_engine_attach(engine, s_vars) < 0)
+                goto err;
+        if (s_vars->dispatch) {
+                err = evloop_init(&l->pending);
+                if (!err)
+                        err = evloop_watch(&l->pending, sock_fd);
+                if (!err)
+                        err = evloop_watch(&l->pending, engine->stop_fd[0]);
+                if (err < 0) {
+                        fprintf(stderr, "Error creating event loop: %s.\n",
+                                strerror(-err));
+                        goto err;
+                }
+        }
+
+        pthread_mutex_lock(&engine->lock);
+#ifdef NET_TRACING
+        if (!engine->traced &&
+            net_trace_start_dumper(s_vars->trace_dir ? s_vars->trace_dir
+                                                     : ".") < 0)
+                net_warn("Couldn't set up trace dumps.\n");
+        engine->traced = 1;
+#endif
+        if (pthread_create(&l->thread, NULL, &_server_accept_loop, l)) {
+                pthread_mutex_unlock(&engine->lock);
+                fprintf(stderr, "Error creating pthread.\n");
+                goto err;
+        }
+        l->next = engine->listeners;
+        engine->listeners = l;
+        pthread_mutex_unlock(&engine->lock);
+        return 0;
+
+ err:
+        /* Undo server_engine_attach(), unless it was done before us.  The
+         * capture read hook stays; it ignores connections that are not
+         * captured. */
+        if (!had_hists) {
+                free(s_vars->latency_hists);
+                s_vars->latency_hists = NULL;
+                s_vars->nworkers = 0;
+        }
+        if (!attached) {
+                s_vars->engine = NULL;
+                s_vars->sched = NULL;
+        }
+        evloop_destroy(&l->pending);
+        free(l);
+        return -1;
+}
+
 
-        /* Create a listening tcp/ip socket. */
-        sock_fd = _server_tcp_init(server_port);
+/*
+ * As server_engine_listen_fd(), on a new TCP listener on
+ * <b>server_port</b> tuned with <b>s_vars</b>'s socket options.
+ * @return 0, or -1 on failure.
+ */
+int
+server_engine_listen(struct server_engine *engine,
+                     struct _server_vars *s_vars, char *server_port)
+{
+        net_socket_fd_t sock_fd;
+
+        sock_fd = _server_tcp_init(server_port, &s_vars->sockopts);
+        if ( !NET_SOCKET_OK(sock_fd) )
+                return -1;
+        if (server_engine_listen_fd(engine, s_vars, sock_fd) < 0) {
+                net_socket_close(sock_fd);
+                return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * As server_engine_listen_fd(), on a new AF_UNIX listener of <b>type</b>
+ * (SOCK_STREAM or SOCK_SEQPACKET) at <b>path</b>, "@name" for the abstract
+ * namespace.  Same-host clients skip the TCP/IP stack altogether.
+ * @return 0, or -1 on failure.
+ */
+int
+server_engine_listen_unix(struct server_engine *engine,
+                          struct _server_vars *s_vars, const char *path,
+                          int type)
+{
+        net_socket_fd_t sock_fd;
+
+        sock_fd = net_unix_listen(path, type, s_vars->passcred,
+                                  &s_vars->sockopts);
         if ( !NET_SOCKET_OK(sock_fd) ) {
-                freeaddrinfo(server);
+                net_error("Error listening on %s: %s.\n", path,
+                          strerror(errno));
                 return -1;
         }
+        if (server_engine_listen_fd(engine, s_vars, sock_fd) < 0) {
+                net_socket_close(sock_fd);
+                return -1;
+        }
+        return 0;
+}
+
+
+/*
+ * Block until every listener of <b>engine</b> has stopped accepting, and
+ * close their sockets.  @return 0.
+ */
+int
+server_engine_wait(struct server_engine *engine)
+{
+        struct _server_listener *l, **pp;
+
+        for (;;) {
+                pthread_mutex_lock(&engine->lock);
+                l = engine->listeners;
+                pthread_mutex_unlock(&engine->lock);
+                if (!l)
+                        break;
+                pthread_join(l->thread, NULL);
+
+                /* Listed until it stops, for server_engine_handover(). */
+                pthread_mutex_lock(&engine->lock);
+                for (pp = &engine->listeners; *pp != l; pp = &(*pp)->next)
+                        ;
+                *pp = l->next;
+                pthread_mutex_unlock(&engine->lock);
+                net_socket_close(l->fd);
+                evloop_destroy(&l->pending);
+                free(l);
+        }
+        return 0;
+}
+
+
+/*
+ * Have <b>engine</b>'s acceptors stop accepting and return; connections
+ * already accepted carry on.  Async-signal-safe, so that a SIGTERM handler
+ * may call it.
+ */
+void
+server_engine_stop(struct server_engine *engine)
+{
+        char c = 0;
+        ssize_t r;
+
+        __atomic_store_n(&engine->stopping, 1, __ATOMIC_RELEASE);
+        /* Never read: it stays readable for every acceptor to see. */
+        r = write(engine->stop_fd[1], &c, 1);
+        (void) r;
+}
+
+
+/* Wait until <b>engine</b> has no connection left, or <b>deadline</b>
+ * (CLOCK_MONOTONIC ns) passes.  @return how many are left. */
+static unsigned int
+_server_engine_settle(struct server_engine *engine, uint64_t deadline)
+{
+        unsigned int active;
+
+        while ((active = __atomic_load_n(&engine->active,
+                                         __ATOMIC_ACQUIRE)) != 0 &&
+               net_now_ns() < deadline) {
+                /* Workers asleep in their loop only look at the cancel
+                 * flag once woken. */
+                if (__atomic_load_n(&engine->cancel, __ATOMIC_RELAXED))
+                        sched_wake_all(engine->sched);
+                poll(NULL, 0, SERVER_DRAIN_POLL_MS);
+        }
+        return active;
+}
+
+
+/*
+ * Shut <b>engine</b> down gracefully: stop accepting, give the connections
+ * in flight up to <b>timeout_ms</b> to finish, then cancel the waits of
+ * those that have not and give them SERVER_CANCEL_MS more to wind up.
+ * Then the workers exit and everything is freed, listeners closed, the
+ * engine included.  Its servers' settings stay with their owner.
+ * @return the number of connections abandoned, hopefully 0.
+ */
+int
+server_engine_drain(struct server_engine *engine, int timeout_ms)
+{
+        unsigned int left, i;
+
+        server_engine_stop(engine);
+        server_engine_wait(engine);
+
+        left = _server_engine_settle(engine, net_now_ns() +
+                                     (uint64_t) timeout_ms * 1000000);
+        if (left) {
+                net_warn("Cancelling %u connections still open.\n", left);
+                __atomic_store_n(&engine->cancel, 1, __ATOMIC_RELAXED);
+                left = _server_engine_settle(engine, net_now_ns() +
+                                (uint64_t) SERVER_CANCEL_MS * 1000000);
+                if (left)
+                        net_warn("Abandoning %u connections.\n", left);
+        }
+
+        sched_stop(engine->sched);
+        for (i = 0; i < engine->nworkers; i++)
+                pthread_join(engine->workers[i].thread, NULL);
+        /* Whatever is left waits in a loop or sits in a queue; close it,
+         * so that its client sees the connection end. */
+        for (i = 0; i < engine->nworkers; i++) {
+                struct evloop *loop = &engine->workers[i].loop;
+                struct conn *c;
+
+                while ((c = evloop_last(loop)) != NULL) {
+                        evloop_detach(loop, c);
+                        _server_abandon(engine, c);
+                }
+                evloop_destroy(loop);
+                while ((c = sched_try_next(engine->sched, i)) != NULL)
+                        _server_abandon(engine, c);
+        }
+        sched_delete(engine->sched);
+        close(engine->stop_fd[0]);
+        close(engine->stop_fd[1]);
+        pthread_mutex_destroy(&engine->lock);
+        free(engine->workers);
+        free(engine);
+        return (int) left;
+}
+
+
+/*
+ * Wait on <b>path</b> (an AF_UNIX path, "@name" for an abstract one) for
+ * the process taking over from us, see server_takeover(), and pass it
+ * every listener of <b>engine</b>, in the order they were added.  Once it
+ * confirms, stop accepting: from then on new clients queue up for the
+ * successor on the very same sockets, so none is refused, and a
+ * server_engine_drain() can see our own clients out.  Returns early, with
+ * -1, if the engine stops meanwhile.
+ * @return 0 once handed over, -1 on failure.
+ */
+int
+server_engine_handover(struct server_engine *engine, const char *path)
+{
+        struct _server_listener *l;
+        int fds[NET_MAX_PASS_FDS];
+        unsigned int n = 0, i;
+        net_socket_fd_t lsock, sock = NET_INVALID_SOCKET;
+        struct pollfd pfd[2];
+        char ack;
+        int err;
+
+        lsock = net_unix_listen(path, SOCK_STREAM, 0, NULL);
+        if (!NET_SOCKET_OK(lsock)) {
+                net_error("Error listening on %s: %s.\n", path,
+                          strerror(errno));
+                return -1;
+        }
+        pfd[0].fd = lsock;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = engine->stop_fd[0];
+        pfd[1].events = POLLIN;
+        for (;;) {
+                if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+                        break;
+                if (pfd[1].revents) {
+                        net_socket_close(lsock);
+                        return -1;
+                }
+                sock = net_accept_nonblocking(lsock, NULL, NULL);
+                if (NET_SOCKET_OK(sock))
+                        break;
+        }
+        /* One successor at a time, and the path is free for it to listen
+         * on for its own. */
+        net_socket_close(lsock);
+        if (!NET_SOCKET_OK(sock))
+                return -1;
+
+        pthread_mutex_lock(&engine->lock);
+        for (l = engine->listeners; l && n < NET_MAX_PASS_FDS; l = l->next)
+                n++;
+        i = n;
+        for (l = engine->listeners; l && i; l = l->next)
+                fds[--i] = l->fd;
+        pthread_mutex_unlock(&engine->lock);
+
+        err = n ? net_send_fds(sock, fds, n) : -ENOENT;
+        if (err == 0) {
+                err = net_wait(sock, POLLIN, SERVER_HANDOVER_MS);
+                if (err > 0)
+                        err = net_read(sock, &ack, 1) == 1 ? 0 : -EPIPE;
+                else if (err == 0)
+                        err = -ETIMEDOUT;
+        }
+        net_socket_close(sock);
+        if (err < 0) {
+                net_warn("Handover failed: %s; still serving.\n",
+                         strerror(-err));
+                return -1;
+        }
+
+        net_print("Handed %u listeners over to our successor.\n", n);
+        server_engine_stop(engine);
+        return 0;
+}
+
+
+/*
+ * Take over the listeners of the process serving at <b>path</b>, see
+ * server_engine_handover(), storing up to <b>max</b> of them in
+ * <b>fds</b>.  The old process stops accepting as soon as we return, so
+ * listen on them at once.
+ * @return how many were stored, or -1 if nobody handed any over.
+ */
+int
+server_takeover(const char *path, int *fds, unsigned int max)
+{
+        net_socket_fd_t sock;
+        char ack = 1;
+        int n;
+
+        sock = net_unix_connect(path, SOCK_STREAM, NULL);
+        if (!NET_SOCKET_OK(sock))
+                return -1;
+        n = net_recv_fds(sock, fds, max);
+        if (n > 0 && net_write(sock, &ack, 1) < 0) {
+                while (n > 0)
+                        net_socket_close(fds[--n]);
+                n = -1;
+        }
+        net_socket_close(sock);
+        return n > 0 ? n : -1;
+}
+
+
+/*
+ * Log percentiles of each latency stage over all workers' histograms, in
+ * microseconds.  Safe to call while the server runs.
+ */
+void
+server_latency_report(struct _server_vars *s_vars)
+{
+        static const char *const names[SERVER_STAGES] = {
+                "kernel", "queue", "request", "handler", "total"
+        };
+        struct hist *sum;
+        unsigned int stage, i;
+
+        if (!s_vars->latency_hists)
+                return;
+        sum = malloc(sizeof(*sum));
+        if (!sum)
+                return;
+
+        for (stage = 0; stage < SERVER_STAGES; stage++) {
+                memset(sum, 0, sizeof(*sum));
+                for (i = 0; i < s_vars->nworkers; i++)
+                        hist_merge(sum, &s_vars->latency_hists[i *
+                                                SERVER_STAGES + stage]);
+                net_print("%-8s %10llu  p50 %8llu  p90 %8llu  p99 %8llu  "
+                          "p99.9 %8llu  max %8llu us\n", names[stage],
+                          (unsigned long long) sum->count,
+                          (unsigned long long) hist_quantile(sum, 0.5) / 1000,
+                          (unsigned long long) hist_quantile(sum, 0.9) / 1000,
+                          (unsigned long long) hist_quantile(sum, 0.99) / 1000,
+                          (unsigned long long) hist_quantile(sum, 0.999) /
+                                               1000,
+                          (unsigned long long) sum->max / 1000);
+        }
+        free(sum);
+}
+
+
+/* Hand our listener over to each new instance that asks, one at a time,
+ * until one takes it or the engine stops. */
+static void *
+_server_handover_main(void *arg)
+{
+        struct _server_vars *s_vars = (struct _server_vars *) arg;
+        struct server_engine *engine = s_vars->engine;
+
+        while (server_engine_handover(engine, s_vars->upgrade_path) < 0 &&
+               !__atomic_load_n(&engine->stopping, __ATOMIC_ACQUIRE))
+                sleep(1);
+        return NULL;
+}
+
+
+/*
+ * Listen on <b>server_port</b> and serve connections with the handler
+ * configured in <b>s_vars</b>.  Blocks for the lifetime of the server.
+ * @return 0 once the server loop exits, -1 on failure.
+ */
+int
+server_run(struct _server_vars *s_vars, char *server_port)
+{
+        struct server_engine *engine;
+        /* The initial size of the thread pool (TODO: Resizeable pool) */
+        unsigned int thread_pool_size = SERVER_DEFAULT_WORKERS;
+        pthread_t handover;
+        int fd, inherited = 0, err;
+
+        if (s_vars->event_log) {
+                err = net_event_open(s_vars->event_log, 0);
+                if (err < 0)
+                        net_warn("Couldn't open event log %s: %s.\n",
+                                 s_vars->event_log, strerror(-err));
+        }
+
+        /* The instance we replace, or a supervisor, may hand us a listener
+         * with its backlog, rather than have us start cold. */
+        if (s_vars->upgrade_path &&
+            server_takeover(s_vars->upgrade_path, &fd, 1) == 1) {
+                net_print("Took over the listener of the previous "
+                          "instance.\n");
+                inherited = 1;
+        } else if (net_listen_fds(&fd, 1) == 1) {
+                inherited = 1;
+        }
+
+        engine = server_engine_create(thread_pool_size, s_vars->worker_mode,
+                                      s_vars->busy_idle_usec);
+        if (!engine) {
+                if (inherited)
+                        net_socket_close(fd);
+                net_event_close();
+                return -1;
+        }
+        if (inherited) {
+                err = server_engine_listen_fd(engine, s_vars, fd);
+                if (err < 0)
+                        net_socket_close(fd);
+        } else {
+                err = server_engine_listen(engine, s_vars, server_port);
+        }
+        if (err < 0)
+                goto out;
+
+        if (s_vars->upgrade_path &&
+            pthread_create(&handover, NULL, &_server_handover_main, s_vars)) {
+                fprintf(stderr, "Error creating pthread.\n");
+                err = -1;
+                goto out;
+        }
+
+        /* Until handed over, or accept() fails for good. */
+        server_engine_wait(engine);
+        server_engine_stop(engine);
+        if (s_vars->upgrade_path)
+                pthread_join(handover, NULL);
+        err = 0;
+ out:
+        /* On failure nobody has been served yet: no need to wait. */
+        server_engine_drain(engine, err < 0 ? 0 : SERVER_DRAIN_MS);
+        net_event_close();
+        return err < 0 ? -1 : 0;
+}
+
+
+int
+server_start(char *server_port)
+{
+        struct _server_vars s_vars;
 
         /* Zero out our variables */
         memset(&s_vars, 0, sizeof(struct _server_vars));
 
-        /* Run server using the */
-        err = _server_tcp_loop(&s_vars, sock_fd, thread_pool_size);
+        return server_run(&s_vars, server_port);
+}
+
+
+/*
+ * As server_start(), but for latency critical deployments: workers and the
+ * acceptor spin instead of sleeping, and sockets busy-poll the device.
+ */
+int
+server_start_busy_poll(char *server_port, unsigned int busy_idle_usec)
+{
+        struct _server_vars s_vars;
+        struct net_sockopt_profile prof = NET_SOCKOPT_PROFILE_BUSY_POLL;
+
+        memset(&s_vars, 0, sizeof(struct _server_vars));
+        s_vars.sockopts = prof;
+        s_vars.worker_mode = SERVER_WORKER_BUSY_POLL;
+        s_vars.busy_idle_usec = busy_idle_usec;
+
+        return server_run(&s_vars, server_port);
+}
+
+
+/*
+ * As server_start(), but answer every request with a file from
+ * <b>docroot</b>.
+ */
+int
+server_start_files(char *server_port, const char *docroot)
+{
+        struct _server_vars s_vars;
+        struct fs_cache *cache;
+        int err;
+
+        cache = fs_cache_create(docroot, 0, 0, 0);
+        if (!cache)
+                return -1;
+
+        memset(&s_vars, 0, sizeof(struct _server_vars));
+        s_vars.handler = &fileserve_handler;
+        s_vars.handler_arg = cache;
+
+        err = server_run(&s_vars, server_port);
+
+        fs_cache_delete(cache);
+        return err;
+}
+
+
+/*
+ * As server_start(), but speak HTTP/1.1, answering every request with the
+ * contents of <b>body_file</b>, or HTTP_DEFAULT_BODY if it is NULL, over
+ * connections kept alive; for comparing throughput with other servers.
+ */
+int
+server_start_http(char *server_port, const char *body_file)
+{
+        struct _server_vars s_vars;
+        struct net_sockopt_profile low_latency =
+                NET_SOCKOPT_PROFILE_LOW_LATENCY;
+        struct http_responder *r;
+        int err;
+
+        r = body_file ? http_responder_create_file(body_file, NULL) :
+                        http_responder_create(NULL, 0, NULL);
+        if (!r)
+                return -1;
+
+        memset(&s_vars, 0, sizeof(struct _server_vars));
+        s_vars.handler = &http_handler;
+        s_vars.handler_arg = r;
+        s_vars.sockopts = low_latency;
+
+        err = server_run(&s_vars, server_port);
+
+        net_print("Served %lu requests.\n", r->requests);
+        http_responder_delete(r);
+        return err;
+}
 
-        close(sock_fd);
+
+/*
+ * Run as a reverse proxy, spreading requests over the <b>nupstreams</b>
+ * "host:port[/weight]" strings in <b>upstreams</b> with <b>policy</b>
+ * (one of BAL_*).
+ */
+int
+server_start_proxy(char *server_port, const char *const *upstreams,
+                   unsigned int nupstreams, int policy)
+{
+        struct _server_vars s_vars;
+        struct net_sockopt_profile low_latency =
+                NET_SOCKOPT_PROFILE_LOW_LATENCY;
+        struct proxy px;
+        struct healthcheck *hc;
+        int err = -1;
+
+        memset(&px, 0, sizeof(px));
+        px.bal = balancer_create(policy, upstreams, nupstreams);
+        if (!px.bal)
+                return -1;
+        px.membudget = mem_budget_create(0, 0);
+        if (!px.membudget)
+                goto out;
+        /* Keep dead and slow upstreams off the hot path. */
+        hc = healthcheck_start(px.bal, 0, 0);
+        if (!hc)
+                net_warn("Health checks are off; upstreams stay in use "
+                         "whatever their state.\n");
+        px.sockopts = low_latency;
+        /* Repeats need not go upstream at all. */
+        px.cache = resp_cache_create(0, 0, 0);
+        if (!px.cache)
+                net_warn("Response cache is off.\n");
+
+        memset(&s_vars, 0, sizeof(struct _server_vars));
+        s_vars.handler = &proxy_handler;
+        s_vars.handler_arg = &px;
+        s_vars.membudget = px.membudget;
+
+        err = server_run(&s_vars, server_port);
+
+        if (hc)
+                healthcheck_stop(hc);
+        if (px.cache) {
+                net_print("Response cache: %lu hits, %lu misses, %lu "
+                          "waited for another's fill, %lu evicted.\n",
+                          px.cache->hits, px.cache->misses,
+                          px.cache->coalesced, px.cache->evictions);
+                resp_cache_delete(px.cache);
+        }
+        mem_budget_delete(px.membudget);
+ out:
+        balancer_delete(px.bal);
         return err;
 }
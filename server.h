@@ -1,12 +1,169 @@
+/* Workers sleep until a connection is queued for them. */
+#define SERVER_WORKER_BLOCKING 0
+/* Workers spin on their queues, trading CPU for wake-up latency, and only
+ * park after busy_idle_usec without work. */
+#define SERVER_WORKER_BUSY_POLL 1
+
+#define SERVER_BUSY_IDLE_USEC 200
+/* Workers server_run() starts. */
+#define SERVER_DEFAULT_WORKERS 64
+/* How long server_run() lets clients finish once it stops accepting. */
+#define SERVER_DRAIN_MS 30000
+
+/* What the acceptor does with a client over its rate limit. */
+#define SERVER_RATELIMIT_REJECT 0
+#define SERVER_RATELIMIT_DELAY 1
+/* Clients that would have to wait longer than this are rejected anyway. */
+#define SERVER_RATELIMIT_MAX_DELAY_MS 1000
+
+/* Latency stages recorded per connection; see server_latency_report().
+ * KERNEL: first request byte stamped by the kernel until accept() returned,
+ * the time spent in the backlog (needs sockopts.timestamping).
+ * QUEUE: accept() until a worker started the handler.
+ * REQUEST: handler start until the first byte arrived, if it was late.
+ * HANDLER: the rest of the handler, suspended waits included.
+ * TOTAL: first byte or accept(), whichever came first, until done. */
+#define SERVER_STAGE_KERNEL 0
+#define SERVER_STAGE_QUEUE 1
+#define SERVER_STAGE_REQUEST 2
+#define SERVER_STAGE_HANDLER 3
+#define SERVER_STAGE_TOTAL 4
+#define SERVER_STAGES 5
+
+/* Clients whose address starts with the first <b>bits</b> of <b>addr</b>
+ * (4 bytes for AF_INET, 16 for AF_INET6) go in class <b>prio</b>. */
+struct server_prio_prefix {
+        int family;
+        unsigned char addr[16];
+        unsigned int bits;
+        unsigned int prio;
+};
+
 /* These attributes are local to the server.  I have placed them into a struct,
- * to allow multiple instances of a server in one process. */
+ * to allow multiple instances of a server in one process: each listener
+ * added to a server_engine has its own, while they share the workers. */
 struct _server_vars {
-        struct ring *rb;
-        pthread_mutex_t rb_mutex_sum;
-        pthread_cond_t rb_not_full;
-        pthread_cond_t rb_not_empty;
+        /* Engine whose workers run this server's handlers, and its
+         * scheduler; set by server_engine_listen(). */
+        struct server_engine *engine;
+        struct sched *sched;
+
+        /* How idle workers wait for connections; one of SERVER_WORKER_*.
+         * server_run() starts its engine so; the acceptor spins in
+         * busy-poll mode whatever the engine does. */
+        int worker_mode;
+        /* In busy-poll mode, the longest a worker spins without finding
+         * work before it parks, in microseconds. */
+        unsigned int busy_idle_usec;
+
+        /* Called by a worker for each accepted connection; the worker
+         * closes the socket once it returns.  NULL just closes it. */
+        int (*handler)(void *handler_arg, int client_fd);
+        void *handler_arg;
+
+        /* Socket tuning for the listener and accepted connections. */
+        struct net_sockopt_profile sockopts;
+        /* Collect the small writes a handler makes to its client between
+         * waits and send them together, once the batch is big or old
+         * enough for the client's RTT or the handler waits or returns. */
+        int coalesce;
+        /* With coalesce, writes of at least zerocopy_threshold bytes (0
+         * for NET_ZC_DEFAULT_THRESHOLD) go out with MSG_ZEROCOPY from
+         * buffers of this pool rather than copied by the kernel; NULL
+         * always copies.  See net_batch_zerocopy(). */
+        struct net_zc_pool *zerocopy;
+        size_t zerocopy_threshold;
+        /* On AF_UNIX listeners, have the kernel attach the sender's
+         * credentials to what handlers read with net_unix_recv_cred(). */
+        int passcred;
+
+        /* Scheduling class of this server's connections, one of
+         * SCHED_CLASS_*; servers on one engine share its workers by the
+         * weights of their classes (see server_engine_weight()).  The
+         * first of the prio_prefixes matching a client's address, if
+         * any, overrides it.  To class clients by the first bytes they
+         * send, dispatch them to servers of different classes on the
+         * same engine. */
+        unsigned int prio;
+        const struct server_prio_prefix *prio_prefixes;
+        unsigned int nprio_prefixes;
+
+        /* Per-client connection rate limit, checked right after accept;
+         * NULL for none.  ratelimit_policy is one of SERVER_RATELIMIT_*. */
+        struct ratelimit *ratelimit;
+        int ratelimit_policy;
+
+        /* Budget that handlers charge their buffers to; NULL for none.
+         * Under pressure the acceptor stops accepting. */
+        struct mem_budget *membudget;
+
+        /* Record per-stage latency histograms, SERVER_STAGES for each of
+         * nworkers workers.  Set latency before server_run(); the server
+         * fills in the rest. */
+        int latency;
+        struct hist *latency_hists;
+        unsigned int nworkers;
+
+        /* Record what every client sends, with timing, for replay; NULL
+         * for none.  See capture.h. */
+        struct capture *capture;
+
+        /* Route each connection by the first bytes its client sends, to
+         * another server attached to this or another engine (a worker
+         * group of its own, or a proxy to some upstream) or, failing a
+         * match, to this one; NULL to skip.  Pair it with
+         * sockopts.defer_accept, so that most clients have sent those
+         * bytes by the time they are accepted.  See dispatch.h. */
+        struct dispatch *dispatch;
+
+        /* Where server_run() hands its listener to the next instance
+         * started with the same path, before draining and returning, and
+         * takes it over from the previous one; NULL for neither.  An
+         * AF_UNIX path, "@name" for an abstract one.  Without one,
+         * server_run() still uses a listener passed systemd style. */
+        const char *upgrade_path;
+
+        /* File server_run() keeps the binary event log of failures in
+         * (see net/net_event.h and evlog); NULL to only summarize them on
+         * stderr. */
+        const char *event_log;
+
+        /* Where NET_TRACE_SIGNAL dumps the hot path trace, in builds with
+         * NET_TRACING; NULL for the working directory. */
+        const char *trace_dir;
 
         /* The least significant bit marks the run boolean. */
         unsigned int flags;
 };
 
+
+struct server_engine *server_engine_create(unsigned int nworkers,
+                                           int worker_mode,
+                                           unsigned int busy_idle_usec);
+void server_engine_rebalance(struct server_engine *engine,
+                            unsigned int interval_ms);
+int server_engine_weight(struct server_engine *engine, unsigned int prio,
+                         unsigned int weight);
+int server_engine_attach(struct server_engine *engine,
+                         struct _server_vars *s_vars);
+int server_engine_listen(struct server_engine *engine,
+                         struct _server_vars *s_vars, char *server_port);
+int server_engine_listen_unix(struct server_engine *engine,
+                              struct _server_vars *s_vars, const char *path,
+                              int type);
+int server_engine_listen_fd(struct server_engine *engine,
+                            struct _server_vars *s_vars, int sock_fd);
+int server_engine_wait(struct server_engine *engine);
+void server_engine_stop(struct server_engine *engine);
+int server_engine_drain(struct server_engine *engine, int timeout_ms);
+int server_engine_handover(struct server_engine *engine, const char *path);
+int server_takeover(const char *path, int *fds, unsigned int max);
+
+int server_run(struct _server_vars *s_vars, char *server_port);
+int server_start(char *server_port);
+int server_start_busy_poll(char *server_port, unsigned int busy_idle_usec);
+int server_start_files(char *server_port, const char *docroot);
+int server_start_http(char *server_port, const char *body_file);
+void server_latency_report(struct _server_vars *s_vars);
+int server_start_proxy(char *server_port, const char *const *upstreams,
+                       unsigned int nupstreams, int policy);
@@ -0,0 +1,233 @@
+/* Tests for the TLS ClientHello parsing in dispatch.c. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../dispatch.h"
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__,        \
+                                __LINE__, #cond);                       \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+
+static void
+_put16(char *p, size_t v)
+{
+        p[0] = (char) (v >> 8);
+        p[1] = (char) v;
+}
+
+
+/*
+ * Build a ClientHello in <b>buf</b> asking for <b>host</b>, or without a
+ * server_name extension if it is NULL, after an ALPN extension so that
+ * the parser has something to skip.
+ * @return its length.
+ */
+static size_t
+_hello(char *buf, const char *host)
+{
+        static const char alpn[] = "\x00\x10\x00\x05\x00\x03\x02h2";
+        size_t p = 0, hs, ext, hlen = host ? strlen(host) : 0;
+
+        /* Record header; its length is filled in last. */
+        buf[p++] = 0x16;
+        buf[p++] = 0x03;
+        buf[p++] = 0x01;
+        p += 2;
+
+        /* Handshake header, version, random. */
+        hs = p;
+        buf[p++] = 0x01;
+        p += 3;
+        buf[p++] = 0x03;
+        buf[p++] = 0x03;
+        memset(buf + p, 0xab, 32);
+        p += 32;
+
+        /* A 32 byte session id, two suites, null compression. */
+        buf[p++] = 32;
+        memset(buf + p, 0xcd, 32);
+        p += 32;
+        _put16(buf + p, 4);
+        memcpy(buf + p + 2, "\x13\x01\x13\x02", 4);
+        p += 6;
+        buf[p++] = 1;
+        buf[p++] = 0;
+
+        ext = p;
+        p += 2;
+        memcpy(buf + p, alpn, sizeof(alpn) - 1);
+        p += sizeof(alpn) - 1;
+        if (host) {
+                _put16(buf + p, 0);
+                _put16(buf + p + 2, hlen + 5);
+                _put16(buf + p + 4, hlen + 3);
+                buf[p + 6] = 0;
+                _put16(buf + p + 7, hlen);
+                memcpy(buf + p + 9, host, hlen);
+                p += 9 + hlen;
+        }
+        _put16(buf + ext, p - ext - 2);
+
+        buf[hs + 1] = (char) ((p - hs - 4) >> 16);
+        _put16(buf + hs + 2, p - hs - 4);
+        _put16(buf + 3, p - 5);
+        return p;
+}
+
+
+static void
+test_sni(void)
+{
+        char buf[1024], name[DISPATCH_NAME_MAX];
+        size_t len = _hello(buf, "www.example.com");
+
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 15);
+        CHECK(strcmp(name, "www.example.com") == 0);
+
+        /* Trailing bytes of a next record change nothing. */
+        memcpy(buf + len, "\x17\x03\x03", 3);
+        CHECK(dispatch_tls_sni(buf, len + 3, name, sizeof(name)) == 15);
+
+        len = _hello(buf, NULL);
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 0);
+}
+
+
+static void
+test_truncated(void)
+{
+        char buf[1024], name[DISPATCH_NAME_MAX];
+        size_t len = _hello(buf, "www.example.com"), i;
+
+        for (i = 0; i < len; i++) {
+                int r = dispatch_tls_sni(buf, i, name, sizeof(name));
+
+                if (r != -EAGAIN) {
+                        fprintf(stderr, "cut at %zu: %d\n", i, r);
+                        CHECK(r == -EAGAIN);
+                }
+        }
+}
+
+
+static void
+test_malformed(void)
+{
+        char buf[1024], name[DISPATCH_NAME_MAX];
+        size_t len;
+
+        /* Not TLS at all. */
+        CHECK(dispatch_tls_sni("GET / HTTP/1.1\r\n", 16, name,
+                               sizeof(name)) == 0);
+        CHECK(dispatch_tls_sni("\x16\x02\x00\x00\x10", 5, name,
+                               sizeof(name)) == 0);
+
+        /* A handshake that is not a ClientHello. */
+        len = _hello(buf, "a.example.com");
+        buf[5] = 0x02;
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 0);
+
+        /* Extensions running past the record. */
+        len = _hello(buf, "a.example.com");
+        _put16(buf + 3, 80);
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 0);
+
+        /* A name running past its extension. */
+        len = _hello(buf, "a.example.com");
+        _put16(buf + len - 15, 200);
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 0);
+
+        /* An extension length running past the extensions. */
+        len = _hello(buf, "a.example.com");
+        _put16(buf + len - 20, 0xffff);
+        CHECK(dispatch_tls_sni(buf, len, name, sizeof(name)) == 0);
+
+        /* A name that does not fit the caller's buffer. */
+        len = _hello(buf, "a.example.com");
+        CHECK(dispatch_tls_sni(buf, len, name, 13) == 0);
+        CHECK(dispatch_tls_sni(buf, len, name, 14) == 13);
+}
+
+
+static void
+test_classify(void)
+{
+        static int wild, exact, magic, fallback;
+        struct dispatch *d = dispatch_create(&fallback, 0);
+        char buf[1024];
+        void *target = NULL;
+        size_t len;
+
+        CHECK(d != NULL);
+        if (!d)
+                return;
+        CHECK(dispatch_add(d, DISPATCH_MAGIC, "SSH-", 0, &magic) == 0);
+        CHECK(dispatch_add(d, DISPATCH_SNI, "*.example.com", 0, &wild) == 0);
+        CHECK(dispatch_add(d, DISPATCH_SNI, "exact.org", 0, &exact) == 0);
+
+        len = _hello(buf, "www.example.com");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &wild);
+
+        len = _hello(buf, "A.B.Example.COM");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &wild);
+
+        /* The wildcard wants a subdomain. */
+        len = _hello(buf, "example.com");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &fallback);
+        len = _hello(buf, "notexample.com");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &fallback);
+
+        len = _hello(buf, "EXACT.org");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &exact);
+        len = _hello(buf, "www.exact.org");
+        CHECK(dispatch_classify(d, buf, len, 0, &target) == 1);
+        CHECK(target == &fallback);
+
+        /* Cut short: wait, unless nothing more is coming. */
+        len = _hello(buf, "www.example.com");
+        target = NULL;
+        CHECK(dispatch_classify(d, buf, len - 1, 0, &target) == 0);
+        CHECK(target == NULL);
+        CHECK(dispatch_classify(d, buf, len - 1, 1, &target) == 1);
+        CHECK(target == &fallback);
+
+        CHECK(dispatch_classify(d, "SSH-2.0-x\r\n", 11, 0, &target) == 1);
+        CHECK(target == &magic);
+
+        CHECK(d->rules[1].hits == 2);
+        CHECK(d->rules[2].hits == 1);
+        CHECK(d->fallbacks == 4);
+        dispatch_free(d);
+}
+
+
+int
+main(void)
+{
+        test_sni();
+        test_truncated();
+        test_malformed();
+        test_classify();
+
+        if (failures) {
+                fprintf(stderr, "test_dispatch: %d failed.\n", failures);
+                return 1;
+        }
+        printf("test_dispatch: ok\n");
+        return 0;
+}
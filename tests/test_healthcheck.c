@@ -0,0 +1,124 @@
+/* Tests for the outlier ejection in healthcheck.c, which is included whole
+ * for its static functions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../healthcheck.c"
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__,        \
+                                __LINE__, #cond);                       \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+
+/*
+ * Set up <b>hc</b> over <b>n</b> upstreams whose connect latencies are
+ * <b>us</b>, all live and answering, without starting the prober.
+ * @return 0, or -1 on failure.
+ */
+static int
+_hc_fake(struct healthcheck *hc, unsigned int n, const double *us)
+{
+        static const char *const specs[] = {
+                "127.0.0.1:9001", "127.0.0.1:9002", "127.0.0.1:9003",
+                "127.0.0.1:9004", "127.0.0.1:9005", "127.0.0.1:9006",
+        };
+        unsigned int i;
+
+        memset(hc, 0, sizeof(*hc));
+        hc->bal = balancer_create(BAL_ROUND_ROBIN, specs, n);
+        hc->st = calloc(n, sizeof(*hc->st));
+        if (!hc->bal || !hc->st)
+                return -1;
+        for (i = 0; i < n; i++) {
+                hc->st[i].up = &hc->bal->ups[i];
+                hc->st[i].fd = -1;
+                hc->st[i].success = 1.0;
+                hc->st[i].latency_us = us[i];
+                hc->st[i].live_since = net_now_ns();
+        }
+        return 0;
+}
+
+
+static void
+_hc_unfake(struct healthcheck *hc)
+{
+        balancer_delete(hc->bal);
+        free(hc->st);
+}
+
+
+static void
+test_one_slow(void)
+{
+        static const double us[] = { 400.0, 450.0, 500.0, 20000.0 };
+        struct healthcheck hc;
+
+        CHECK(_hc_fake(&hc, 4, us) == 0);
+        _hc_evaluate(&hc);
+        CHECK(!hc.st[0].ejected && !hc.st[1].ejected && !hc.st[2].ejected);
+        CHECK(hc.st[3].ejected);
+        CHECK(!hc.bal->ups[3].live);
+        _hc_unfake(&hc);
+}
+
+
+static void
+test_spread(void)
+{
+        /* Slower, but within the others' spread, or not by enough to
+         * matter. */
+        static const double wide[] = { 1000.0, 5000.0, 9000.0, 10000.0 };
+        static const double close[] = { 400.0, 400.0, 400.0, 1300.0 };
+        struct healthcheck hc;
+        unsigned int i;
+
+        CHECK(_hc_fake(&hc, 4, wide) == 0);
+        _hc_evaluate(&hc);
+        for (i = 0; i < 4; i++)
+                CHECK(!hc.st[i].ejected);
+        _hc_unfake(&hc);
+
+        CHECK(_hc_fake(&hc, 4, close) == 0);
+        _hc_evaluate(&hc);
+        for (i = 0; i < 4; i++)
+                CHECK(!hc.st[i].ejected);
+        _hc_unfake(&hc);
+}
+
+
+static void
+test_too_few_peers(void)
+{
+        static const double us[] = { 400.0, 450.0, 20000.0 };
+        struct healthcheck hc;
+
+        CHECK(_hc_fake(&hc, 3, us) == 0);
+        _hc_evaluate(&hc);
+        CHECK(!hc.st[2].ejected);
+        _hc_unfake(&hc);
+}
+
+
+int
+main(void)
+{
+        test_one_slow();
+        test_spread();
+        test_too_few_peers();
+
+        if (failures) {
+                fprintf(stderr, "test_healthcheck: %d failed.\n", failures);
+                return 1;
+        }
+        printf("test_healthcheck: ok\n");
+        return 0;
+}
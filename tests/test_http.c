@@ -0,0 +1,277 @@
+/* Tests for the request head parsing and pipelining in httpserve.c, which
+ * is included whole for its static functions. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+
+#include "../httpserve.c"
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__,        \
+                                __LINE__, #cond);                       \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+
+/* @return what _http_parse() makes of the head <b>s</b>, into <b>req</b>;
+ * NULL when it is accepted. */
+static const char *
+_parse(const char *s, struct _http_req *req)
+{
+        return _http_parse(s, strlen(s), req);
+}
+
+
+/* @return whether <b>refusal</b> carries the status <b>code</b>. */
+static int
+_refused(const char *refusal, const char *code)
+{
+        return refusal && strncmp(refusal + 9, code, 3) == 0;
+}
+
+
+static void
+test_head_end(void)
+{
+        static const char crlf[] = "GET / HTTP/1.1\r\nHost: a\r\n\r\nGET";
+        static const char lf[] = "GET / HTTP/1.1\nHost: a\n\nGET";
+        static const char mixed[] = "GET / HTTP/1.1\r\nHost: a\n\r\n";
+
+        CHECK(_http_head_end(crlf, 0, sizeof(crlf) - 1) == 27);
+        CHECK(_http_head_end(lf, 0, sizeof(lf) - 1) == 24);
+        CHECK(_http_head_end(mixed, 0, sizeof(mixed) - 1) ==
+              sizeof(mixed) - 1);
+
+        /* Not there yet, wherever the head is cut. */
+        CHECK(_http_head_end(crlf, 0, 26) == 0);
+        CHECK(_http_head_end(crlf, 0, 25) == 0);
+        CHECK(_http_head_end(lf, 0, 23) == 0);
+        /* Resuming two bytes back still finds it. */
+        CHECK(_http_head_end(crlf, 24, 27) == 27);
+        CHECK(_http_head_end(lf, 21, 24) == 24);
+}
+
+
+static void
+test_parse(void)
+{
+        struct _http_req req;
+
+        CHECK(_parse("GET / HTTP/1.1\r\nHost: a\r\n\r\n", &req) == NULL);
+        CHECK(req.keep_alive && !req.http10 && !req.head_only);
+        CHECK(req.body == 0);
+
+        CHECK(_parse("GET / HTTP/1.0\r\n\r\n", &req) == NULL);
+        CHECK(!req.keep_alive && req.http10);
+        CHECK(_parse("GET / HTTP/1.0\nConnection: Keep-Alive\n\n",
+                     &req) == NULL);
+        CHECK(req.keep_alive && req.http10);
+        CHECK(_parse("GET / HTTP/1.1\nconnection:close\n\n", &req) == NULL);
+        CHECK(!req.keep_alive);
+
+        CHECK(_parse("HEAD /x HTTP/1.1\r\n\r\n", &req) == NULL);
+        CHECK(req.head_only);
+
+        CHECK(_parse("POST / HTTP/1.1\r\nContent-Length:  42 \r\n\r\n",
+                     &req) == NULL);
+        CHECK(req.body == 42);
+}
+
+
+static void
+test_refusals(void)
+{
+        struct _http_req req;
+        char head[128];
+
+        CHECK(_refused(_parse("GET /\r\n\r\n", &req), "400"));
+        CHECK(_refused(_parse(" / HTTP/1.1\r\n\r\n", &req), "400"));
+        CHECK(_refused(_parse("GET / HTTP/2.0\r\n\r\n", &req), "400"));
+        CHECK(_refused(_parse("GET / HTTP/1.2\r\n\r\n", &req), "505"));
+        CHECK(_refused(_parse("GET / HTTP/1.1\r\nHost a\r\n\r\n", &req),
+                       "400"));
+
+        CHECK(_refused(_parse("POST / HTTP/1.1\r\nContent-Length:\r\n\r\n",
+                              &req), "400"));
+        CHECK(_refused(_parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n"
+                              "\r\n", &req), "400"));
+        CHECK(_refused(_parse("POST / HTTP/1.1\r\nContent-Length: 1 2\r\n"
+                              "\r\n", &req), "400"));
+
+        /* The largest length that fits is fine; one more digit is not. */
+        snprintf(head, sizeof(head), "POST / HTTP/1.1\r\n"
+                 "Content-Length: %zu\r\n\r\n", (size_t) -1 / 10);
+        CHECK(_parse(head, &req) == NULL);
+        CHECK(req.body == (size_t) -1 / 10);
+        snprintf(head, sizeof(head), "POST / HTTP/1.1\r\n"
+                 "Content-Length: %zu0\r\n\r\n", (size_t) -1);
+        CHECK(_refused(_parse(head, &req), "400"));
+        CHECK(_refused(_parse("POST / HTTP/1.1\r\nContent-Length: "
+                              "99999999999999999999999999\r\n\r\n", &req),
+                       "400"));
+
+        CHECK(_refused(_parse("POST / HTTP/1.1\r\n"
+                              "Transfer-Encoding: chunked\r\n\r\n", &req),
+                       "501"));
+}
+
+
+struct _writer {
+        int fd;
+        /* Pieces to send, a pause between each. */
+        const char *pieces[8];
+};
+
+static void *
+_write_pieces(void *arg)
+{
+        struct _writer *w = arg;
+        int i;
+
+        for (i = 0; w->pieces[i]; i++) {
+                if (i)
+                        usleep(20000);
+                if (write(w->fd, w->pieces[i], strlen(w->pieces[i])) < 0)
+                        break;
+        }
+        shutdown(w->fd, SHUT_WR);
+        return NULL;
+}
+
+
+/*
+ * Feed <b>w</b>'s pieces to http_handler() and collect what it answers in
+ * <b>out</b>.
+ * @return the handler's return value.
+ */
+static int
+_serve(struct http_responder *r, struct _writer *w, char *out, size_t size)
+{
+        pthread_t t;
+        ssize_t n;
+        size_t len = 0;
+        int sv[2], err;
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+                return -2;
+        w->fd = sv[1];
+        pthread_create(&t, NULL, &_write_pieces, w);
+        err = http_handler(r, sv[0]);
+        shutdown(sv[0], SHUT_WR);
+        pthread_join(t, NULL);
+        while (len < size - 1 &&
+               (n = read(sv[1], out + len, size - 1 - len)) > 0)
+                len += (size_t) n;
+        out[len] = '\0';
+        close(sv[0]);
+        close(sv[1]);
+        return err;
+}
+
+
+/* @return how many times <b>what</b> occurs in <b>s</b>. */
+static int
+_count(const char *s, const char *what)
+{
+        int n = 0;
+
+        while ((s = strstr(s, what)) != NULL) {
+                n++;
+                s += strlen(what);
+        }
+        return n;
+}
+
+
+static void
+test_pipelining(void)
+{
+        struct http_responder *r = http_responder_create("hi", 2, NULL);
+        struct _writer w;
+        static char out[65536], big[HTTP_REQ_MAX + 1];
+
+        CHECK(r != NULL);
+        if (!r)
+                return;
+
+        /* Three at once, answered in one go. */
+        memset(&w, 0, sizeof(w));
+        w.pieces[0] = "GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n\r\n"
+                      "GET / HTTP/1.1\r\n\r\n";
+        CHECK(_serve(r, &w, out, sizeof(out)) == 0);
+        CHECK(_count(out, "HTTP/1.1 200 OK") == 3);
+
+        /* Heads split in the request line, and between the CR and LF of
+         * the blank line, and ending lines with bare LFs. */
+        memset(&w, 0, sizeof(w));
+        w.pieces[0] = "GET / HT";
+        w.pieces[1] = "TP/1.1\r\nHost: a\r\n\r";
+        w.pieces[2] = "\nGET / HTTP/1.1\n";
+        w.pieces[3] = "\nHEAD / HTTP/1.1\r\n\r\n";
+        CHECK(_serve(r, &w, out, sizeof(out)) == 0);
+        CHECK(_count(out, "HTTP/1.1 200 OK") == 3);
+        CHECK(_count(out, "\r\n\r\nhi") == 2);
+
+        /* Bodies are skipped, even when they arrive in pieces, and blank
+         * lines between requests are ignored. */
+        memset(&w, 0, sizeof(w));
+        w.pieces[0] = "POST / HTTP/1.1\r\nContent-Length: 10\r\n\r\n01234";
+        w.pieces[1] = "56789\r\nGET / HTTP/1.1\r\n\r\n";
+        CHECK(_serve(r, &w, out, sizeof(out)) == 0);
+        CHECK(_count(out, "HTTP/1.1 200 OK") == 2);
+
+        /* A refusal ends the connection after what came before it. */
+        memset(&w, 0, sizeof(w));
+        w.pieces[0] = "GET / HTTP/1.1\r\n\r\nPOST / HTTP/1.1\r\n"
+                      "Transfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n"
+                      "0\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+        CHECK(_serve(r, &w, out, sizeof(out)) == -1);
+        CHECK(_count(out, "HTTP/1.1 200 OK") == 1);
+        CHECK(_count(out, "HTTP/1.1 501") == 1);
+        CHECK(strstr(out, "501") > strstr(out, "200 OK"));
+
+        /* Connection: close is the last one answered. */
+        memset(&w, 0, sizeof(w));
+        w.pieces[0] = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n"
+                      "GET / HTTP/1.1\r\n\r\n";
+        CHECK(_serve(r, &w, out, sizeof(out)) == 0);
+        CHECK(_count(out, "HTTP/1.1 200 OK") == 1);
+        CHECK(_count(out, "Connection: close") == 1);
+
+        /* A head that never ends. */
+        memset(&w, 0, sizeof(w));
+        memset(big, 'x', sizeof(big) - 1);
+        w.pieces[0] = "GET / HTTP/1.1\r\nX: ";
+        w.pieces[1] = big;
+        CHECK(_serve(r, &w, out, sizeof(out)) == -1);
+        CHECK(_count(out, "HTTP/1.1 431") == 1);
+
+        CHECK(r->requests == 10);
+        http_responder_delete(r);
+}
+
+
+int
+main(void)
+{
+        test_head_end();
+        test_parse();
+        test_refusals();
+        test_pipelining();
+
+        if (failures) {
+                fprintf(stderr, "test_http: %d failed.\n", failures);
+                return 1;
+        }
+        printf("test_http: ok\n");
+        return 0;
+}
@@ -0,0 +1,158 @@
+/* Tests for the MSG_ZEROCOPY path that net_write() takes through a batch. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../net/net_util.h"
+#include "../net/net_compat.h"
+#include "../net/net_zerocopy.h"
+
+static int failures;
+
+#define CHECK(cond) do {                                                \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__,        \
+                                __LINE__, #cond);                       \
+                        failures++;                                     \
+                }                                                       \
+        } while (0)
+
+
+/* Connect <b>sv</b> over TCP on the loopback, where zerocopy sends are
+ * completed like anywhere else, if copied.  @return 0, or -1 on failure. */
+static int
+_tcp_pair(int sv[2])
+{
+        struct sockaddr_in sin;
+        socklen_t len = sizeof(sin);
+        int l;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        l = socket(AF_INET, SOCK_STREAM, 0);
+        if (l < 0 || bind(l, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+            listen(l, 1) < 0 ||
+            getsockname(l, (struct sockaddr *) &sin, &len) < 0)
+                return -1;
+        sv[0] = net_socket_nonblocking(AF_INET, SOCK_STREAM, 0);
+        if (sv[0] < 0)
+                return -1;
+        connect(sv[0], (struct sockaddr *) &sin, sizeof(sin));
+        sv[1] = accept(l, NULL, NULL);
+        close(l);
+        return sv[1] < 0 ? -1 : 0;
+}
+
+
+struct _reader {
+        int fd;
+        size_t got;
+};
+
+static void *
+_read_all(void *arg)
+{
+        struct _reader *rd = arg;
+        char buf[65536];
+        ssize_t n;
+
+        while ((n = read(rd->fd, buf, sizeof(buf))) > 0)
+                rd->got += (size_t) n;
+        return NULL;
+}
+
+
+/* @return how many buffers sit in <b>pool</b>'s free list. */
+static unsigned int
+_pool_free(struct net_zc_pool *pool)
+{
+        struct net_zc_buf *buf;
+        unsigned int n = 0;
+
+        for (buf = pool->free; buf; buf = buf->next)
+                n++;
+        return n;
+}
+
+
+static void
+test_reaped(void)
+{
+        static char big[256 * 1024];
+        struct net_zc_pool pool;
+        struct net_batch *b;
+        struct _reader rd;
+        pthread_t t;
+        int sv[2], i;
+
+        CHECK(net_zc_pool_init(&pool, 64 * 1024, 8) == 0);
+        CHECK(_tcp_pair(sv) == 0);
+        b = net_batch_new(sv[0]);
+        CHECK(b != NULL);
+        if (!b)
+                return;
+        CHECK(net_batch_zerocopy(b, &pool, 0) == 0);
+        rd.fd = sv[1];
+        rd.got = 0;
+        pthread_create(&t, NULL, &_read_all, &rd);
+
+        memset(big, 'z', sizeof(big));
+        net_batch_set(b);
+        /* Small writes are still only held... */
+        CHECK(net_write(sv[0], "hello", 5) == 5);
+        CHECK(b->len == 5);
+        CHECK(b->zc->next_id == 0);
+        /* ... and large ones push them out from pooled buffers, more than
+         * the pool holds in all. */
+        for (i = 0; i < 4; i++)
+                CHECK(net_write(sv[0], big, sizeof(big)) == sizeof(big));
+        CHECK(b->len == 0);
+        CHECK(net_flush(sv[0], 0) == 0);
+        net_batch_set(NULL);
+
+        if (b->zc->enabled) {
+                CHECK(b->zc->next_id > 0);
+                /* Every send is completed once the peer has it all. */
+                for (i = 0; i < 200 && b->zc->npinned; i++) {
+                        poll(NULL, 0, 10);
+                        net_zc_reap(b->zc);
+                }
+                CHECK(b->zc->npinned == 0);
+                CHECK(_pool_free(&pool) == pool.nalloc);
+                CHECK(pool.nalloc > 0 && pool.nalloc <= 8);
+        } else {
+                printf("test_zerocopy: no SO_ZEROCOPY, copies only.\n");
+        }
+
+        net_batch_free(b);
+        shutdown(sv[0], SHUT_WR);
+        pthread_join(t, NULL);
+        CHECK(rd.got == 5 + 4 * sizeof(big));
+        CHECK(_pool_free(&pool) == pool.nalloc);
+        close(sv[0]);
+        close(sv[1]);
+        net_zc_pool_destroy(&pool);
+}
+
+
+int
+main(void)
+{
+        test_reaped();
+
+        if (failures) {
+                fprintf(stderr, "test_zerocopy: %d failed.\n", failures);
+                return 1;
+        }
+        printf("test_zerocopy: ok\n");
+        return 0;
+}
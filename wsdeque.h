@@ -0,0 +1,164 @@
+/* Chase-Lev work-stealing deque.
+ *
+ * The owning thread pushes and takes at the bottom without locks; any other
+ * thread may steal from the top.  A compare-and-swap on top decides who
+ * gets the last element, so every element is handed to exactly one thread.
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013). */
+
+#ifndef _WSDEQUE_H
+#define _WSDEQUE_H
+
+#include <stdlib.h>
+
+#define WS_INITIAL_SIZE 64
+
+/* Returned by ws_steal() when it lost a race; the deque may not be empty. */
+#define WS_ABORT ((void *) -1)
+
+struct ws_array {
+        long size;
+        /* Arrays replaced by a resize are kept until ws_delete(), since a
+         * thief may still be reading them. */
+        struct ws_array *retired;
+        void *buf[];
+};
+
+struct ws_deque {
+        long top;
+        /* Keep the thieves' cache line away from the owner's. */
+        char pad[64 - sizeof(long)];
+        long bottom;
+        struct ws_array *array;
+};
+
+static inline struct ws_array *
+_ws_array_new(long size)
+{
+        struct ws_array *a;
+
+        a = malloc(sizeof(*a) + (size_t) size * sizeof(void *));
+        if (a) {
+                a->size = size;
+                a->retired = NULL;
+        }
+        return a;
+}
+
+/* Returns 0 on success and -1 if unable to allocate. */
+static inline int
+ws_init(struct ws_deque *q)
+{
+        q->top = 0;
+        q->bottom = 0;
+        q->array = _ws_array_new(WS_INITIAL_SIZE);
+        return q->array ? 0 : -1;
+}
+
+/* Frees the deque's arrays; no thread may be using it. */
+static inline void
+ws_delete(struct ws_deque *q)
+{
+        struct ws_array *a = q->array, *next;
+
+        for (; a; a = next) {
+                next = a->retired;
+                free(a);
+        }
+        q->array = NULL;
+}
+
+/* Approximate number of elements, for load heuristics. */
+static inline long
+ws_size(struct ws_deque *q)
+{
+        long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+        return b > t ? b - t : 0;
+}
+
+/* Owner only.  Returns 0 on success and -1 if unable to grow. */
+static inline int
+ws_push(struct ws_deque *q, void *x)
+{
+        long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+        struct ws_array *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+
+        if (b - t > a->size - 1) {
+                struct ws_array *bigger = _ws_array_new(a->size * 2);
+                long i;
+
+                if (!bigger)
+                        return -1;
+                for (i = t; i < b; i++)
+                        bigger->buf[i & (bigger->size - 1)] =
+                                a->buf[i & (a->size - 1)];
+                bigger->retired = a;
+                __atomic_store_n(&q->array, bigger, __ATOMIC_RELEASE);
+                a = bigger;
+        }
+        __atomic_store_n(&a->buf[b & (a->size - 1)], x, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/* Owner only.  Returns the most recently pushed element, or NULL. */
+static inline void *
+ws_take(struct ws_deque *q)
+{
+        long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+        struct ws_array *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+        long t;
+        void *x = NULL;
+
+        __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+        if (t <= b) {
+                x = __atomic_load_n(&a->buf[b & (a->size - 1)],
+                                    __ATOMIC_RELAXED);
+                if (t == b) {
+                        /* Last element; race the thieves for it. */
+                        if (!__atomic_compare_exchange_n(&q->top, &t, t + 1,
+                                        0, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED))
+                                x = NULL;
+                        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+                }
+        } else {
+                __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return x;
+}
+
+/* Any thread.  Returns the oldest element, NULL if empty, or WS_ABORT if
+ * another thread got there first. */
+static inline void *
+ws_steal(struct ws_deque *q)
+{
+        long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+        long b;
+        void *x = NULL;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+        if (t < b) {
+                struct ws_array *a = __atomic_load_n(&q->array,
+                                                     __ATOMIC_ACQUIRE);
+
+                x = __atomic_load_n(&a->buf[t & (a->size - 1)],
+                                    __ATOMIC_RELAXED);
+                if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+                                                 __ATOMIC_SEQ_CST,
+                                                 __ATOMIC_RELAXED))
+                        return WS_ABORT;
+        }
+        return x;
+}
+
+#endif